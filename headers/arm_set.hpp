@@ -0,0 +1,197 @@
+#ifndef ARM_SET_H_
+#define ARM_SET_H_
+
+#include <armadillo>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+/**
+ *  \brief Compacted state of the arms of a bandit race.
+ *
+ *  The estimate, confidence bounds and sample count of every arm are stored
+ *  contiguously, permuted so that the arms still in the race form a prefix.
+ *  Computing an arm exactly or eliminating it moves it behind that prefix, so
+ *  a sampling round only touches the live arms and costs O(live arms)
+ *  instead of O(arms). The prefix is compacted stably: live arms stay in
+ *  increasing order, as arma::find would return them.
+ *
+ *  Arms are identified by their index at ArmSet::reset, which is also the
+ *  index used to look up their dispersion.
+ */
+class ArmSet {
+  public:
+    /*! \brief Puts all n_arms arms back in the race with no samples */
+    void reset(size_t n_arms) {
+        ids.set_size(n_arms);
+        for (size_t a = 0; a < n_arms; a++) {
+            ids(a) = a;
+        }
+        estimates.zeros(n_arms);
+        lcbs.zeros(n_arms);
+        ucbs.zeros(n_arms);
+        samples.zeros(n_arms);
+        live = n_arms;
+        retiredUcb = std::numeric_limits<double>::infinity();
+    }
+
+    /*! \brief Returns the number of arms still in the race */
+    size_t size() const {
+        return live;
+    }
+
+    /*! \brief Returns the arms still in the race */
+    arma::uvec liveArms() const {
+        return live > 0 ? arma::uvec(ids.head(live)) : arma::uvec();
+    }
+
+    /*! \brief Computes exactly the live arms that would reach N samples
+     *
+     *  Live arms whose sample count reaches N with the next batch are
+     *  evaluated on every reference point and leave the race with their
+     *  exact value as estimate and bounds.
+     *
+     *  @param batch Size of the next sampling batch
+     *  @param N Number of reference points
+     *  @param compute Returns the exact value of each of the given arms
+     *  @return Number of arms computed exactly
+     */
+    template <typename Compute>
+    size_t resolveExact(size_t batch, size_t N, Compute compute) {
+        std::vector<arma::uword> exact;
+        for (size_t p = 0; p < live; p++) {
+            if (samples(p) + batch >= N) {
+                exact.push_back(p);
+            }
+        }
+        if (exact.empty()) {
+            return 0;
+        }
+        const arma::uvec positions(exact);
+        const auto result = compute(arma::uvec(ids.elem(positions)));
+        for (size_t i = 0; i < positions.n_elem; i++) {
+            const size_t p = positions(i);
+            estimates(p) = result(i);
+            lcbs(p) = result(i);
+            ucbs(p) = result(i);
+            samples(p) += N;
+        }
+        // live arms have fewer than N samples
+        compact([&](size_t p) { return samples(p) < N; });
+        return positions.n_elem;
+    }
+
+    /*! \brief Samples every live arm once more and narrows its bounds
+     *
+     *  @param batch Number of reference points sampled
+     *  @param sigma Dispersion of each arm, indexed by arm
+     *  @param log_p Logarithm of the reciprocal of the error probability
+     *  @param compute Returns the mean over batch reference points of each
+     *  of the given arms
+     */
+    template <typename Compute>
+    void sample(size_t batch, const arma::Mat<double>& sigma, double log_p, Compute compute) {
+        if (live == 0) {
+            return;
+        }
+        const auto result = compute(liveArms());
+        for (size_t p = 0; p < live; p++) {
+            estimates(p) = (samples(p) * estimates(p) + result(p) * batch) / (samples(p) + batch);
+            samples(p) += batch;
+            const double cb_delta = sigma(ids(p)) * std::sqrt(log_p / samples(p));
+            ucbs(p) = estimates(p) + cb_delta;
+            lcbs(p) = estimates(p) - cb_delta;
+        }
+    }
+
+    /*! \brief Returns the lowest upper bound of all arms, live or not */
+    double minUcb() const {
+        double bound = retiredUcb;
+        for (size_t p = 0; p < live; p++) {
+            bound = std::min(bound, ucbs(p));
+        }
+        return bound;
+    }
+
+    /*! \brief Eliminates the live arms whose lower bound is not below bound */
+    void prune(double bound) {
+        compact([&](size_t p) { return lcbs(p) < bound; });
+    }
+
+    /*! \brief Returns the arm of lowest lower bound, ties to the lowest arm */
+    arma::uword best() const {
+        size_t best_p = 0;
+        for (size_t p = 1; p < ids.n_elem; p++) {
+            if (lcbs(p) < lcbs(best_p) || (lcbs(p) == lcbs(best_p) && ids(p) < ids(best_p))) {
+                best_p = p;
+            }
+        }
+        return ids(best_p);
+    }
+
+    /*! \brief Returns among the given first positions the sampled arm of
+     *  lowest estimate whose upper bound is below bound, or -1 if none is
+     *
+     *  @param bound Upper bound an arm has to be below
+     *  @param n_positions Number of leading positions searched; these are
+     *  the arms live at the start of the round
+     */
+    arma::sword bestBelow(double bound, size_t n_positions) const {
+        arma::sword best_p = -1;
+        for (size_t p = 0; p < n_positions; p++) {
+            if (samples(p) > 0 && ucbs(p) < bound &&
+                (best_p < 0 || estimates(p) < estimates(best_p) ||
+                 (estimates(p) == estimates(best_p) && ids(p) < ids(best_p)))) {
+                best_p = p;
+            }
+        }
+        return best_p < 0 ? -1 : arma::sword(ids(best_p));
+    }
+
+  private:
+    /*! \brief Moves the live arms failing keep behind the live prefix,
+     *  keeping the order of the others
+     */
+    template <typename Keep>
+    void compact(Keep keep) {
+        size_t kept = 0;
+        for (size_t p = 0; p < live; p++) {
+            if (keep(p)) {
+                if (kept != p) {
+                    swapArms(kept, p);
+                }
+                kept++;
+            } else {
+                retiredUcb = std::min(retiredUcb, ucbs(p));
+            }
+        }
+        live = kept;
+    }
+
+    /*! \brief Exchanges the state stored at positions a and b */
+    void swapArms(size_t a, size_t b) {
+        std::swap(ids(a), ids(b));
+        std::swap(estimates(a), estimates(b));
+        std::swap(lcbs(a), lcbs(b));
+        std::swap(ucbs(a), ucbs(b));
+        std::swap(samples(a), samples(b));
+    }
+
+    arma::uvec ids; ///< arm stored at each position; live arms come first
+
+    arma::vec estimates; ///< running mean of the sampled values of each arm
+
+    arma::vec lcbs; ///< lower confidence bound of each arm
+
+    arma::vec ucbs; ///< upper confidence bound of each arm
+
+    arma::vec samples; ///< number of reference points sampled for each arm
+
+    size_t live = 0; ///< number of arms still in the race
+
+    double retiredUcb = std::numeric_limits<double>::infinity(); ///< lowest upper bound of the arms out of the race
+};
+
+#endif // ARM_SET_H_
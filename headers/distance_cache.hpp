@@ -0,0 +1,290 @@
+#ifndef DISTANCE_CACHE_H_
+#define DISTANCE_CACHE_H_
+
+#include "distances.hpp"
+
+#include <armadillo>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ *  \brief Bounded, lock-free cache of pairwise distances.
+ *
+ *  Fixed size hash table keyed by the unordered pair of datapoint indices. The
+ *  table is split into 4-way set associative buckets that each fill one cache
+ *  line; a new entry evicts a slot of its bucket chosen from its hash, so the
+ *  memory used never exceeds the byte budget given at construction.
+ *
+ *  Reads never block or write shared state: a slot is read as key, value,
+ *  key and the read only counts as a hit if the key is unchanged. Writers
+ *  claim a slot with a compare-and-swap and skip the insertion if another
+ *  thread holds it. Hits and misses are counted by the callers, once per
+ *  block, into per-thread shards on separate cache lines.
+ */
+class DistanceCache {
+  public:
+    /*! \brief Creates an empty cache using at most bytes of memory
+     *
+     *  @param bytes Byte budget of the table; at least one bucket is allocated
+     */
+    explicit DistanceCache(size_t bytes) {
+        size_t n = 1;
+        while (2 * n * sizeof(Bucket) <= bytes) {
+            n *= 2;
+        }
+        n_buckets = n;
+        void* mem = nullptr;
+        if (posix_memalign(&mem, sizeof(Bucket), n_buckets * sizeof(Bucket)) != 0) {
+            throw std::bad_alloc();
+        }
+        buckets.reset(static_cast<Bucket*>(mem));
+        // zero every slot (the empty key) in parallel, so the pages are
+        // first touched by the threads that will use them
+        char* bytes_mem = static_cast<char*>(mem);
+        const size_t chunk = size_t(1) << 20;
+#pragma omp parallel for
+        for (size_t start = 0; start < n_buckets * sizeof(Bucket); start += chunk) {
+            std::memset(bytes_mem + start, 0, std::min(chunk, n_buckets * sizeof(Bucket) - start));
+        }
+    }
+
+    DistanceCache(const DistanceCache&) = delete;
+
+    DistanceCache& operator=(const DistanceCache&) = delete;
+
+    /*! \brief Looks up the distance between datapoints i and j
+     *
+     *  Does not count the lookup; see DistanceCache::count.
+     *
+     *  @param i Index of the first datapoint
+     *  @param j Index of the second datapoint
+     *  @param distance Set to the cached distance on a hit
+     *  @return Whether the distance was cached
+     */
+    inline bool lookup(arma::uword i, arma::uword j, double& distance) const {
+        const uint64_t key = pairKey(i, j);
+        const Bucket& bucket = buckets[hash(key) & (n_buckets - 1)];
+        for (int s = 0; s < ways; s++) {
+            const Slot& slot = bucket.slots[s];
+            if (slot.key.load(std::memory_order_acquire) != key) {
+                continue;
+            }
+            const uint64_t bits = slot.value.load(std::memory_order_acquire);
+            // a writer replacing the slot in between changes the key
+            if (slot.key.load(std::memory_order_acquire) == key) {
+                std::memcpy(&distance, &bits, sizeof(double));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*! \brief Adds lookups of the calling thread to the statistics */
+    inline void count(size_t hits, size_t misses) const {
+        Shard& shard = shards[thread_slot() & (n_shards - 1)];
+        shard.hits.fetch_add(hits, std::memory_order_relaxed);
+        shard.misses.fetch_add(misses, std::memory_order_relaxed);
+    }
+
+    /*! \brief Stores the distance between datapoints i and j
+     *
+     *  Prefers an empty slot of the bucket, otherwise evicts one. The insertion
+     *  is dropped when another thread is writing the chosen slot.
+     *
+     *  @param i Index of the first datapoint
+     *  @param j Index of the second datapoint
+     *  @param distance Distance between the two datapoints
+     */
+    inline void insert(arma::uword i, arma::uword j, double distance) {
+        const uint64_t key = pairKey(i, j);
+        const uint64_t h = hash(key);
+        Bucket& bucket = buckets[h & (n_buckets - 1)];
+        Slot* victim = &bucket.slots[(h >> 32) & (ways - 1)];
+        for (int s = 0; s < ways; s++) {
+            if (bucket.slots[s].key.load(std::memory_order_relaxed) == empty) {
+                victim = &bucket.slots[s];
+                break;
+            }
+        }
+        uint64_t previous = victim->key.load(std::memory_order_relaxed);
+        if (previous == locked ||
+            !victim->key.compare_exchange_strong(previous, locked, std::memory_order_acquire)) {
+            return;
+        }
+        uint64_t bits;
+        std::memcpy(&bits, &distance, sizeof(double));
+        victim->value.store(bits, std::memory_order_release);
+        victim->key.store(key, std::memory_order_release);
+    }
+
+    /*! \brief Returns the number of lookups that found their distance */
+    size_t hits() const {
+        size_t total = 0;
+        for (int s = 0; s < n_shards; s++) {
+            total += shards[s].hits.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /*! \brief Returns the number of lookups that did not find their distance */
+    size_t misses() const {
+        size_t total = 0;
+        for (int s = 0; s < n_shards; s++) {
+            total += shards[s].misses.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+  private:
+    static const int ways = 4; ///< slots per bucket
+
+    static const int n_shards = 64; ///< number of statistics shards, a power of two
+
+    static const uint64_t empty = 0; ///< key of a slot never written
+
+    static const uint64_t locked = ~uint64_t(0); ///< key of a slot being written
+
+    struct Slot {
+        std::atomic<uint64_t> key;   ///< pairKey of the cached pair, empty or locked
+        std::atomic<uint64_t> value; ///< bits of the cached distance
+    };
+
+    struct alignas(64) Bucket {
+        Slot slots[ways];
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<size_t> hits{0};
+        std::atomic<size_t> misses{0};
+    };
+
+    /*! \brief Key of the unordered pair (i, j); never equal to empty or locked */
+    static inline uint64_t pairKey(arma::uword i, arma::uword j) {
+        if (i > j) {
+            std::swap(i, j);
+        }
+        return ((uint64_t(i) << 32) | uint64_t(j)) + 1;
+    }
+
+    /*! \brief splitmix64 finalizer */
+    static inline uint64_t hash(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    struct FreeDeleter {
+        void operator()(Bucket* p) const { std::free(p); }
+    };
+
+    size_t n_buckets; ///< number of buckets, a power of two
+
+    std::unique_ptr<Bucket[], FreeDeleter> buckets; ///< the table
+
+    mutable Shard shards[n_shards]; ///< lookup statistics of each thread slot
+};
+
+/**
+ *  \brief Distance policy adapter that memoizes another policy.
+ *
+ *  Every distance evaluated through the adapter is looked up in a
+ *  DistanceCache first and stored there on a miss, so the distances the
+ *  build and swap steps evaluate repeatedly (e.g. from every point to the
+ *  current medoids) are only computed once while they stay cached.
+ *
+ *  Blocks are filled from the cache where possible. When most of a block is
+ *  missing the wrapped policy's batched block is used for the whole block;
+ *  otherwise only the missing entries are computed.
+ */
+template <typename Distance>
+struct CachedDistance {
+    const Distance& lossFn; ///< wrapped distance policy
+
+    DistanceCache* cache; ///< cache shared by every thread of the fit
+
+    CachedDistance(const Distance& lossFn, DistanceCache& cache)
+      : lossFn(lossFn), cache(&cache) {}
+
+    template <typename T>
+    inline double operator()(const T& data, arma::uword i, arma::uword j) const {
+        double distance;
+        if (cache->lookup(i, j, distance)) {
+            cache->count(1, 0);
+        } else {
+            distance = lossFn(data, i, j);
+            cache->insert(i, j, distance);
+            cache->count(0, 1);
+        }
+        return distance;
+    }
+
+    template <typename T>
+    void block(
+      const T& data,
+      const arma::uvec& rows,
+      const arma::uvec& cols,
+      arma::Mat<typename T::elem_type>& out) const
+    {
+        out.set_size(rows.n_elem, cols.n_elem);
+        // entries found in the cache; any value, NaN included, may be cached
+        std::vector<char> found(out.n_elem);
+        size_t missing = 0;
+#pragma omp parallel reduction(+:missing)
+        {
+            size_t hits = 0;
+            size_t misses = 0;
+#pragma omp for
+            for (arma::uword b = 0; b < cols.n_elem; b++) {
+                for (arma::uword a = 0; a < rows.n_elem; a++) {
+                    double distance;
+                    const bool hit = cache->lookup(rows(a), cols(b), distance);
+                    found[b * rows.n_elem + a] = hit;
+                    if (hit) {
+                        out(a, b) = distance;
+                        hits++;
+                    } else {
+                        misses++;
+                    }
+                }
+            }
+            cache->count(hits, misses);
+            missing += misses;
+        }
+        if (missing == 0) {
+            return;
+        }
+        if (2 * missing > out.n_elem) {
+            lossFn.block(data, rows, cols, out);
+#pragma omp parallel for
+            for (arma::uword b = 0; b < cols.n_elem; b++) {
+                for (arma::uword a = 0; a < rows.n_elem; a++) {
+                    if (!found[b * rows.n_elem + a]) {
+                        cache->insert(rows(a), cols(b), out(a, b));
+                    }
+                }
+            }
+            return;
+        }
+#pragma omp parallel for
+        for (arma::uword b = 0; b < cols.n_elem; b++) {
+            for (arma::uword a = 0; a < rows.n_elem; a++) {
+                if (!found[b * rows.n_elem + a]) {
+                    const double distance = lossFn(data, rows(a), cols(b));
+                    cache->insert(rows(a), cols(b), distance);
+                    out(a, b) = distance;
+                }
+            }
+        }
+    }
+};
+
+#endif // DISTANCE_CACHE_H_
@@ -0,0 +1,482 @@
+#ifndef DISTANCES_H_
+#define DISTANCES_H_
+
+#include "simd_kernels.hpp"
+
+#include <armadillo>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+/**
+ *  \brief Loss functions supported by KMedoids::fit
+ *
+ *  Identifies which distance policy the BanditPAM engine is instantiated with.
+ *  Chosen by KMedoids::setLossFn from the user's loss string.
+ */
+enum class LossType {
+    L1,   ///< "L1" or "manhattan"
+    L2,   ///< "L2"
+    LP,   ///< "L<p>" for any other integer p
+    LINF, ///< "inf"
+    COS,  ///< "cos"
+    PRECOMPUTED ///< "precomputed", the input is a dissimilarity matrix
+};
+
+/**
+ *  \brief Evaluates a block of distances one pair at a time
+ *
+ *  Fills out(a, b) with the distance between datapoints rows(a) and cols(b).
+ *  Used by the policies that have no faster batched formulation.
+ *
+ *  @param lossFn Distance policy used for every distance evaluation
+ *  @param data Transposed input data, dense or sparse
+ *  @param rows Indices of the datapoints indexing the rows of the block
+ *  @param cols Indices of the datapoints indexing the columns of the block
+ *  @param out Block of distances, resized to rows.n_elem x cols.n_elem
+ */
+template <typename T, typename Distance>
+inline void pairwise_block(
+  const Distance& lossFn,
+  const T& data,
+  const arma::uvec& rows,
+  const arma::uvec& cols,
+  arma::Mat<typename T::elem_type>& out)
+{
+    out.set_size(rows.n_elem, cols.n_elem);
+#pragma omp parallel for
+    for (arma::uword b = 0; b < cols.n_elem; b++) {
+        for (arma::uword a = 0; a < rows.n_elem; a++) {
+            out(a, b) = lossFn(data, rows(a), cols(b));
+        }
+    }
+}
+
+/**
+ *  \brief Squared norm of every datapoint
+ *
+ *  Computes the squared norm of every column of the (transposed) dataset,
+ *  accumulating in double precision without copying the data.
+ *
+ *  @param data Transposed input data
+ */
+template <typename eT>
+inline arma::rowvec column_sq_norms(const arma::Mat<eT>& data) {
+    arma::rowvec sq_norms(data.n_cols);
+#pragma omp parallel for
+    for (arma::uword i = 0; i < data.n_cols; i++) {
+        const eT* col = data.colptr(i);
+        double total = 0;
+        for (arma::uword r = 0; r < data.n_rows; r++) {
+            total += double(col[r]) * col[r];
+        }
+        sq_norms(i) = total;
+    }
+    return sq_norms;
+}
+
+/**
+ *  \brief Squared norm of every sparse datapoint
+ *
+ *  Same as column_sq_norms for dense data, but only visits the nonzeros.
+ *
+ *  @param data Transposed sparse input data in compressed column form
+ */
+template <typename eT>
+inline arma::rowvec column_sq_norms(const arma::SpMat<eT>& data) {
+    arma::rowvec sq_norms(data.n_cols);
+#pragma omp parallel for
+    for (arma::uword i = 0; i < data.n_cols; i++) {
+        double total = 0;
+        for (arma::uword r = data.col_ptrs[i]; r < data.col_ptrs[i + 1]; r++) {
+            total += double(data.values[r]) * data.values[r];
+        }
+        sq_norms(i) = total;
+    }
+    return sq_norms;
+}
+
+/**
+ *  \brief Merges the nonzeros of two sparse datapoints
+ *
+ *  Walks the sorted row indices of columns i and j together and calls
+ *  acc(total, a_r - b_r) once for every row that is nonzero in either column.
+ *  Rows that are zero in both columns contribute nothing to any of the
+ *  supported losses and are never visited.
+ *
+ *  @param data Transposed sparse input data in compressed column form
+ *  @param i Index of the first datapoint
+ *  @param j Index of the second datapoint
+ *  @param acc Accumulator called with the running total and a difference
+ */
+template <typename eT, typename Acc>
+inline double sparse_merge(const arma::SpMat<eT>& data, arma::uword i, arma::uword j, Acc acc) {
+    const arma::uword* rows = data.row_indices;
+    const eT* values = data.values;
+    arma::uword a = data.col_ptrs[i];
+    arma::uword b = data.col_ptrs[j];
+    const arma::uword a_end = data.col_ptrs[i + 1];
+    const arma::uword b_end = data.col_ptrs[j + 1];
+    double total = 0;
+    while (a < a_end && b < b_end) {
+        if (rows[a] < rows[b]) {
+            acc(total, double(values[a++]));
+        } else if (rows[b] < rows[a]) {
+            acc(total, -double(values[b++]));
+        } else {
+            acc(total, double(values[a++]) - double(values[b++]));
+        }
+    }
+    for (; a < a_end; a++) {
+        acc(total, double(values[a]));
+    }
+    for (; b < b_end; b++) {
+        acc(total, -double(values[b]));
+    }
+    return total;
+}
+
+/**
+ *  \brief Dot product of two sparse datapoints
+ *
+ *  Intersects the sorted row indices of columns i and j. When one column has
+ *  far more nonzeros than the other, the longer one is searched with binary
+ *  search instead of being walked entry by entry.
+ *
+ *  @param data Transposed sparse input data in compressed column form
+ *  @param i Index of the first datapoint
+ *  @param j Index of the second datapoint
+ */
+template <typename eT>
+inline double sparse_dot(const arma::SpMat<eT>& data, arma::uword i, arma::uword j) {
+    const arma::uword* rows = data.row_indices;
+    const eT* values = data.values;
+    arma::uword a = data.col_ptrs[i];
+    arma::uword b = data.col_ptrs[j];
+    arma::uword a_end = data.col_ptrs[i + 1];
+    arma::uword b_end = data.col_ptrs[j + 1];
+    if (a_end - a > b_end - b) {
+        std::swap(a, b);
+        std::swap(a_end, b_end);
+    }
+    const bool gallop = (b_end - b) > 16 * (a_end - a);
+    double total = 0;
+    while (a < a_end && b < b_end) {
+        if (rows[a] == rows[b]) {
+            total += double(values[a++]) * values[b++];
+        } else if (rows[a] < rows[b]) {
+            a++;
+        } else if (gallop) {
+            b = std::lower_bound(rows + b, rows + b_end, rows[a]) - rows;
+        } else {
+            b++;
+        }
+    }
+    return total;
+}
+
+/**
+ *  \brief Manhattan (L1) distance policy.
+ *
+ *  Computes the L1 distance between the datapoints at index i and j of the
+ *  (transposed) dataset with the vectorized kernel selected for this host.
+ *  Sparse datasets merge the nonzeros of both datapoints instead.
+ */
+template <typename eT>
+struct L1Distance {
+    typename simd::DistanceKernels<eT>::KernelFn kernel; ///< kernel resolved when the policy is created
+
+    L1Distance() : kernel(simd::kernels<eT>().l1) {}
+
+    inline double operator()(const arma::Mat<eT>& data, arma::uword i, arma::uword j) const {
+        return kernel(data.colptr(i), data.colptr(j), data.n_rows);
+    }
+
+    inline double operator()(const arma::SpMat<eT>& data, arma::uword i, arma::uword j) const {
+        return sparse_merge(data, i, j, [](double& total, double d) { total += std::abs(d); });
+    }
+
+    void block(const arma::Mat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        pairwise_block(*this, data, rows, cols, out);
+    }
+
+    void block(const arma::SpMat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        pairwise_block(*this, data, rows, cols, out);
+    }
+};
+
+/**
+ *  \brief Euclidean (L2) distance policy.
+ *
+ *  Computes the L2 distance between the datapoints at index i and j of the
+ *  (transposed) dataset with the vectorized kernel selected for this host.
+ *  Blocks of distances are expanded as |x|^2 + |y|^2 - 2 x.y, so a whole
+ *  block costs one GEMM plus the squared norms (see column_sq_norms) given at
+ *  construction. The norms are kept in double precision even for single
+ *  precision data. Sparse datasets use the same expansion with a sparse dot
+ *  product.
+ */
+template <typename eT>
+struct L2Distance {
+    typename simd::DistanceKernels<eT>::KernelFn kernel; ///< kernel resolved when the policy is created
+
+    arma::rowvec sq_norms; ///< squared norm of every datapoint
+
+    explicit L2Distance(const arma::rowvec& sq_norms)
+      : kernel(simd::kernels<eT>().sqeuclidean),
+        sq_norms(sq_norms) {}
+
+    inline double operator()(const arma::Mat<eT>& data, arma::uword i, arma::uword j) const {
+        return std::sqrt(kernel(data.colptr(i), data.colptr(j), data.n_rows));
+    }
+
+    inline double operator()(const arma::SpMat<eT>& data, arma::uword i, arma::uword j) const {
+        const double sq = sq_norms(i) + sq_norms(j) - 2 * sparse_dot(data, i, j);
+        return sq > 0 ? std::sqrt(sq) : 0;
+    }
+
+    void block(const arma::SpMat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        pairwise_block(*this, data, rows, cols, out);
+    }
+
+    void block(const arma::Mat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        out = arma::trans(data.cols(rows)) * data.cols(cols);
+#pragma omp parallel for
+        for (arma::uword b = 0; b < cols.n_elem; b++) {
+            eT* col = out.colptr(b);
+            const double norm_b = sq_norms(cols(b));
+            for (arma::uword a = 0; a < rows.n_elem; a++) {
+                // clamp the rounding error of the expansion for (near) duplicates
+                const double sq = sq_norms(rows(a)) + norm_b - 2 * double(col[a]);
+                col[a] = sq > 0 ? std::sqrt(sq) : 0;
+            }
+        }
+    }
+};
+
+/**
+ *  \brief General LP distance policy.
+ *
+ *  Computes the LP distance between the datapoints at index i and j of the
+ *  (transposed) dataset. The exponent is fixed when the policy is created at
+ *  the start of KMedoids::fit. There is no vector kernel for general p since
+ *  the per-coordinate pow dominates the cost. Sparse datasets merge the
+ *  nonzeros of both datapoints instead.
+ */
+template <typename eT>
+struct LpDistance {
+    int p; ///< exponent of the norm
+
+    explicit LpDistance(int p) : p(p) {}
+
+    inline double operator()(const arma::Mat<eT>& data, arma::uword i, arma::uword j) const {
+        const eT* a = data.colptr(i);
+        const eT* b = data.colptr(j);
+        double total = 0;
+        for (arma::uword r = 0; r < data.n_rows; r++) {
+            total += std::pow(std::abs(double(a[r]) - double(b[r])), p);
+        }
+        return std::pow(total, 1.0 / p);
+    }
+
+    inline double operator()(const arma::SpMat<eT>& data, arma::uword i, arma::uword j) const {
+        const int exponent = p;
+        const double sum = sparse_merge(data, i, j, [exponent](double& total, double d) {
+            total += std::pow(std::abs(d), exponent);
+        });
+        return std::pow(sum, 1.0 / p);
+    }
+
+    void block(const arma::Mat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        pairwise_block(*this, data, rows, cols, out);
+    }
+
+    void block(const arma::SpMat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        pairwise_block(*this, data, rows, cols, out);
+    }
+};
+
+/**
+ *  \brief L_INFINITY distance policy.
+ *
+ *  Computes the largest absolute coordinate difference between the datapoints
+ *  at index i and j of the (transposed) dataset with the vectorized kernel
+ *  selected for this host. Sparse datasets merge the nonzeros of both
+ *  datapoints instead.
+ */
+template <typename eT>
+struct LinfDistance {
+    typename simd::DistanceKernels<eT>::KernelFn kernel; ///< kernel resolved when the policy is created
+
+    LinfDistance() : kernel(simd::kernels<eT>().linf) {}
+
+    inline double operator()(const arma::Mat<eT>& data, arma::uword i, arma::uword j) const {
+        return kernel(data.colptr(i), data.colptr(j), data.n_rows);
+    }
+
+    inline double operator()(const arma::SpMat<eT>& data, arma::uword i, arma::uword j) const {
+        return sparse_merge(data, i, j, [](double& total, double d) {
+            total = std::max(total, std::abs(d));
+        });
+    }
+
+    void block(const arma::Mat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        pairwise_block(*this, data, rows, cols, out);
+    }
+
+    void block(const arma::SpMat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        pairwise_block(*this, data, rows, cols, out);
+    }
+};
+
+/**
+ *  \brief Cosine loss policy.
+ *
+ *  Computes the cosine between the datapoints at index i and j of the
+ *  (transposed) dataset in a single vectorized pass over both columns.
+ *  Blocks of cosines are one GEMM scaled by the norms derived from the squared
+ *  norms given at construction. Sparse datasets scale a sparse dot product by
+ *  the same norms.
+ */
+template <typename eT>
+struct CosDistance {
+    typename simd::DistanceKernels<eT>::KernelFn kernel; ///< kernel resolved when the policy is created
+
+    arma::rowvec norms; ///< norm of every datapoint
+
+    explicit CosDistance(const arma::rowvec& sq_norms)
+      : kernel(simd::kernels<eT>().cos),
+        norms(arma::sqrt(sq_norms)) {}
+
+    inline double operator()(const arma::Mat<eT>& data, arma::uword i, arma::uword j) const {
+        return kernel(data.colptr(i), data.colptr(j), data.n_rows);
+    }
+
+    inline double operator()(const arma::SpMat<eT>& data, arma::uword i, arma::uword j) const {
+        return sparse_dot(data, i, j) / (norms(i) * norms(j));
+    }
+
+    void block(const arma::SpMat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        pairwise_block(*this, data, rows, cols, out);
+    }
+
+    void block(const arma::Mat<eT>& data, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        out = arma::trans(data.cols(rows)) * data.cols(cols);
+#pragma omp parallel for
+        for (arma::uword b = 0; b < cols.n_elem; b++) {
+            eT* col = out.colptr(b);
+            const double norm_b = norms(cols(b));
+            for (arma::uword a = 0; a < rows.n_elem; a++) {
+                col[a] = double(col[a]) / (norms(rows(a)) * norm_b);
+            }
+        }
+    }
+};
+
+/**
+ *  \brief Precomputed dissimilarity policy.
+ *
+ *  Looks up the dissimilarity between datapoints i and j in a symmetric N x N
+ *  matrix passed to the engine in place of the data. The lookup reads column
+ *  i, so evaluating one point against many others walks contiguous memory.
+ *  Blocks are gathered straight from the matrix.
+ */
+template <typename eT>
+struct PrecomputedDistance {
+    inline double operator()(const arma::Mat<eT>& dists, arma::uword i, arma::uword j) const {
+        return dists.at(j, i);
+    }
+
+    inline double operator()(const arma::SpMat<eT>& dists, arma::uword i, arma::uword j) const {
+        return dists(j, i);
+    }
+
+    void block(const arma::Mat<eT>& dists, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        out = dists.submat(rows, cols);
+    }
+
+    void block(const arma::SpMat<eT>& dists, const arma::uvec& rows, const arma::uvec& cols, arma::Mat<eT>& out) const {
+        pairwise_block(*this, dists, rows, cols, out);
+    }
+};
+
+/**
+ *  \brief Returns the slot of the calling thread, numbered in order of first use
+ *
+ *  Unlike the OpenMP thread number, which is 0 for every thread running a
+ *  nested serialized region, distinct threads get distinct slots; per-thread
+ *  statistics are sharded by it.
+ */
+inline int thread_slot() {
+    static std::atomic<int> next{0};
+    static thread_local const int slot = next.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+/**
+ *  \brief Count of distance evaluations shared by the threads of a fit.
+ *
+ *  Kept in shards on separate cache lines. Each thread adds to the shard of
+ *  its thread_slot, so threads only share a shard beyond n_shards threads.
+ */
+class DistanceCounter {
+  public:
+    /*! \brief Adds n evaluations */
+    inline void add(size_t n) {
+        shards[thread_slot() & (n_shards - 1)].count.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /*! \brief Returns the number of evaluations added so far */
+    size_t total() const {
+        size_t sum = 0;
+        for (int s = 0; s < n_shards; s++) {
+            sum += shards[s].count.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+  private:
+    static const int n_shards = 64; ///< number of shards, a power of two
+
+    struct alignas(64) Shard {
+        std::atomic<size_t> count{0};
+    };
+
+    Shard shards[n_shards]; ///< per-thread counts
+};
+
+/**
+ *  \brief Distance policy adapter that counts distance evaluations.
+ *
+ *  Adds every distance the wrapped policy evaluates, one by one or as a
+ *  block, to a DistanceCounter. Wrapped innermost, so distances served by a
+ *  DistanceCache are not counted.
+ */
+template <typename Distance>
+struct CountedDistance {
+    const Distance& lossFn; ///< wrapped distance policy
+
+    DistanceCounter* counter; ///< counter shared by every thread of the fit
+
+    CountedDistance(const Distance& lossFn, DistanceCounter& counter)
+      : lossFn(lossFn), counter(&counter) {}
+
+    template <typename T>
+    inline double operator()(const T& data, arma::uword i, arma::uword j) const {
+        counter->add(1);
+        return lossFn(data, i, j);
+    }
+
+    template <typename T>
+    void block(
+      const T& data,
+      const arma::uvec& rows,
+      const arma::uvec& cols,
+      arma::Mat<typename T::elem_type>& out) const
+    {
+        counter->add(rows.n_elem * cols.n_elem);
+        lossFn.block(data, rows, cols, out);
+    }
+};
+
+#endif // DISTANCES_H_
@@ -1,8 +1,17 @@
 #ifndef KMEDOIDS_UCB_H_
 #define KMEDOIDS_UCB_H_
 
+#include "arm_set.hpp"
+#include "distance_cache.hpp"
+#include "distances.hpp"
+#include "mapped_matrix.hpp"
+#include "numa_placement.hpp"
+#include "sampler.hpp"
+#include "scratch_arena.hpp"
+
 #include <carma.h>
 #include <armadillo>
+#include <atomic>
 #include <vector>
 #include <fstream>
 #include <iostream>
@@ -113,6 +122,48 @@ struct LogHelper {
     }
 };
 
+/**
+ *  \brief Algorithms KMedoids::fit can run
+ *
+ *  Identifies the algorithm chosen by KMedoids::checkAlgorithm from the user's
+ *  algorithm string.
+ */
+enum class AlgorithmType {
+    BANDITPAM, ///< "BanditPAM"
+    NAIVE,     ///< "naive"
+    FASTERPAM  ///< "FasterPAM", BanditPAM with eager swaps
+};
+
+/**
+ *  \brief Reasons the swap step of KMedoids::fit stops
+ */
+enum class StopReason {
+    CONVERGED,      ///< no swap improved the loss
+    MAX_ITER,       ///< max_iter swap iterations were run
+    TIME_BUDGET,    ///< the time budget ran out
+    LOSS_TOLERANCE, ///< the relative loss improvement fell below the tolerance
+    CANCELLED       ///< the cancel flag was set
+};
+
+/**
+ *  \brief Fit for one number of medoids of KMedoids::fit_path
+ */
+struct PathResult {
+    size_t k; ///< number of medoids
+
+    arma::rowvec build_medoids; ///< medoids at the end of the build step
+
+    arma::rowvec medoids; ///< medoids at the end of the swap step
+
+    arma::rowvec labels; ///< assignments of each datapoint to its medoid
+
+    double loss; ///< total distance of the datapoints to their medoids
+
+    int steps; ///< number of swap steps taken
+
+    size_t seed; ///< seed of the swap step; a fit with it warm-started from build_medoids finds the same medoids
+};
+
 /**
  *  \brief Class implementation for running KMedoids methods.
  *
@@ -121,19 +172,49 @@ struct LogHelper {
  *
  *  @param nMedoids Number of medoids/clusters to create
  *  @param algorithm Algorithm used to find medoids; options are "BanditPAM" for
- *  the "Bandit-PAM" algorithm, or "naive" to use the naive method
+ *  the "Bandit-PAM" algorithm, "FasterPAM" for Bandit-PAM with eager swaps, or
+ *  "naive" to use the naive method
  *  @param verbosity Verbosity of the algorithm, 0 will have no log file
  *  emitted, 1 will emit a log file
  *  @param maxIter The maximum number of iterations the algorithm runs for
  *  @param logFilename The name of the output log file
+ *  @param seed Seed of the random reference batches
  */
 class KMedoids {
   public:
-    KMedoids(int n_medoids = 5, std::string algorithm = "BanditPAM", int verbosity = 0, int max_iter = 1000, std::string logFilename = "KMedoidsLogfile");
+    KMedoids(int n_medoids = 5, std::string algorithm = "BanditPAM", int verbosity = 0, int max_iter = 1000, std::string logFilename = "KMedoidsLogfile", size_t seed = 0);
     
     ~KMedoids();
 
-    void fit(arma::mat inputData, std::string loss);
+    void fit(const arma::mat& inputData, std::string loss);
+
+    void fit(const arma::mat& inputData, std::string loss, const arma::urowvec& initialMedoids);
+
+    void fit(const arma::fmat& inputData, std::string loss);
+
+    void fit(const arma::fmat& inputData, std::string loss, const arma::urowvec& initialMedoids);
+
+    void fit(const arma::sp_mat& inputData, std::string loss);
+
+    void fit(const arma::sp_mat& inputData, std::string loss, const arma::urowvec& initialMedoids);
+
+    void fit(const MappedMatrix& inputData, std::string loss);
+
+    std::vector<PathResult> fit_path(const arma::mat& inputData, std::string loss, const std::vector<size_t>& kValues);
+
+    std::vector<PathResult> fit_path(const arma::fmat& inputData, std::string loss, const std::vector<size_t>& kValues);
+
+    std::vector<PathResult> fit_path(const arma::sp_mat& inputData, std::string loss, const std::vector<size_t>& kValues);
+
+    void fit_sharded(const std::vector<std::string>& workers, std::string loss);
+
+    void fit_many(const std::vector<KMedoids*>& models, const std::vector<arma::mat>& inputData, const std::vector<size_t>& kValues, std::string loss);
+
+    void fit_many(const std::vector<KMedoids*>& models, const std::vector<arma::fmat>& inputData, const std::vector<size_t>& kValues, std::string loss);
+
+    void partial_fit(const arma::mat& newData, size_t maxRounds = 10);
+
+    void partial_fit(const arma::fmat& newData, size_t maxRounds = 10);
 
     // The functions below are "get" functions for read-only attributes
 
@@ -145,6 +226,18 @@ class KMedoids {
 
     int getSteps();
 
+    StopReason getStopReason();
+
+    size_t getCacheHits();
+
+    size_t getCacheMisses();
+
+    size_t getDistanceCalls();
+
+    size_t getBuildDistanceCalls();
+
+    size_t getSwapDistanceCalls();
+
     // The functions below are get/set functions for attributes
 
     int getNMedoids();
@@ -167,91 +260,265 @@ class KMedoids {
 
     void setLogFilename(std::string new_lname);
 
+    size_t getCacheBytes();
+
+    void setCacheBytes(size_t new_bytes);
+
+    size_t getBatchSize();
+
+    void setBatchSize(size_t new_size);
+
+    size_t getBuildConfidence();
+
+    void setBuildConfidence(size_t new_confidence);
+
+    size_t getSwapConfidence();
+
+    void setSwapConfidence(size_t new_confidence);
+
+    bool getAdaptiveBatch();
+
+    void setAdaptiveBatch(bool new_adaptive);
+
+    double getPilotErrorRate();
+
+    void setPilotErrorRate(double new_rate);
+
+    double getTimeBudget();
+
+    void setTimeBudget(double new_budget);
+
+    double getLossTolerance();
+
+    void setLossTolerance(double new_tolerance);
+
+    double loss();
+
+    bool getNumaMode();
+
+    void setNumaMode(bool new_mode);
+
+    size_t getSeed();
+
+    void setSeed(size_t new_seed);
+
+    void setCancelFlag(const std::atomic<bool>* flag);
+
     void setLossFn(std::string loss);
   private:
-    // The functions below are PAM's constituent functions
-    void fit_bpam(arma::mat inputData);
+    void parseLossFn(std::string loss);
+
+    template <typename T>
+    void fit_impl(const T& inputData, std::string loss, const arma::urowvec& initialMedoids, const MappedMatrix* mapped = nullptr);
+
+    template <typename T>
+    std::vector<PathResult> fit_path_impl(const T& inputData, std::string loss, const std::vector<size_t>& kValues);
+
+    template <typename T>
+    void fit_many_impl(const std::vector<KMedoids*>& models, const std::vector<T>& inputData, const std::vector<size_t>& kValues, std::string loss);
+
+    template <typename T, typename Fn>
+    void withInputData(const T& inputData, const MappedMatrix* mapped, Fn fn);
+
+    template <typename eT>
+    void partial_fit_impl(const arma::Mat<eT>& newData, size_t maxRounds);
 
-    void fit_naive(arma::mat inputData);
+    template <typename T>
+    T& storedData();
+
+    template <typename T, typename Fn>
+    void dispatchLossFn(const T& data, Fn fn);
+
+    template <typename T>
+    void pilot_confidence(const T& inputData, std::string loss, bool transposed);
+
+    template <typename eT>
+    arma::Mat<eT> pilotSample(const arma::Mat<eT>& inputData, const arma::uvec& sample, bool transposed);
+
+    template <typename eT>
+    arma::SpMat<eT> pilotSample(const arma::SpMat<eT>& inputData, const arma::uvec& sample, bool transposed);
+
+    size_t roundBatchSize(size_t activeArms, size_t totalArms, size_t N);
+
+    size_t referenceChunks(size_t targets, size_t refs);
+
+    bool outOfTime();
 
-    void build_naive(arma::mat& data, arma::rowvec& medoidIndices);
+    bool interrupted();
 
-    void swap_naive(arma::mat& data, arma::rowvec& medoidIndices, arma::rowvec& assignments);
+    bool stopEarly(double previousLoss, double loss);
 
+    template <typename T, typename Distance, typename Fn>
+    void prefetchMapped(const T& data, const Distance& lossFn, Fn fn);
+
+    template <typename Distance, typename Fn>
+    void prefetchMapped(const arma::mat& data, const Distance& lossFn, Fn fn);
+
+    // The functions below are PAM's constituent functions
+    template <typename T, typename Distance>
+    void fit_bpam(const T& data, const Distance& lossFn);
+
+    template <typename T, typename Distance>
+    void fit_naive(const T& data, const Distance& lossFn);
+
+    template <typename T, typename Distance>
+    void fit_path_run(
+      const T& data,
+      const std::vector<size_t>& kValues,
+      std::vector<PathResult>& results,
+      const Distance& lossFn
+    );
+
+    template <typename T, typename Distance>
+    void build_naive(const T& data, arma::rowvec& medoidIndices, const Distance& lossFn);
+
+    template <typename T, typename Distance>
+    void swap_naive(const T& data, arma::rowvec& medoidIndices, arma::rowvec& assignments, const Distance& lossFn);
+
+    template <typename T, typename Distance>
     void build(
-      arma::mat& data,
+      const T& data,
       arma::rowvec& medoidIndices,
-      arma::mat& medoids
+      T& medoids,
+      const Distance& lossFn
     );
 
+    template <typename T, typename Distance>
     void build_sigma(
-      arma::mat& data,
+      const T& data,
       arma::rowvec& best_distances,
       arma::rowvec& sigma,
       arma::uword batch_size,
-      bool use_absolute
+      bool use_absolute,
+      const Distance& lossFn
     );
 
+    template <typename T, typename Distance>
     arma::rowvec build_target(
-      arma::mat& data,
+      const T& data,
       arma::uvec& target,
       size_t batch_size,
       arma::rowvec& best_distances,
-      bool use_absolute
+      bool use_absolute,
+      const Distance& lossFn
     );
 
+    template <typename T, typename Distance>
     void swap(
-      arma::mat& data,
+      const T& data,
+      arma::rowvec& medoidIndices,
+      T& medoids,
+      arma::rowvec& assignments,
+      const Distance& lossFn
+    );
+
+    template <typename T, typename Distance>
+    void swap_eager(
+      const T& data,
       arma::rowvec& medoidIndices,
-      arma::mat& medoids,
-      arma::rowvec& assignments
+      T& medoids,
+      arma::rowvec& assignments,
+      const Distance& lossFn
+    );
+
+    template <typename T, typename Distance>
+    arma::sword race_swaps(
+      const T& data,
+      arma::rowvec& medoidIndices,
+      arma::uvec& targets,
+      const arma::vec& arm_sigma,
+      arma::rowvec& best_distances,
+      arma::rowvec& second_distances,
+      arma::rowvec& assignments,
+      double log_p,
+      size_t& rounds,
+      const Distance& lossFn
+    );
+
+    template <typename T, typename Distance>
+    void stream_swap(
+      const T& data,
+      size_t first_new,
+      size_t max_rounds,
+      const Distance& lossFn
     );
 
+    template <typename T, typename Distance>
     void calc_best_distances_swap(
-      arma::mat& data,
+      const T& data,
+      arma::rowvec& medoidIndices,
+      arma::rowvec& best_distances,
+      arma::rowvec& second_distances,
+      arma::rowvec& assignments,
+      arma::rowvec& second_assignments,
+      const Distance& lossFn
+    );
+
+    template <typename T, typename Distance>
+    void scan_medoids_swap(
+      const T& data,
+      arma::rowvec& medoidIndices,
+      size_t i,
+      arma::rowvec& best_distances,
+      arma::rowvec& second_distances,
+      arma::rowvec& assignments,
+      arma::rowvec& second_assignments,
+      const Distance& lossFn
+    );
+
+    template <typename T, typename Distance>
+    void update_best_distances_swap(
+      const T& data,
       arma::rowvec& medoidIndices,
+      size_t k,
       arma::rowvec& best_distances,
       arma::rowvec& second_distances,
-      arma::rowvec& assignments
+      arma::rowvec& assignments,
+      arma::rowvec& second_assignments,
+      const Distance& lossFn
     );
 
+    template <typename T, typename Distance>
     arma::vec swap_target(
-      arma::mat& data,
+      const T& data,
       arma::rowvec& medoidIndices,
       arma::uvec& targets,
       size_t batch_size,
       arma::rowvec& best_distances,
       arma::rowvec& second_best_distances,
-      arma::rowvec& assignments
+      arma::rowvec& assignments,
+      const Distance& lossFn
     );
 
+    template <typename T, typename Distance>
     void swap_sigma(
-      arma::mat& data,
+      const T& data,
       arma::mat& sigma,
       size_t batch_size,
+      const arma::uvec& candidates,
       arma::rowvec& best_distances,
       arma::rowvec& second_best_distances,
-      arma::rowvec& assignments
+      arma::rowvec& assignments,
+      const Distance& lossFn
     );
 
     void sigma_log(arma::mat& sigma);
 
-    double calc_loss(arma::mat& data, arma::rowvec& medoidIndices);
-
-    // Loss functions
-    int lp;
-    double LP(arma::mat& data, int i, int j) const;
+    template <typename T, typename Distance>
+    double calc_loss(const T& data, arma::rowvec& medoidIndices, const Distance& lossFn);
 
-    double LINF(arma::mat& data, int i, int j) const;
+    template <typename T, typename Distance>
+    void refresh_best_distances(const T& data, arma::uword medoid, arma::rowvec& bestDistances, const Distance& lossFn);
 
-    double cos(arma::mat& data, int i, int j) const;
+    // Loss functions
+    int lp; ///< exponent used when lossType is LossType::LP
 
-    double manhattan(arma::mat& data, int i, int j) const;
+    LossType lossType; ///< distance policy the engine is instantiated with during KMedoids::fit
 
     void checkAlgorithm(std::string algorithm);
 
     // Constructor params
-    std::string algorithm; ///< options: "naive" and "BanditPAM"
+    std::string algorithm; ///< options: "naive", "BanditPAM" and "FasterPAM"
 
     int max_iter; ///< maximum number of iterations during KMedoids::fit
 
@@ -262,30 +529,90 @@ class KMedoids {
     std::string logFilename; ///< name of the logfile output (verbosity permitting)
 
     // Properties of the KMedoids instance
-    arma::mat data; ///< input data used during KMedoids::fit
+    arma::mat data; ///< input data used during KMedoids::fit (double precision)
+
+    arma::fmat fdata; ///< input data used during KMedoids::fit (single precision)
+
+    arma::sp_mat spdata; ///< input data used during KMedoids::fit (sparse)
+
+    arma::uword nStored = 0; ///< datapoints in the stored data; dense data may have spare columns for KMedoids::partial_fit
+
+    arma::rowvec sqNorms; ///< squared norm of every stored datapoint, for the L2 and cosine policies
+
+    const MappedMatrix* mappedData = nullptr; ///< mapping the data of an out-of-core KMedoids::fit aliases, null otherwise
 
     arma::rowvec labels; ///< assignments of each datapoint to its medoid
 
+    arma::rowvec bestDistances; ///< distance of each datapoint to its medoid, kept for KMedoids::partial_fit
+
+    arma::rowvec secondDistances; ///< distance of each datapoint to its second closest medoid
+
+    arma::rowvec secondLabels; ///< assignments of each datapoint to its second closest medoid
+
     arma::rowvec medoid_indices_build; ///< medoids at the end of build step
 
-    arma::rowvec medoid_indices_final; ///< medoids at the end of the swap step
+    arma::urowvec initialMedoids; ///< medoids of a warm-started KMedoids::fit, empty otherwise
 
-    double (KMedoids::*lossFn)(arma::mat& data, int i, int j) const; ///< loss function used during KMedoids::fit
+    arma::rowvec medoid_indices_final; ///< medoids at the end of the swap step
 
-    void (KMedoids::*fitFn)(arma::mat inputData); ///< function used for finding medoids (from algorithm)
+    AlgorithmType algorithmType; ///< algorithm used for finding medoids (from algorithm)
 
     LogHelper logHelper; ///< helper object for making formatted logs
 
     int steps; ///< number of actual swap iterations taken by the algorithm
 
+    StopReason stopReason = StopReason::CONVERGED; ///< why the swap step of the last KMedoids::fit stopped
+
+    std::chrono::steady_clock::time_point fitStart; ///< start of the running KMedoids::fit
+
+    double timeBudget = 0; ///< seconds KMedoids::fit may run before the swap step stops, 0 for no limit
+
+    double lossTolerance = 0; ///< relative loss improvement below which the swap step stops, 0 to disable
+
+    size_t cacheBytes = 0; ///< byte budget of the distance cache, 0 disables it
+
+    size_t cacheHits = 0; ///< distance cache hits during the last KMedoids::fit
+
+    size_t cacheMisses = 0; ///< distance cache misses during the last KMedoids::fit
+
+    DistanceCounter* distanceCounter = nullptr; ///< counter of the distances evaluated by the running fit, null otherwise
+
+    const std::atomic<bool>* cancelFlag = nullptr; ///< set to stop the running fit at its next swap round, null if fits cannot be cancelled
+
+    size_t distanceCalls = 0; ///< distances evaluated during the last KMedoids::fit
+
+    size_t buildDistanceCalls = 0; ///< distances evaluated by the build step of the last KMedoids::fit
+
     // Hyperparameters
-    static const size_t buildConfidence = 1000; ///< constant that affects the sensitivity of build confidence bounds
+    size_t buildConfidence = 1000; ///< constant that affects the sensitivity of build confidence bounds
 
-    static const size_t swapConfidence = 10000; ///< constant that affects the sensitiviy of swap confidence bounds
+    size_t swapConfidence = 10000; ///< constant that affects the sensitiviy of swap confidence bounds
 
     const double precision = 0.001; ///< bound for double comparison precision
 
-    const size_t batchSize = 100; ///< batch size for computation steps
+    size_t batchSize = 100; ///< batch size for computation steps, the smallest batch when adaptiveBatch is set
+
+    bool adaptiveBatch = false; ///< grows the batch of each bandit round as arms are eliminated
+
+    double pilotErrorRate = 0; ///< target error probability the pilot tunes the confidences for, 0 disables the pilot
+
+    const size_t pilotSize = 1000; ///< datapoints in each pilot subsample
+
+    const size_t pilotRuns = 5; ///< pilot subsamples each candidate confidence is run on
+
+    const size_t blockElems = 1 << 22; ///< max entries of a (targets x references) block of distances
+
+    const size_t minChunkRefs = 1024; ///< fewest references in a chunk of a target's batch
+
+    const arma::uword serialFitPoints = 4096; ///< datapoints up to which a job of KMedoids::fit_many runs on a single thread
+
+    size_t seed = 0; ///< seed of the reference batches, restarted by every fit
+
+    bool numaMode = false; ///< pins the threads and places the transposed data on their nodes during a fit
+
+    ReferenceSampler sampler; ///< draws the reference batches of the bandit rounds
+
+    ScratchArena scratch; ///< buffers of the bandit rounds, reused across rounds
 };
 
 #endif // KMEDOIDS_UCB_H_
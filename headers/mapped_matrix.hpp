@@ -0,0 +1,87 @@
+#ifndef MAPPED_MATRIX_H_
+#define MAPPED_MATRIX_H_
+
+#include <armadillo>
+#include <string>
+
+/**
+ *  \brief Read-only matrix backed by a memory-mapped file.
+ *
+ *  Maps a raw file of doubles stored in column-major order and exposes it as
+ *  an arma::mat that aliases the mapping, so matrices larger than memory can
+ *  be passed to KMedoids::fit without being loaded. Pages are read from disk
+ *  on first access and may be evicted by the kernel under memory pressure.
+ *  The matrix must not be written to.
+ *
+ *  Columns about to be read can be prefetched, so the disk reads of randomly
+ *  sampled columns overlap instead of each faulting in turn.
+ */
+class MappedMatrix {
+  public:
+    MappedMatrix(const std::string& path, arma::uword n_rows, arma::uword n_cols);
+
+    MappedMatrix(const std::string& path, arma::uword n_rows);
+
+    explicit MappedMatrix(const std::string& path);
+
+    ~MappedMatrix();
+
+    MappedMatrix(const MappedMatrix&) = delete;
+
+    MappedMatrix& operator=(const MappedMatrix&) = delete;
+
+    const arma::mat& mat() const;
+
+    void prefetch(const arma::uvec& cols) const;
+
+  private:
+    static void* map(const std::string& path, size_t length);
+
+    static arma::uword fileEntries(const std::string& path);
+
+    static arma::uword squareSize(const std::string& path);
+
+    void* addr; ///< start of the mapping
+
+    size_t length; ///< length of the mapping in bytes
+
+    arma::mat view; ///< matrix aliasing the mapping
+};
+
+/**
+ *  \brief Distance policy adapter that prefetches the columns of a mapping.
+ *
+ *  Blocks of distances over a MappedMatrix first ask the kernel to read the
+ *  columns of the block, then delegate to the wrapped policy. Sampled
+ *  reference batches are scattered over the file, so their reads are issued
+ *  together rather than one page fault at a time. Single distances are
+ *  delegated as is.
+ */
+template <typename Distance>
+struct PrefetchedDistance {
+    const Distance& lossFn; ///< wrapped distance policy
+
+    const MappedMatrix* mapped; ///< mapping the data of the fit aliases
+
+    PrefetchedDistance(const Distance& lossFn, const MappedMatrix& mapped)
+      : lossFn(lossFn), mapped(&mapped) {}
+
+    template <typename T>
+    inline double operator()(const T& data, arma::uword i, arma::uword j) const {
+        return lossFn(data, i, j);
+    }
+
+    template <typename T>
+    void block(
+      const T& data,
+      const arma::uvec& rows,
+      const arma::uvec& cols,
+      arma::Mat<typename T::elem_type>& out) const
+    {
+        mapped->prefetch(cols);
+        mapped->prefetch(rows);
+        lossFn.block(data, rows, cols, out);
+    }
+};
+
+#endif // MAPPED_MATRIX_H_
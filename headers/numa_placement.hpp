@@ -0,0 +1,84 @@
+#ifndef NUMA_PLACEMENT_H_
+#define NUMA_PLACEMENT_H_
+
+#include <armadillo>
+#include <algorithm>
+#include <vector>
+
+/**
+ *  \brief NUMA placement of the data and threads of a fit.
+ *
+ *  The topology is read from sysfs, so no NUMA library is needed; on
+ *  machines where it cannot be read every allowed CPU is treated as one
+ *  node, which makes the placement a no-op apart from the pinning.
+ */
+namespace numa {
+
+/*! \brief Returns the CPUs of each NUMA node the process may run on
+ *
+ *  Read once, at the first call, from /sys/devices/system/node and the
+ *  affinity mask of the process at that time.
+ */
+const std::vector<std::vector<int>>& nodeCpus();
+
+/**
+ *  \brief Pins the OpenMP threads to CPUs while in scope.
+ *
+ *  Each thread of the OpenMP pool is pinned to one CPU, the threads split
+ *  over the nodes in contiguous groups, so thread t of a static schedule
+ *  always runs on the same node. OpenMP reuses its pool threads, so the
+ *  pinning holds for the parallel regions that follow. The affinity of
+ *  every pool thread, the calling thread being thread 0, is saved on
+ *  construction and restored on destruction by a region of the same size.
+ */
+class ThreadPinning {
+  public:
+    ThreadPinning();
+
+    ~ThreadPinning();
+
+    ThreadPinning(const ThreadPinning&) = delete;
+
+    ThreadPinning& operator=(const ThreadPinning&) = delete;
+
+  private:
+    std::vector<std::vector<char>> masks; ///< saved affinity mask of each pool thread
+};
+
+/*! \brief Transposes input into out, first-touching out in parallel
+ *
+ *  out is allocated without being written, then every OpenMP thread writes
+ *  the datapoints (columns of out) it will scan under a static schedule, so
+ *  the pages of each datapoint are placed on the node of that thread.
+ *
+ *  @param input Input data, one datapoint per row
+ *  @param out Transposed data, one datapoint per column
+ */
+template <typename eT>
+void firstTouchTranspose(const arma::Mat<eT>& input, arma::Mat<eT>& out) {
+    out.set_size(input.n_cols, input.n_rows);
+    const arma::uword N = input.n_rows;
+    const arma::uword D = input.n_cols;
+    // blocks of datapoints read each input column contiguously
+    const arma::uword block = 64;
+#pragma omp parallel for schedule(static)
+    for (arma::uword start = 0; start < N; start += block) {
+        const arma::uword end = std::min(start + block, N);
+        for (arma::uword d = 0; d < D; d++) {
+            const eT* in = input.colptr(d);
+            for (arma::uword i = start; i < end; i++) {
+                out.at(d, i) = in[i];
+            }
+        }
+    }
+}
+
+/*! \brief Transposes sparse input into out; sparse data is not placed */
+template <typename eT>
+void firstTouchTranspose(const arma::SpMat<eT>& input, arma::SpMat<eT>& out) {
+    out = arma::trans(input);
+}
+
+} // namespace numa
+
+#endif // NUMA_PLACEMENT_H_
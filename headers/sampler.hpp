@@ -0,0 +1,110 @@
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include <armadillo>
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+/**
+ *  \brief Counter-based stream of random numbers.
+ *
+ *  The i-th number of a stream is the splitmix64 finalizer of its key plus i
+ *  times the golden ratio, so a stream is fully described by its key and
+ *  counter. Every (seed, stream) pair names an independent, reproducible
+ *  sequence and streams never share state, so each thread or worker can own
+ *  one without synchronization.
+ */
+class RandomStream {
+  public:
+    /*! \brief Creates stream number stream of the given seed */
+    explicit RandomStream(uint64_t seed = 0, uint64_t stream = 0)
+      : key(mix(mix(seed) + stream * gamma)), counter(0) {}
+
+    /*! \brief Returns the next 64 random bits */
+    inline uint64_t next() {
+        return mix(key + (++counter) * gamma);
+    }
+
+    /*! \brief Returns a random integer in [0, n)
+     *
+     *  Uses the high half of a 64 x 64 bit product; the bias of at most
+     *  n / 2^64 is negligible for any n a datapoint index takes.
+     */
+    inline uint64_t below(uint64_t n) {
+        return uint64_t((__uint128_t(next()) * n) >> 64);
+    }
+
+  private:
+    static const uint64_t gamma = 0x9e3779b97f4a7c15ULL; ///< golden ratio increment
+
+    /*! \brief splitmix64 finalizer */
+    static inline uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    uint64_t key; ///< stream key derived from the seed and stream number
+
+    uint64_t counter; ///< number of values drawn so far
+};
+
+/**
+ *  \brief Draws batches of reference points without replacement.
+ *
+ *  Keeps a permutation of 0, ..., N - 1 that is allocated once per fit. A
+ *  batch of b points is the head of the permutation after b steps of a
+ *  Fisher-Yates shuffle, so each batch costs O(b) and reuses the same
+ *  buffers. A shuffled uniform permutation stays uniform, so the permutation
+ *  is never reset between batches.
+ */
+class ReferenceSampler {
+  public:
+    /*! \brief Restarts sampling from stream number stream of seed */
+    void seed(uint64_t seed, uint64_t stream = 0) {
+        rng = RandomStream(seed, stream);
+        // the permutation is rebuilt so equal seeds draw equal batches
+        permutation.reset();
+    }
+
+    /*! \brief Returns the next 64 random bits, e.g. to seed another sampler */
+    uint64_t next() {
+        return rng.next();
+    }
+
+    /*! \brief Draws b of the N reference points without replacement
+     *
+     *  The returned batch is overwritten by the next call to draw.
+     *
+     *  @param N Number of reference points
+     *  @param b Number of points drawn, at most N
+     */
+    const arma::uvec& draw(size_t N, size_t b) {
+        if (permutation.n_elem != N) {
+            permutation.set_size(N);
+            for (size_t i = 0; i < N; i++) {
+                permutation(i) = i;
+            }
+        }
+        b = std::min(b, N);
+        batch.set_size(b);
+        for (size_t i = 0; i < b; i++) {
+            std::swap(permutation(i), permutation(i + rng.below(N - i)));
+            batch(i) = permutation(i);
+        }
+        return batch;
+    }
+
+  private:
+    RandomStream rng; ///< stream the batches are drawn from
+
+    arma::uvec permutation; ///< random permutation of the reference points
+
+    arma::uvec batch; ///< last batch drawn
+};
+
+#endif // SAMPLER_H_
@@ -0,0 +1,133 @@
+#ifndef SCRATCH_ARENA_H_
+#define SCRATCH_ARENA_H_
+
+#include <armadillo>
+#include <cmath>
+#include <omp.h>
+#include <vector>
+
+/**
+ *  \brief Scratch buffers of the bandit rounds, reused from round to round.
+ *
+ *  Holds the block of distances of a round and the values of its reference
+ *  batch, gathered once into contiguous arrays that every thread then reads,
+ *  plus one buffer per OpenMP thread for the temporaries each thread writes.
+ *  Buffers only grow, so once the first rounds have sized them no round
+ *  allocates, and no two threads write the same buffer.
+ */
+class ScratchArena {
+  public:
+    std::vector<double> refBest; ///< best distance of each reference of the batch
+
+    std::vector<double> refSecond; ///< second best distance of each reference of the batch
+
+    std::vector<size_t> refAssignment; ///< medoid slot of each reference of the batch
+
+    std::vector<double> partials; ///< partial sums of the (target x reference chunk) tiles of a round
+
+    /*! \brief Makes room for the threads of the next parallel region; call
+     *  outside of it
+     */
+    void reserveThreads() {
+        const size_t n = omp_get_max_threads();
+        if (threads.size() < n) {
+            threads.resize(n);
+        }
+    }
+
+    /*! \brief Returns a buffer of at least size doubles owned by the calling
+     *  thread
+     */
+    double* local(size_t size) {
+        std::vector<double>& buffer = threads[omp_get_thread_num()];
+        if (buffer.size() < size + pad) {
+            // padded so the hot ends of two threads' buffers never share a
+            // cache line
+            buffer.resize(size + pad);
+        }
+        return buffer.data();
+    }
+
+    /*! \brief Returns the block of distances of element type eT */
+    template <typename eT>
+    arma::Mat<eT>& distances();
+
+    /*! \brief Gathers the distances of a reference batch to its medoids
+     *
+     *  @param refs Reference batch
+     *  @param best_distances Best distance of every datapoint
+     *  @param second_distances Second best distance of every datapoint, or
+     *  nullptr if not needed
+     *  @param assignments Medoid slot of every datapoint, or nullptr if not
+     *  needed
+     */
+    void gather(
+      const arma::uvec& refs,
+      const arma::rowvec& best_distances,
+      const arma::rowvec* second_distances = nullptr,
+      const arma::rowvec* assignments = nullptr)
+    {
+        refBest.resize(refs.n_elem);
+        for (size_t j = 0; j < refs.n_elem; j++) {
+            refBest[j] = best_distances(refs(j));
+        }
+        if (second_distances != nullptr) {
+            refSecond.resize(refs.n_elem);
+            for (size_t j = 0; j < refs.n_elem; j++) {
+                refSecond[j] = (*second_distances)(refs(j));
+            }
+        }
+        if (assignments != nullptr) {
+            refAssignment.resize(refs.n_elem);
+            for (size_t j = 0; j < refs.n_elem; j++) {
+                refAssignment[j] = size_t((*assignments)(refs(j)));
+            }
+        }
+    }
+
+  private:
+    static const size_t pad = 8; ///< doubles in a cache line
+
+    std::vector<std::vector<double>> threads; ///< buffer of each thread
+
+    arma::mat doubleBlock; ///< block of distances of double data
+
+    arma::fmat floatBlock; ///< block of distances of float data
+};
+
+template <>
+inline arma::Mat<double>& ScratchArena::distances<double>() {
+    return doubleBlock;
+}
+
+template <>
+inline arma::Mat<float>& ScratchArena::distances<float>() {
+    return floatBlock;
+}
+
+/**
+ *  \brief One-pass sample standard deviation (Welford's algorithm).
+ *
+ *  Matches arma::stddev with its default normalization by n - 1, without
+ *  storing the values.
+ */
+struct RunningStddev {
+    size_t n = 0;
+
+    double mean = 0;
+
+    double m2 = 0; ///< sum of squared deviations from the mean
+
+    inline void push(double x) {
+        n++;
+        const double delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    inline double value() const {
+        return n > 1 ? std::sqrt(m2 / (n - 1)) : 0;
+    }
+};
+
+#endif // SCRATCH_ARENA_H_
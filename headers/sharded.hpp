@@ -0,0 +1,353 @@
+#ifndef SHARDED_H_
+#define SHARDED_H_
+
+#include "distances.hpp"
+#include "sampler.hpp"
+
+#include <armadillo>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ *  \brief Requests of the sharded BanditPAM protocol.
+ *
+ *  The coordinator sends requests to each worker in turn over its own
+ *  connection; only the requests marked below are answered, with a message
+ *  of the same opcode. An estimate either names candidates every worker
+ *  holds and lets each worker sample its own references, or carries a
+ *  broadcast batch of references (see ShardReferences) for the arms of the
+ *  worker's own datapoints.
+ */
+enum class ShardOp : uint32_t {
+    HELLO,          ///< loss, exponent, shard offset and seed; answered with the shard's size and dimension
+    POINTS,         ///< global indices of points of the shard; answered with their coordinates
+    COORDINATES,    ///< global indices and coordinates of points of other shards, cached by the worker
+    REFERENCES,     ///< batch size; answered with a batch of references sampled from the shard
+    BUILD_ESTIMATE, ///< build arms, batch size, whether losses are absolute and references; answered with ArmSums
+    SWAP_ESTIMATE,  ///< swap arms, batch size, number of medoids and references; answered with ArmSums
+    ADD_MEDOID,     ///< global index of a new build medoid; answered with the shard's loss
+    SET_MEDOIDS,    ///< global indices of every medoid; answered with the shard's loss
+    LABELS,         ///< answered with the medoid slot of every point of the shard
+    BYE             ///< ends the session
+};
+
+/**
+ *  \brief Payload of a ShardOp, read back in the order it was written.
+ *
+ *  Values are copied as raw native-endian bytes, so the coordinator and its
+ *  workers must run on machines of the same architecture.
+ */
+class ShardMessage {
+  public:
+    std::vector<char> bytes; ///< payload
+
+    /*! \brief Appends one value */
+    template <typename V>
+    void put(const V& value) {
+        const char* raw = reinterpret_cast<const char*>(&value);
+        bytes.insert(bytes.end(), raw, raw + sizeof(V));
+    }
+
+    /*! \brief Appends the length of an array, then its values */
+    template <typename V>
+    void putArray(const V* values, size_t n) {
+        put<uint64_t>(n);
+        const char* raw = reinterpret_cast<const char*>(values);
+        bytes.insert(bytes.end(), raw, raw + n * sizeof(V));
+    }
+
+    /*! \brief Reads the next value */
+    template <typename V>
+    V get() {
+        V value;
+        take(&value, sizeof(V));
+        return value;
+    }
+
+    /*! \brief Reads the next array written by putArray */
+    template <typename V>
+    std::vector<V> getArray() {
+        std::vector<V> values(get<uint64_t>());
+        take(values.data(), values.size() * sizeof(V));
+        return values;
+    }
+
+  private:
+    size_t readPos = 0; ///< bytes read so far
+
+    void take(void* out, size_t n) {
+        if (readPos + n > bytes.size()) {
+            throw std::runtime_error("error: truncated shard message");
+        }
+        std::memcpy(out, bytes.data() + readPos, n);
+        readPos += n;
+    }
+};
+
+/**
+ *  \brief Blocking stream socket between a coordinator and a worker.
+ *
+ *  Addresses are "unix:<path>" for a Unix domain socket or "<host>:<port>"
+ *  for TCP, e.g. "127.0.0.1:5000" over loopback.
+ */
+class ShardConnection {
+  public:
+    /*! \brief Connects to a listening worker, retrying until it is up */
+    static std::unique_ptr<ShardConnection> connect(const std::string& address, double timeoutSeconds = 30);
+
+    explicit ShardConnection(int fd);
+
+    ~ShardConnection();
+
+    ShardConnection(const ShardConnection&) = delete;
+
+    ShardConnection& operator=(const ShardConnection&) = delete;
+
+    void send(ShardOp op, const ShardMessage& message);
+
+    ShardOp receive(ShardMessage& message);
+
+  private:
+    int fd; ///< connected socket
+};
+
+/**
+ *  \brief Sums of the values of each arm over a batch of reference points.
+ *
+ *  Workers return the sums over their own references; the coordinator adds
+ *  those of every shard, so means and dispersions cover the whole batch.
+ */
+struct ArmSums {
+    arma::vec sum; ///< sum of the values of each arm
+
+    arma::vec sumSq; ///< sum of the squared values of each arm
+
+    double count = 0; ///< number of references summed over
+
+    /*! \brief Adds the sums of another shard over the same arms */
+    void add(const ArmSums& other) {
+        if (sum.n_elem == 0) {
+            sum.zeros(other.sum.n_elem);
+            sumSq.zeros(other.sum.n_elem);
+        }
+        sum += other.sum;
+        sumSq += other.sumSq;
+        count += other.count;
+    }
+
+    /*! \brief Returns the mean value of each arm */
+    arma::vec mean() const {
+        return count > 0 ? arma::vec(sum / count) : arma::vec(sum.n_elem, arma::fill::zeros);
+    }
+
+    /*! \brief Returns the sample standard deviation of each arm */
+    arma::vec stddev() const {
+        if (count < 2) {
+            return arma::vec(sum.n_elem, arma::fill::zeros);
+        }
+        arma::vec sd(sum.n_elem);
+        for (arma::uword a = 0; a < sum.n_elem; a++) {
+            // the one-pass variance may round slightly below zero
+            const double var = (sumSq(a) - sum(a) * sum(a) / count) / (count - 1);
+            sd(a) = var > 0 ? std::sqrt(var) : 0;
+        }
+        return sd;
+    }
+};
+
+/**
+ *  \brief Batch of reference points with their state at the medoids.
+ *
+ *  Sampled by the workers from their shards and broadcast by the
+ *  coordinator, so each worker can estimate the arms of its own datapoints
+ *  over references of every shard.
+ */
+struct ShardReferences {
+    arma::mat coordinates; ///< one reference per column
+
+    arma::vec best; ///< distance of each reference to its medoid
+
+    arma::vec second; ///< distance of each reference to its second closest medoid
+
+    arma::uvec assignment; ///< medoid slot of each reference
+
+    /*! \brief Appends the batch to a message */
+    void write(ShardMessage& message) const {
+        message.putArray(coordinates.memptr(), coordinates.n_elem);
+        message.putArray(best.memptr(), best.n_elem);
+        message.putArray(second.memptr(), second.n_elem);
+        const std::vector<uint64_t> slots(assignment.begin(), assignment.end());
+        message.putArray(slots.data(), slots.size());
+    }
+
+    /*! \brief Reads a batch of datapoints of dimension rows */
+    void read(ShardMessage& message, arma::uword rows) {
+        const std::vector<double> values = message.getArray<double>();
+        best = arma::vec(message.getArray<double>());
+        second = arma::vec(message.getArray<double>());
+        const std::vector<uint64_t> slots = message.getArray<uint64_t>();
+        if (values.size() != rows * best.n_elem || second.n_elem != best.n_elem || slots.size() != best.n_elem) {
+            throw std::runtime_error("error: malformed shard references");
+        }
+        coordinates = arma::mat(values.data(), rows, best.n_elem);
+        assignment.set_size(slots.size());
+        for (size_t i = 0; i < slots.size(); i++) {
+            assignment(i) = slots[i];
+        }
+    }
+};
+
+/**
+ *  \brief Worker process of sharded BanditPAM.
+ *
+ *  Holds one shard of the datapoints together with their best and second
+ *  best distances and assignments to the current medoids, which never leave
+ *  the worker except as part of a sampled reference batch. While many arms
+ *  are live the worker estimates the arms of its own datapoints over a
+ *  broadcast batch; once few are left, their coordinates are sent to every
+ *  worker once and cached, and each worker sums over its own references.
+ *  Distances are computed over tiles of at most blockCols datapoints, so the
+ *  worker copies no more than a tile of its shard at a time.
+ */
+class ShardWorker {
+  public:
+    explicit ShardWorker(const arma::mat& shard);
+
+    void serve(const std::string& address);
+
+  private:
+    void hello(ShardMessage& request, ShardMessage& reply);
+
+    void points(ShardMessage& request, ShardMessage& reply);
+
+    void coordinates(ShardMessage& request);
+
+    void sampleReferences(ShardMessage& request, ShardMessage& reply);
+
+    void buildEstimate(ShardMessage& request, ShardMessage& reply);
+
+    void swapEstimate(ShardMessage& request, ShardMessage& reply);
+
+    void addMedoid(ShardMessage& request, ShardMessage& reply);
+
+    void setMedoids(ShardMessage& request, ShardMessage& reply);
+
+    void buildSums(
+      const arma::mat& candidates,
+      size_t start,
+      const ShardReferences& refs,
+      bool useAbsolute,
+      arma::vec& sum,
+      arma::vec& sumSq);
+
+    void swapSums(
+      const arma::mat& candidates,
+      size_t start,
+      const ShardReferences& refs,
+      const std::vector<uint64_t>& arms,
+      const std::vector<size_t>& firstArm,
+      size_t nMedoids,
+      arma::vec& sum,
+      arma::vec& sumSq);
+
+    template <typename Fn>
+    void forReferences(bool broadcast, const ShardReferences& batch, const arma::uvec& local, Fn fn);
+
+    void pairwise(const arma::mat& left, const arma::mat& right, arma::mat& out);
+
+    const double* point(uint64_t index) const;
+
+    arma::mat gather(const std::vector<uint64_t>& indices, size_t start, size_t end) const;
+
+    ShardReferences localReferences(const arma::uvec& local, size_t start, size_t end) const;
+
+    arma::uvec references(uint64_t batch);
+
+    template <typename Fn>
+    void withLossFn(const arma::rowvec& sqNorms, Fn fn);
+
+    arma::mat data; ///< shard, one datapoint per column
+
+    arma::uword nLocal; ///< datapoints of the shard
+
+    uint64_t offset = 0; ///< global index of the first datapoint of the shard
+
+    arma::mat candidates; ///< cached datapoints of other shards, one per column; has spare columns
+
+    arma::uword nCached = 0; ///< filled columns of candidates
+
+    std::unordered_map<uint64_t, arma::uword> cached; ///< column of candidates holding each cached datapoint
+
+    LossType lossType = LossType::L2; ///< distance of the session
+
+    int lp = 2; ///< exponent when lossType is LossType::LP
+
+    ReferenceSampler sampler; ///< draws the shard's reference batches
+
+    arma::rowvec bestDistances; ///< distance of each datapoint of the shard to its medoid
+
+    arma::rowvec secondDistances; ///< distance of each datapoint of the shard to its second closest medoid
+
+    arma::urowvec assignments; ///< medoid slot of each datapoint of the shard
+
+    const size_t blockCols = 4096; ///< max datapoints of a shard copied into one block of distances
+};
+
+/**
+ *  \brief Coordinator side of sharded BanditPAM.
+ *
+ *  Connects to the workers, whose shards are numbered in the order of their
+ *  addresses, and turns arm estimates and medoid updates into requests to
+ *  every worker. The coordinator holds no shard: it holds at most one
+ *  reference batch, or the coordinates one owner returns for a pruned set
+ *  of candidates while it forwards them.
+ */
+class ShardCoordinator {
+  public:
+    ShardCoordinator(const std::vector<std::string>& addresses, LossType lossType, int lp, size_t seed);
+
+    ~ShardCoordinator();
+
+    ShardCoordinator(const ShardCoordinator&) = delete;
+
+    ShardCoordinator& operator=(const ShardCoordinator&) = delete;
+
+    arma::uword size() const;
+
+    ArmSums buildEstimate(const arma::uvec& arms, size_t batch, bool useAbsolute);
+
+    ArmSums swapEstimate(const arma::uvec& arms, size_t nMedoids, size_t batch);
+
+    double addMedoid(arma::uword index);
+
+    double setMedoids(const arma::rowvec& medoidIndices);
+
+    arma::rowvec labels();
+
+  private:
+    ArmSums estimate(ShardOp op, const arma::uvec& arms, size_t armsPerCandidate, size_t batch, const ShardMessage& parameters);
+
+    ShardMessage sampleReferences(size_t batch, double& count);
+
+    void shareCoordinates(const arma::uvec& candidates);
+
+    size_t share(size_t batch, size_t w) const;
+
+    size_t owner(arma::uword index) const;
+
+    std::vector<std::unique_ptr<ShardConnection>> workers; ///< connection to each worker
+
+    std::vector<arma::uword> offsets; ///< global index of the first datapoint of each shard, then N
+
+    std::vector<std::vector<bool>> known; ///< whether each worker holds each datapoint
+
+    arma::uword dimension = 0; ///< coordinates of each datapoint
+};
+
+#endif // SHARDED_H_
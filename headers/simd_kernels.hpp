@@ -0,0 +1,49 @@
+#ifndef SIMD_KERNELS_H_
+#define SIMD_KERNELS_H_
+
+#include <cstddef>
+
+/**
+ *  \brief Vectorized distance kernels with runtime CPU dispatch.
+ *
+ *  Every kernel is compiled once per instruction set (scalar, SSE2, AVX2,
+ *  AVX-512). The widest variant supported by the host is selected when the
+ *  library is loaded, so a single build runs on any x86-64 machine. Setting
+ *  the BANDITPAM_SIMD environment variable to "scalar", "sse2", "avx2" or
+ *  "avx512" caps the selected instruction set.
+ */
+namespace simd {
+
+/**
+ *  \brief Table of distance kernels for the active instruction set.
+ *
+ *  Kernels read two columns of element type eT and always return a double.
+ */
+template <typename eT>
+struct DistanceKernels {
+    typedef double (*KernelFn)(const eT* a, const eT* b, size_t n);
+
+    KernelFn l1;           ///< sum of |a_i - b_i|
+    KernelFn sqeuclidean;  ///< sum of (a_i - b_i)^2
+    KernelFn linf;         ///< max of |a_i - b_i|
+    KernelFn cos;          ///< a.b / (|a| |b|)
+    const char* isa;       ///< name of the selected instruction set
+};
+
+/*! \brief Returns the kernel table selected for this host.
+ *
+ *  Returns the kernel table of element type eT selected for this host. The
+ *  CPU is only queried once; later calls return the cached table.
+ */
+template <typename eT>
+const DistanceKernels<eT>& kernels();
+
+template <>
+const DistanceKernels<double>& kernels<double>();
+
+template <>
+const DistanceKernels<float>& kernels<float>();
+
+} // namespace simd
+
+#endif // SIMD_KERNELS_H_
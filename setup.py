@@ -144,7 +144,11 @@ ext_modules = [
     Extension(
         'BanditPAM',
         sorted([os.path.join('src', 'kmedoids_ucb.cpp'),
-                os.path.join('src', 'kmeds_pywrapper.cpp')]),
+                os.path.join('src', 'kmeds_pywrapper.cpp'),
+                os.path.join('src', 'simd_kernels.cpp'),
+                os.path.join('src', 'mapped_matrix.cpp'),
+                os.path.join('src', 'numa_placement.cpp'),
+                os.path.join('src', 'sharded.cpp')]),
         include_dirs=[
             get_pybind_include(),
             get_numpy_include(),
@@ -189,5 +193,14 @@ setup(
         "License :: OSI Approved :: MIT License",
         "Operating System :: OS Independent",
     ],
-    headers=[os.path.join('headers', 'kmedoids_ucb.hpp')],
+    headers=[os.path.join('headers', 'kmedoids_ucb.hpp'),
+             os.path.join('headers', 'arm_set.hpp'),
+             os.path.join('headers', 'distances.hpp'),
+             os.path.join('headers', 'distance_cache.hpp'),
+             os.path.join('headers', 'simd_kernels.hpp'),
+             os.path.join('headers', 'mapped_matrix.hpp'),
+             os.path.join('headers', 'sampler.hpp'),
+             os.path.join('headers', 'scratch_arena.hpp'),
+             os.path.join('headers', 'numa_placement.hpp'),
+             os.path.join('headers', 'sharded.hpp')],
 )
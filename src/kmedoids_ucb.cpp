@@ -6,11 +6,16 @@
  *
  */
 #include "kmedoids_ucb.hpp"
+#include "sharded.hpp"
 
 #include <carma.h>
 #include <armadillo>
+#include <algorithm>
+#include <exception>
+#include <memory>
 #include <unordered_map>
 #include <regex>
+#include <vector>
 //#include <sstream>
 
 /**
@@ -21,19 +26,23 @@
  *
  *  @param n_medoids Number of medoids/clusters to create
  *  @param algorithm Algorithm used to find medoids; options are "BanditPAM" for
- *  the "Bandit-PAM" algorithm, or "naive" to use the naive method
+ *  the "Bandit-PAM" algorithm, "FasterPAM" for Bandit-PAM with eager swaps, or
+ *  "naive" to use the naive method
  *  @param verbosity Verbosity of the algorithm, 0 will have no log file
  *  emitted, 1 will emit a log file
  *  @param max_iter The maximum number of iterations the algorithm runs for
  *  @param logFilename The name of the output log file
+ *  @param seed Seed of the random reference batches
  */
 KMedoids::KMedoids(int n_medoids, std::string algorithm, int verbosity,
-                                          int max_iter, std::string logFilename
+                                          int max_iter, std::string logFilename,
+                                          size_t seed
     ): n_medoids(n_medoids),
        algorithm(algorithm),
        max_iter(max_iter),
        verbosity(verbosity),
-       logFilename(logFilename) {
+       logFilename(logFilename),
+       seed(seed) {
   KMedoids::checkAlgorithm(algorithm);
 }
 
@@ -53,9 +62,11 @@ KMedoids::~KMedoids() {;}
  */
 void KMedoids::checkAlgorithm(std::string algorithm) {
   if (algorithm == "BanditPAM") {
-    fitFn = &KMedoids::fit_bpam;
+    algorithmType = AlgorithmType::BANDITPAM;
   } else if (algorithm == "naive") {
-    fitFn = &KMedoids::fit_naive;
+    algorithmType = AlgorithmType::NAIVE;
+  } else if (algorithm == "FasterPAM") {
+    algorithmType = AlgorithmType::FASTERPAM;
   } else {
     throw "unrecognized algorithm";
   }
@@ -101,35 +112,211 @@ int KMedoids::getSteps() {
   return steps;
 }
 
+/**
+ *  \brief Returns why the swap step stopped
+ *
+ *  Returns the reason the swap step of the last call to KMedoids::fit
+ *  stopped: convergence, max_iter, the time budget, the loss tolerance or a
+ *  cancellation
+ */
+StopReason KMedoids::getStopReason() {
+  return stopReason;
+}
+
+/**
+ *  \brief Returns the number of distance cache hits
+ *
+ *  Returns the number of distances served by the distance cache during the
+ *  last call to KMedoids::fit
+ */
+size_t KMedoids::getCacheHits() {
+  return cacheHits;
+}
+
+/**
+ *  \brief Returns the number of distance cache misses
+ *
+ *  Returns the number of distances the distance cache did not hold, and which
+ *  were therefore computed, during the last call to KMedoids::fit
+ */
+size_t KMedoids::getCacheMisses() {
+  return cacheMisses;
+}
+
+/**
+ *  \brief Returns the number of distance evaluations
+ *
+ *  Returns the number of distances evaluated during the last call to
+ *  KMedoids::fit, excluding those served by the distance cache and those of
+ *  the pilot
+ */
+size_t KMedoids::getDistanceCalls() {
+  return distanceCalls;
+}
+
+/**
+ *  \brief Returns the number of distance evaluations of the build step
+ *
+ *  Returns the number of distances evaluated by the build step during the
+ *  last call to KMedoids::fit
+ */
+size_t KMedoids::getBuildDistanceCalls() {
+  return buildDistanceCalls;
+}
+
+/**
+ *  \brief Returns the number of distance evaluations of the swap step
+ *
+ *  Returns the number of distances evaluated by the swap step during the
+ *  last call to KMedoids::fit
+ */
+size_t KMedoids::getSwapDistanceCalls() {
+  return distanceCalls - buildDistanceCalls;
+}
+
 /**
  *  \brief Sets the loss function
  *
- *  Sets the loss function used during KMedoids::fit
+ *  Sets the loss function used during KMedoids::fit. An unrecognized loss
+ *  is reported and leaves the loss function unchanged.
  *
  *  @param loss Loss function to be used e.g. L2
  */
 void KMedoids::setLossFn(std::string loss) {
-  if (std::regex_match(loss, std::regex("L\\d*"))) {
-      loss = loss.substr(1);
-  }
   try {
-    if (loss == "manhattan") {
-        lossFn = &KMedoids::manhattan;
-    } else if (loss == "cos") {
-        lossFn = &KMedoids::cos;
-    } else if (loss == "inf") {
-        lossFn = &KMedoids::LINF;
-    } else if (std::isdigit(loss.at(0))) {
-        lossFn = &KMedoids::LP;
-        lp     = atoi(loss.c_str());
-    } else {
-        throw std::invalid_argument("error: unrecognized loss function");
-    }
+    parseLossFn(loss);
   } catch (std::invalid_argument& e) {
       std::cout << e.what() << std::endl;
     }
 }
 
+/**
+ *  \brief Sets the loss function, throwing on an unrecognized one
+ *
+ *  @param loss Loss function to be used e.g. L2
+ */
+void KMedoids::parseLossFn(std::string loss) {
+  if (std::regex_match(loss, std::regex("L\\d*"))) {
+      loss = loss.substr(1);
+  }
+  if (loss == "manhattan") {
+      lossType = LossType::L1;
+  } else if (loss == "cos") {
+      lossType = LossType::COS;
+  } else if (loss == "inf") {
+      lossType = LossType::LINF;
+  } else if (loss == "precomputed") {
+      lossType = LossType::PRECOMPUTED;
+  } else if (std::isdigit(loss.at(0))) {
+      lp = atoi(loss.c_str());
+      if (lp == 1) {
+          lossType = LossType::L1;
+      } else if (lp == 2) {
+          lossType = LossType::L2;
+      } else {
+          lossType = LossType::LP;
+      }
+  } else {
+      throw std::invalid_argument("error: unrecognized loss function");
+  }
+}
+
+/**
+ *  \brief Wraps the distance policy for mapped data in a PrefetchedDistance
+ *
+ *  Calls fn with lossFn. Only double precision dense data can be mapped, so
+ *  other matrix types never instantiate the prefetching engine.
+ *
+ *  @param data Transposed input data the policy will be evaluated on; only
+ *  its type is used, to pick the overload
+ *  @param lossFn Distance policy
+ *  @param fn Generic callable taking the distance policy
+ */
+template <typename T, typename Distance, typename Fn>
+void KMedoids::prefetchMapped(const T& /* data */, const Distance& lossFn, Fn fn) {
+  fn(lossFn);
+}
+
+template <typename Distance, typename Fn>
+void KMedoids::prefetchMapped(const arma::mat& /* data */, const Distance& lossFn, Fn fn) {
+  if (mappedData == nullptr) {
+    fn(lossFn);
+    return;
+  }
+  fn(PrefetchedDistance<Distance>(lossFn, *mappedData));
+}
+
+/**
+ *  \brief Instantiates the engine with the selected distance policy
+ *
+ *  Calls fn with the distance policy matching the loss chosen by
+ *  KMedoids::setLossFn. The choice is made once per KMedoids::fit, so every
+ *  distance evaluation inside fn is a direct, inlinable call. The per-point
+ *  norms of the L2 and cosine policies are kept in sqNorms across calls, so
+ *  KMedoids::partial_fit only computes those of the appended points. When a
+ *  cache budget is set, the policy is wrapped in a CachedDistance whose cache
+ *  lives for this call. Policies over mapped data are wrapped in a
+ *  PrefetchedDistance. Every distance evaluation is counted in
+ *  distanceCalls.
+ *
+ *  @param data Transposed input data the policy will be evaluated on, dense
+ *  or sparse
+ *  @param fn Generic callable taking the distance policy
+ */
+template <typename T, typename Fn>
+void KMedoids::dispatchLossFn(const T& data, Fn fn) {
+  typedef typename T::elem_type eT;
+  cacheHits = 0;
+  cacheMisses = 0;
+  buildDistanceCalls = 0;
+  DistanceCounter counter;
+  distanceCounter = &counter;
+  if ((lossType == LossType::L2 || lossType == LossType::COS) && sqNorms.n_elem != data.n_cols) {
+    sqNorms = column_sq_norms(data);
+  }
+  auto withCache = [&](const auto& lossFn) {
+    // lookups would cost as much as the precomputed matrix itself
+    if (cacheBytes == 0 || lossType == LossType::PRECOMPUTED) {
+      fn(lossFn);
+      return;
+    }
+    DistanceCache cache(cacheBytes);
+    fn(CachedDistance<std::decay_t<decltype(lossFn)>>(lossFn, cache));
+    cacheHits = cache.hits();
+    cacheMisses = cache.misses();
+  };
+  // cached distances are not read from the mapping, so the cache is outermost
+  auto withPrefetch = [&](const auto& lossFn) {
+    prefetchMapped(data, lossFn, withCache);
+  };
+  // counts the distances actually evaluated, innermost
+  auto withCount = [&](const auto& lossFn) {
+    withPrefetch(CountedDistance<std::decay_t<decltype(lossFn)>>(lossFn, counter));
+  };
+  switch (lossType) {
+    case LossType::L1:
+      withCount(L1Distance<eT>());
+      break;
+    case LossType::L2:
+      withCount(L2Distance<eT>(sqNorms));
+      break;
+    case LossType::LP:
+      withCount(LpDistance<eT>(lp));
+      break;
+    case LossType::LINF:
+      withCount(LinfDistance<eT>());
+      break;
+    case LossType::COS:
+      withCount(CosDistance<eT>(sqNorms));
+      break;
+    case LossType::PRECOMPUTED:
+      withCount(PrecomputedDistance<eT>());
+      break;
+  }
+  distanceCalls = counter.total();
+  distanceCounter = nullptr;
+}
+
 /**
  *  \brief Returns the number of medoids
  *
@@ -165,6 +352,7 @@ std::string KMedoids::getAlgorithm() {
  *  @param new_alg New algorithm to use
  */
 void KMedoids::setAlgorithm(std::string new_alg) {
+  KMedoids::checkAlgorithm(new_alg);
   algorithm = new_alg;
 }
 
@@ -233,6 +421,383 @@ void KMedoids::setLogFilename(std::string new_lname) {
   logFilename = new_lname;
 }
 
+/**
+ *  \brief Returns the distance cache budget
+ *
+ *  Returns the number of bytes the distance cache may use during
+ *  KMedoids::fit; 0 means distances are not cached.
+ */
+size_t KMedoids::getCacheBytes() {
+  return cacheBytes;
+}
+
+/**
+ *  \brief Sets the distance cache budget
+ *
+ *  Sets the number of bytes the distance cache may use during KMedoids::fit.
+ *  Cached distances are reused across the build and swap steps, trading
+ *  memory for distance evaluations; 0 disables the cache.
+ *
+ *  @param new_bytes New byte budget of the cache
+ */
+void KMedoids::setCacheBytes(size_t new_bytes) {
+  cacheBytes = new_bytes;
+}
+
+/**
+ *  \brief Returns the batch size
+ *
+ *  Returns the number of reference points sampled per arm in each round of
+ *  the build and swap steps
+ */
+size_t KMedoids::getBatchSize() {
+  return batchSize;
+}
+
+/**
+ *  \brief Sets the batch size
+ *
+ *  Sets the number of reference points sampled per arm in each round of the
+ *  build and swap steps; with adaptive batches, the batch of the first round
+ *
+ *  @param new_size New batch size
+ */
+void KMedoids::setBatchSize(size_t new_size) {
+  batchSize = new_size;
+}
+
+/**
+ *  \brief Returns the build confidence
+ *
+ *  Returns the constant scaling the confidence bounds of the build step, as
+ *  set or as chosen by the pilot during the last KMedoids::fit
+ */
+size_t KMedoids::getBuildConfidence() {
+  return buildConfidence;
+}
+
+/**
+ *  \brief Sets the build confidence
+ *
+ *  Sets the constant scaling the confidence bounds of the build step; larger
+ *  values lower the error probability at the cost of more distance calls
+ *
+ *  @param new_confidence New build confidence
+ */
+void KMedoids::setBuildConfidence(size_t new_confidence) {
+  buildConfidence = new_confidence;
+}
+
+/**
+ *  \brief Returns the swap confidence
+ *
+ *  Returns the constant scaling the confidence bounds of the swap step, as
+ *  set or as chosen by the pilot during the last KMedoids::fit
+ */
+size_t KMedoids::getSwapConfidence() {
+  return swapConfidence;
+}
+
+/**
+ *  \brief Sets the swap confidence
+ *
+ *  Sets the constant scaling the confidence bounds of the swap step; larger
+ *  values lower the error probability at the cost of more distance calls
+ *
+ *  @param new_confidence New swap confidence
+ */
+void KMedoids::setSwapConfidence(size_t new_confidence) {
+  swapConfidence = new_confidence;
+}
+
+/**
+ *  \brief Returns whether batches are adaptive
+ *
+ *  Returns whether the batch of each bandit round grows as arms are
+ *  eliminated
+ */
+bool KMedoids::getAdaptiveBatch() {
+  return adaptiveBatch;
+}
+
+/**
+ *  \brief Sets whether batches are adaptive
+ *
+ *  With adaptive batches, each round of the build and swap steps samples
+ *  batchSize x (arms at the start) / (arms still in the race) reference
+ *  points per arm, so the work of a round stays roughly constant while the
+ *  race narrows down
+ *
+ *  @param new_adaptive Whether batches are adaptive
+ */
+void KMedoids::setAdaptiveBatch(bool new_adaptive) {
+  adaptiveBatch = new_adaptive;
+}
+
+/**
+ *  \brief Returns the target error probability of the pilot
+ *
+ *  Returns the error probability the pilot tunes the confidences for; 0
+ *  means the pilot is disabled
+ */
+double KMedoids::getPilotErrorRate() {
+  return pilotErrorRate;
+}
+
+/**
+ *  \brief Sets the target error probability of the pilot
+ *
+ *  When positive, KMedoids::fit first runs a pilot on subsamples of the data
+ *  and sets the build and swap confidences to the cheapest scaling of their
+ *  current values whose pilot runs miss the most conservative medoids at most
+ *  this often (see KMedoids::pilot_confidence)
+ *
+ *  @param new_rate New target error probability, 0 to disable the pilot
+ */
+void KMedoids::setPilotErrorRate(double new_rate) {
+  pilotErrorRate = new_rate;
+}
+
+/**
+ *  \brief Returns the time budget
+ *
+ *  Returns the number of seconds KMedoids::fit may run before its swap step
+ *  stops; 0 means no limit
+ */
+double KMedoids::getTimeBudget() {
+  return timeBudget;
+}
+
+/**
+ *  \brief Sets the time budget
+ *
+ *  Sets the number of seconds KMedoids::fit may run, counted from its start.
+ *  The build step always completes; the swap step stops at the first check
+ *  past the budget and keeps the best medoids found so far.
+ *
+ *  @param new_budget New time budget in seconds, 0 for no limit
+ */
+void KMedoids::setTimeBudget(double new_budget) {
+  timeBudget = new_budget;
+}
+
+/**
+ *  \brief Returns the loss tolerance
+ *
+ *  Returns the relative loss improvement below which the swap step stops;
+ *  0 means the swap step runs until convergence or max_iter
+ */
+double KMedoids::getLossTolerance() {
+  return lossTolerance;
+}
+
+/**
+ *  \brief Sets the loss tolerance
+ *
+ *  The swap step stops after an iteration that lowers the loss by less than
+ *  this fraction of the loss before it
+ *
+ *  @param new_tolerance New relative loss tolerance, 0 to disable
+ */
+void KMedoids::setLossTolerance(double new_tolerance) {
+  lossTolerance = new_tolerance;
+}
+
+/**
+ *  \brief Returns the loss of the fitted medoids
+ *
+ *  Returns the total distance of the datapoints of the last fit to their
+ *  closest final medoid, evaluated in parallel on the data the model keeps.
+ *  The distance counts and cache statistics of the fit are left unchanged.
+ */
+double KMedoids::loss() {
+  if (nStored == 0 || medoid_indices_final.n_elem == 0) {
+    throw std::invalid_argument("error: loss requires a model fitted on data it keeps; precomputed and mapped data are not kept");
+  }
+  const size_t calls = distanceCalls;
+  const size_t build_calls = buildDistanceCalls;
+  const size_t hits = cacheHits;
+  const size_t misses = cacheMisses;
+  double total = 0;
+  auto run = [&](const auto& points) {
+    dispatchLossFn(points, [&](const auto& lossFn) {
+      total = calc_loss(points, medoid_indices_final, lossFn);
+    });
+  };
+  if (data.n_elem > 0) {
+    run(arma::mat(data.memptr(), data.n_rows, nStored, false, true));
+  } else if (fdata.n_elem > 0) {
+    run(arma::fmat(fdata.memptr(), fdata.n_rows, nStored, false, true));
+  } else {
+    run(spdata);
+  }
+  distanceCalls = calls;
+  buildDistanceCalls = build_calls;
+  cacheHits = hits;
+  cacheMisses = misses;
+  return total;
+}
+
+/**
+ *  \brief Returns whether fits run in NUMA mode
+ */
+bool KMedoids::getNumaMode() {
+  return numaMode;
+}
+
+/**
+ *  \brief Sets whether fits run in NUMA mode
+ *
+ *  In NUMA mode every fit pins the OpenMP threads to CPUs spread over the
+ *  NUMA nodes and transposes the data in parallel, so each datapoint is
+ *  first touched, and placed, on the node of the thread that scans it.
+ *
+ *  @param new_mode Whether to run in NUMA mode
+ */
+void KMedoids::setNumaMode(bool new_mode) {
+  numaMode = new_mode;
+}
+
+/**
+ *  \brief Returns the seed
+ *
+ *  Returns the seed the reference batches of each fit are drawn from
+ */
+size_t KMedoids::getSeed() {
+  return seed;
+}
+
+/**
+ *  \brief Sets the seed
+ *
+ *  Sets the seed the reference batches of each fit are drawn from; fits with
+ *  equal seeds and inputs draw equal batches, whatever the number of threads
+ *
+ *  @param new_seed New seed
+ */
+void KMedoids::setSeed(size_t new_seed) {
+  seed = new_seed;
+}
+
+/**
+ *  \brief Sets the flag that cancels fits
+ *
+ *  While flag is set, the swap step of a running fit stops at its next
+ *  round, keeping the best medoids found so far, and reports
+ *  StopReason::CANCELLED. The flag is read from the fitting thread, so it may
+ *  be set from any other thread; it must outlive the fits that use it.
+ *
+ *  @param flag Cancel flag, or nullptr to make fits uncancellable
+ */
+void KMedoids::setCancelFlag(const std::atomic<bool>* flag) {
+  cancelFlag = flag;
+}
+
+/**
+ *  \brief Returns whether the time budget of the running fit is spent
+ */
+bool KMedoids::outOfTime() {
+  return timeBudget > 0 &&
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - fitStart).count() >= timeBudget;
+}
+
+/**
+ *  \brief Returns whether the swap step must stop now
+ *
+ *  Checked between rounds of the swap step; sets stopReason when the fit was
+ *  cancelled or its time budget is spent.
+ */
+bool KMedoids::interrupted() {
+  if (cancelFlag != nullptr && cancelFlag->load(std::memory_order_relaxed)) {
+    stopReason = StopReason::CANCELLED;
+    return true;
+  }
+  if (outOfTime()) {
+    stopReason = StopReason::TIME_BUDGET;
+    return true;
+  }
+  return false;
+}
+
+/**
+ *  \brief Decides whether the swap step stops before convergence
+ *
+ *  Called after each swap iteration with the losses tracked in
+ *  LogHelper::loss_swap; sets stopReason when the swap step should stop.
+ *
+ *  @param previousLoss Loss before the iteration
+ *  @param loss Loss after the iteration
+ */
+bool KMedoids::stopEarly(double previousLoss, double loss) {
+  if (interrupted()) {
+    return true;
+  }
+  if (lossTolerance > 0 && previousLoss - loss < lossTolerance * previousLoss) {
+    stopReason = StopReason::LOSS_TOLERANCE;
+    return true;
+  }
+  return false;
+}
+
+/**
+ *  \brief Returns the number of chunks each target's batch is split into
+ *
+ *  With many targets every target is one tile of work. With few, their
+ *  reference batches are split so there are enough (target x reference
+ *  chunk) tiles for dynamic scheduling to keep every thread busy, without
+ *  chunks shorter than minChunkRefs references.
+ *
+ *  @param targets Number of targets of the round
+ *  @param refs Number of references in the batch
+ */
+size_t KMedoids::referenceChunks(size_t targets, size_t refs) {
+  const size_t wanted = 4 * size_t(omp_get_max_threads());
+  if (targets == 0 || targets >= wanted) {
+    return 1;
+  }
+  const size_t max_chunks = std::max<size_t>(1, refs / minChunkRefs);
+  return std::min(max_chunks, (wanted + targets - 1) / targets);
+}
+
+/**
+ *  \brief Returns the batch of the next bandit round
+ *
+ *  Returns batchSize, or with adaptive batches batchSize scaled by the
+ *  fraction of arms eliminated so far, capped at N.
+ *
+ *  @param activeArms Arms still in the race
+ *  @param totalArms Arms at the start of the race
+ *  @param N Number of reference points
+ */
+size_t KMedoids::roundBatchSize(size_t activeArms, size_t totalArms, size_t N) {
+  if (!adaptiveBatch || activeArms == 0) {
+    return std::min(batchSize, N);
+  }
+  const double grown = double(batchSize) * totalArms / activeArms;
+  return std::max(std::min(batchSize, N), size_t(std::min(grown, double(N))));
+}
+
+/**
+ * \brief Returns the stored data of the given matrix type
+ *
+ * Returns the data member holding the transposed input data for matrix
+ * type T.
+ */
+template <>
+arma::mat& KMedoids::storedData<arma::mat>() {
+  return data;
+}
+
+template <>
+arma::fmat& KMedoids::storedData<arma::fmat>() {
+  return fdata;
+}
+
+template <>
+arma::sp_mat& KMedoids::storedData<arma::sp_mat>() {
+  return spdata;
+}
+
 /**
  * \brief Finds medoids for the input data under identified loss function
  *
@@ -242,43 +807,814 @@ void KMedoids::setLogFilename(std::string new_lname) {
  * @param input_data Input data to find the medoids of
  * @param loss The loss function used during medoid computation
  */
-void KMedoids::fit(arma::mat input_data, std::string loss) {
+void KMedoids::fit(const arma::mat& input_data, std::string loss) {
+  KMedoids::fit_impl(input_data, loss, arma::urowvec());
+}
+
+/**
+ * \brief Finds medoids for input data, starting from given medoids
+ *
+ * Warm-started KMedoids::fit: the build step is skipped and the swap step
+ * starts from initial_medoids. The number of medoids is set to the number of
+ * initial medoids.
+ *
+ * @param input_data Input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ * @param initial_medoids Distinct indices of the datapoints to start from
+ */
+void KMedoids::fit(const arma::mat& input_data, std::string loss, const arma::urowvec& initial_medoids) {
+  KMedoids::fit_impl(input_data, loss, initial_medoids);
+}
+
+/**
+ * \brief Finds medoids for single precision input data
+ *
+ * Same as the double precision KMedoids::fit, but the data is stored and
+ * every distance is evaluated in single precision. Losses and confidence
+ * bounds are still accumulated in double precision.
+ *
+ * @param input_data Input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ */
+void KMedoids::fit(const arma::fmat& input_data, std::string loss) {
+  KMedoids::fit_impl(input_data, loss, arma::urowvec());
+}
+
+/**
+ * \brief Finds medoids for single precision input data, starting from given medoids
+ *
+ * Warm-started KMedoids::fit: the build step is skipped and the swap step
+ * starts from initial_medoids. The number of medoids is set to the number of
+ * initial medoids.
+ *
+ * @param input_data Input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ * @param initial_medoids Distinct indices of the datapoints to start from
+ */
+void KMedoids::fit(const arma::fmat& input_data, std::string loss, const arma::urowvec& initial_medoids) {
+  KMedoids::fit_impl(input_data, loss, initial_medoids);
+}
+
+/**
+ * \brief Finds medoids for sparse input data
+ *
+ * Same as the dense KMedoids::fit, but the data is kept in compressed sparse
+ * column form throughout. Distances are computed by merging the nonzero
+ * entries of the two datapoints, so the cost scales with the number of
+ * nonzeros rather than with the dimension.
+ *
+ * @param input_data Sparse input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ */
+void KMedoids::fit(const arma::sp_mat& input_data, std::string loss) {
+  KMedoids::fit_impl(input_data, loss, arma::urowvec());
+}
+
+/**
+ * \brief Finds medoids for sparse input data, starting from given medoids
+ *
+ * Warm-started KMedoids::fit: the build step is skipped and the swap step
+ * starts from initial_medoids. The number of medoids is set to the number of
+ * initial medoids.
+ *
+ * @param input_data Input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ * @param initial_medoids Distinct indices of the datapoints to start from
+ */
+void KMedoids::fit(const arma::sp_mat& input_data, std::string loss, const arma::urowvec& initial_medoids) {
+  KMedoids::fit_impl(input_data, loss, initial_medoids);
+}
+
+/**
+ * \brief Finds medoids for memory-mapped input data
+ *
+ * Out-of-core KMedoids::fit: the mapped matrix holds one datapoint per
+ * column, the transposed layout the algorithm works on, so it is read in
+ * place and never copied or held in memory as a whole. The kernel pages in
+ * the columns as they are read; the columns of each block of distances, such
+ * as a sampled reference batch, are prefetched together.
+ *
+ * @param input_data Mapped data, one datapoint per column; a precomputed
+ * dissimilarity matrix with the "precomputed" loss
+ * @param loss The loss function used during medoid computation
+ */
+void KMedoids::fit(const MappedMatrix& input_data, std::string loss) {
+  KMedoids::fit_impl(input_data.mat(), loss, arma::urowvec(), &input_data);
+}
+
+/**
+ * \brief Adds a batch of datapoints to a fitted model
+ *
+ * Appends newData to the data of the last KMedoids::fit, assigns the new
+ * datapoints to their closest medoids, then runs at most maxRounds bandit
+ * rounds racing the new datapoints as medoid candidates. A candidate that
+ * provably decreases the loss is swapped in and the race restarts. Distance
+ * evaluations scale with the size of the batch and the number of medoids,
+ * not with the number of datapoints fitted so far, except when a swap is
+ * committed and every datapoint is reassigned.
+ *
+ * @param newData New datapoints, one per row, with the dimension of the
+ * fitted data
+ * @param maxRounds Maximum number of sampling rounds of the bandit race
+ */
+void KMedoids::partial_fit(const arma::mat& newData, size_t maxRounds) {
+  KMedoids::partial_fit_impl(newData, maxRounds);
+}
+
+/**
+ * \brief Adds a batch of single precision datapoints to a fitted model
+ *
+ * Same as the double precision KMedoids::partial_fit, for a model fitted on
+ * single precision data.
+ *
+ * @param newData New datapoints, one per row, with the dimension of the
+ * fitted data
+ * @param maxRounds Maximum number of sampling rounds of the bandit race
+ */
+void KMedoids::partial_fit(const arma::fmat& newData, size_t maxRounds) {
+  KMedoids::partial_fit_impl(newData, maxRounds);
+}
+
+/**
+ * \brief Finds medoids for several numbers of medoids at once
+ *
+ * Equivalent to one KMedoids::fit per entry of k_values, but the greedy
+ * build step runs only once, up to the largest k: the first k medoids it
+ * picks are the build medoids for k. The swap steps of the different k start
+ * from those prefixes and run in parallel. Afterwards the model holds the fit
+ * of the largest k.
+ *
+ * @param input_data Input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ * @param k_values Numbers of medoids to find
+ * @return The fit of each entry of k_values, in the same order
+ */
+std::vector<PathResult> KMedoids::fit_path(const arma::mat& input_data, std::string loss, const std::vector<size_t>& k_values) {
+  return KMedoids::fit_path_impl(input_data, loss, k_values);
+}
+
+/**
+ * \brief Finds medoids of single precision data for several numbers of medoids
+ *
+ * Same as the double precision KMedoids::fit_path, with the data stored and
+ * every distance evaluated in single precision.
+ *
+ * @param input_data Input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ * @param k_values Numbers of medoids to find
+ * @return The fit of each entry of k_values, in the same order
+ */
+std::vector<PathResult> KMedoids::fit_path(const arma::fmat& input_data, std::string loss, const std::vector<size_t>& k_values) {
+  return KMedoids::fit_path_impl(input_data, loss, k_values);
+}
+
+/**
+ * \brief Finds medoids of sparse data for several numbers of medoids
+ *
+ * Same as the dense KMedoids::fit_path, with the data kept in compressed
+ * sparse column form.
+ *
+ * @param input_data Sparse input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ * @param k_values Numbers of medoids to find
+ * @return The fit of each entry of k_values, in the same order
+ */
+std::vector<PathResult> KMedoids::fit_path(const arma::sp_mat& input_data, std::string loss, const std::vector<size_t>& k_values) {
+  return KMedoids::fit_path_impl(input_data, loss, k_values);
+}
+
+/**
+ * \brief Fits one model per dataset on the shared thread pool
+ *
+ * Fits models[i] with kValues[i] medoids on inputData[i], each with the
+ * settings of this model. Jobs of at most serialFitPoints datapoints run
+ * one per thread, so no job pays for starting parallel regions on tiny
+ * data; larger jobs then run one after the other, each on every thread.
+ * Each job draws from its own stream of the seed, so the medoids do not
+ * depend on which thread runs it. In NUMA mode the pool is pinned once
+ * for the small jobs, and each large job pins and places its own data.
+ * An unrecognized loss throws before any job runs.
+ *
+ * @param models Models to fit, one per dataset
+ * @param input_data Input data of each job
+ * @param k_values Number of medoids of each job
+ * @param loss The loss function used during medoid computation
+ */
+void KMedoids::fit_many(const std::vector<KMedoids*>& models, const std::vector<arma::mat>& input_data, const std::vector<size_t>& k_values, std::string loss) {
+  KMedoids::fit_many_impl(models, input_data, k_values, loss);
+}
+
+/**
+ * \brief Fits one model per single precision dataset on the shared thread pool
+ *
+ * Same as the double precision KMedoids::fit_many.
+ *
+ * @param models Models to fit, one per dataset
+ * @param input_data Input data of each job
+ * @param k_values Number of medoids of each job
+ * @param loss The loss function used during medoid computation
+ */
+void KMedoids::fit_many(const std::vector<KMedoids*>& models, const std::vector<arma::fmat>& input_data, const std::vector<size_t>& k_values, std::string loss) {
+  KMedoids::fit_many_impl(models, input_data, k_values, loss);
+}
+
+/**
+ * \brief Runs BanditPAM on datapoints sharded across worker processes
+ *
+ * Each worker (see ShardWorker) holds a shard of the datapoints, numbered in
+ * the order of workers, together with their best and second best distances
+ * to the medoids. Every round of the build and swap races asks the workers
+ * for the sums of the arm values over a batch of references sampled from
+ * every shard (see ShardCoordinator::estimate); this process only combines
+ * the sums and runs the elimination, and no worker receives more than the
+ * reference batches and pruned candidates of other shards. The
+ * model keeps no data, so KMedoids::loss and KMedoids::partial_fit are not
+ * available afterwards.
+ *
+ * @param workers Address of each worker, "unix:<path>" or "<host>:<port>"
+ * @param loss The loss function used during medoid computation
+ */
+void KMedoids::fit_sharded(const std::vector<std::string>& workers, std::string loss) {
+  fitStart = std::chrono::steady_clock::now();
+  KMedoids::setLossFn(loss);
+  if (lossType == LossType::PRECOMPUTED) {
+    throw std::invalid_argument("error: sharded fits do not support the precomputed loss");
+  }
+  if (algorithmType != AlgorithmType::BANDITPAM) {
+    throw std::invalid_argument("error: sharded fits only run the BanditPAM algorithm");
+  }
+  ShardCoordinator shards(workers, lossType, lp, seed);
+  const size_t N = shards.size();
+  if (N < size_t(n_medoids)) {
+    throw std::invalid_argument("error: fewer datapoints than medoids");
+  }
+  data.reset();
+  fdata.reset();
+  spdata.reset();
+  nStored = 0;
+  initialMedoids.reset();
+  distanceCalls = 0;
+  buildDistanceCalls = 0;
+  cacheHits = 0;
+  cacheMisses = 0;
+  steps = 0;
+
+  // build step, as KMedoids::build
+  double p = double(buildConfidence) * N; // reciprocal of
+  double log_p = std::log(double(buildConfidence) * N);
+  bool use_absolute = true;
+  const arma::uvec points = arma::regspace<arma::uvec>(0, N - 1);
+  arma::rowvec medoid_indices(n_medoids);
+  ArmSet arms;
+  double loss_value = 0;
+  for (size_t k = 0; k < size_t(n_medoids); k++) {
+    arms.reset(N);
+    const arma::vec sigma = shards.buildEstimate(points, batchSize, use_absolute).stddev();
+    while (arms.size() > 0) {
+      const size_t round_batch = roundBatchSize(arms.size(), N, N);
+      const size_t n_exact = arms.resolveExact(round_batch, N, [&](arma::uvec targets) {
+        return shards.buildEstimate(targets, 0, use_absolute).mean();
+      });
+      if (n_exact > 0) {
+        logHelper.comp_exact_build.push_back(n_exact);
+      }
+      if (arms.size() == 0) {
+        break;
+      }
+      arms.sample(round_batch, sigma, log_p, [&](arma::uvec targets) {
+        return shards.buildEstimate(targets, round_batch, use_absolute).mean();
+      });
+      arms.prune(arms.minUcb());
+    }
+    medoid_indices(k) = arms.best();
+    loss_value = shards.addMedoid(medoid_indices(k));
+    use_absolute = false;
+    logHelper.loss_build.push_back(loss_value);
+    logHelper.p_build.push_back((float)1/(float)p);
+  }
+  medoid_indices_build = medoid_indices;
+
+  // swap step, as KMedoids::swap
+  p = double(N) * n_medoids * swapConfidence;
+  log_p = std::log(double(N) * n_medoids * swapConfidence);
+  const arma::uvec swaps = arma::regspace<arma::uvec>(0, N * n_medoids - 1);
+  loss_value = shards.setMedoids(medoid_indices);
+  double previous_loss = loss_value;
+  double best_loss = loss_value;
+  arma::rowvec best_medoids = medoid_indices;
+  stopReason = StopReason::CONVERGED;
+  size_t iter = 0;
+  bool swap_performed = true;
+  while (swap_performed && iter < size_t(max_iter)) {
+    iter++;
+    // arm n * n_medoids + k is entry (k, n), as in KMedoids::swap
+    const arma::vec arm_sigma = shards.swapEstimate(swaps, n_medoids, batchSize).stddev();
+    arma::mat sigma(arm_sigma.memptr(), n_medoids, N);
+    arms.reset(n_medoids * N);
+    bool stopped = false;
+    while (arms.size() > 0) {
+      const size_t round_batch = roundBatchSize(arms.size(), n_medoids * N, N);
+      const size_t n_exact = arms.resolveExact(round_batch, N, [&](arma::uvec targets) {
+        return shards.swapEstimate(targets, n_medoids, 0).mean();
+      });
+      if (n_exact > 0) {
+        logHelper.comp_exact_swap.push_back(n_exact);
+        arms.prune(arms.minUcb());
+      }
+      if (arms.size() == 0) {
+        break;
+      }
+      arms.sample(round_batch, sigma, log_p, [&](arma::uvec targets) {
+        return shards.swapEstimate(targets, n_medoids, round_batch).mean();
+      });
+      arms.prune(arms.minUcb());
+      if (interrupted()) {
+        stopped = true;
+        break;
+      }
+    }
+    if (stopped) {
+      break;
+    }
+    const arma::uword new_medoid = arms.best();
+    const size_t k = new_medoid % n_medoids;
+    const size_t n = new_medoid / n_medoids;
+    swap_performed = medoid_indices(k) != n;
+    steps++;
+    medoid_indices(k) = n;
+    if (swap_performed) {
+      loss_value = shards.setMedoids(medoid_indices);
+    }
+    sigma_log(sigma);
+    logHelper.loss_swap.push_back(loss_value);
+    logHelper.p_swap.push_back((float)1/(float)p);
+    if (loss_value < best_loss) {
+      best_loss = loss_value;
+      best_medoids = medoid_indices;
+    }
+    if (swap_performed && stopEarly(previous_loss, loss_value)) {
+      break;
+    }
+    previous_loss = loss_value;
+  }
+  if (stopReason == StopReason::CONVERGED && swap_performed) {
+    stopReason = StopReason::MAX_ITER;
+  }
+  const bool stopped_early = stopReason == StopReason::TIME_BUDGET ||
+                             stopReason == StopReason::LOSS_TOLERANCE ||
+                             stopReason == StopReason::CANCELLED;
+  if (stopped_early && best_loss < loss_value) {
+    medoid_indices = best_medoids;
+    loss_value = shards.setMedoids(medoid_indices);
+  }
+  if (logHelper.loss_swap.empty()) {
+    logHelper.loss_swap.push_back(loss_value);
+  }
+  medoid_indices_final = medoid_indices;
+  labels = shards.labels();
+  if (verbosity > 0) {
+      logHelper.init(logFilename);
+      logHelper.writeProfile(medoid_indices_build, medoid_indices_final, steps,
+                                                        logHelper.loss_swap.back());
+      logHelper.hlogFile << "Batch Size: " << batchSize
+                         << (adaptiveBatch ? " (adaptive)" : "") << '\n';
+      logHelper.hlogFile << "Build Confidence: " << buildConfidence << '\n';
+      logHelper.hlogFile << "Swap Confidence: " << swapConfidence << '\n';
+      logHelper.hlogFile << "Shards: " << workers.size() << '\n';
+      logHelper.hlogFile << "Loss: " << loss_value << '\n';
+      logHelper.close();
+  }
+}
+
+/**
+ * \brief Runs the selected algorithm for the given matrix type
+ *
+ * Stores the transposed input data, instantiates the engine with the selected
+ * distance policy and algorithm, and outputs logs if verbosity is >0. With the
+ * "precomputed" loss the input is an N x N dissimilarity matrix; it is read in
+ * place and never copied into the data members, as is mapped data.
+ *
+ * @param input_data Input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ * @param initial_medoids Medoids the swap step starts from, skipping the
+ * build step; empty to run the build step
+ * @param mapped Mapping input_data aliases, already transposed; null for
+ * data held in memory
+ */
+template <typename T>
+void KMedoids::fit_impl(const T& input_data, std::string loss, const arma::urowvec& initial_medoids, const MappedMatrix* mapped) {
+  fitStart = std::chrono::steady_clock::now();
+  sampler.seed(seed);
   KMedoids::setLossFn(loss);
-  (this->*fitFn)(input_data);
+  if (initial_medoids.n_elem > 0) {
+    // datapoints are the rows of the input, or its columns when precomputed
+    const arma::uword N = input_data.n_rows;
+    const arma::urowvec distinct = arma::unique(initial_medoids);
+    if (arma::any(initial_medoids >= N) || distinct.n_elem != initial_medoids.n_elem) {
+      throw std::invalid_argument("error: initial medoids must be distinct datapoint indices");
+    }
+    n_medoids = initial_medoids.n_elem;
+  }
+  initialMedoids = initial_medoids;
+  // the naive algorithm has no confidence bounds to tune
+  if (pilotErrorRate > 0 && algorithmType != AlgorithmType::NAIVE) {
+    pilot_confidence(input_data, loss, mapped != nullptr);
+  }
+  withInputData(input_data, mapped, [&](const T& points) {
+    dispatchLossFn(points, [&](const auto& lossFn) {
+      if (algorithmType == AlgorithmType::NAIVE) {
+        fit_naive(points, lossFn);
+      } else {
+        fit_bpam(points, lossFn);
+      }
+    });
+  });
   if (verbosity > 0) {
       logHelper.init(logFilename);
       logHelper.writeProfile(medoid_indices_build, medoid_indices_final, steps,
                                                         logHelper.loss_swap.back());
+      logHelper.hlogFile << "Batch Size: " << batchSize
+                         << (adaptiveBatch ? " (adaptive)" : "") << '\n';
+      logHelper.hlogFile << "Build Confidence: " << buildConfidence << '\n';
+      logHelper.hlogFile << "Swap Confidence: " << swapConfidence << '\n';
+      logHelper.hlogFile << "Distance Calls: " << distanceCalls
+                         << " (build: " << buildDistanceCalls
+                         << ", swap: " << distanceCalls - buildDistanceCalls << ")" << '\n';
       logHelper.close();
   }
 }
 
+/**
+ * \brief Appends a batch of datapoints to the stored data
+ *
+ * The stored data grows its capacity geometrically, so appending a batch
+ * copies the existing datapoints only once every doubling. The engine then
+ * sees a matrix aliasing the filled columns.
+ *
+ * @param new_data New datapoints, one per row
+ * @param max_rounds Maximum number of sampling rounds of the bandit race
+ */
+template <typename eT>
+void KMedoids::partial_fit_impl(const arma::Mat<eT>& new_data, size_t max_rounds) {
+  arma::Mat<eT>& stored = storedData<arma::Mat<eT>>();
+  if (nStored == 0 || medoid_indices_final.n_elem == 0) {
+    throw std::invalid_argument("error: partial_fit requires a model fitted on dense data of the same precision");
+  }
+  if (new_data.n_cols != stored.n_rows) {
+    throw std::invalid_argument("error: new datapoints must have as many columns as the fitted data");
+  }
+  if (new_data.n_rows == 0) {
+    return;
+  }
+  const arma::uword first_new = nStored;
+  const arma::uword N = nStored + new_data.n_rows;
+  if (N > stored.n_cols) {
+    arma::Mat<eT> grown(stored.n_rows, std::max<arma::uword>(N, 2 * stored.n_cols));
+    grown.cols(0, first_new - 1) = stored.cols(0, first_new - 1);
+    stored = std::move(grown);
+  }
+  stored.cols(first_new, N - 1) = arma::trans(new_data);
+  nStored = N;
+  const arma::Mat<eT> points(stored.memptr(), stored.n_rows, N, false, true);
+  if (sqNorms.n_elem == first_new) {
+    sqNorms = arma::join_rows(sqNorms, column_sq_norms(arma::Mat<eT>(points.cols(first_new, N - 1))));
+  }
+  dispatchLossFn(points, [&](const auto& lossFn) {
+    stream_swap(points, first_new, max_rounds, lossFn);
+  });
+}
+
+/**
+ * \brief Runs KMedoids::fit_path for the given matrix type
+ *
+ * @param input_data Input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ * @param k_values Numbers of medoids to find
+ * @return The fit of each entry of k_values, in the same order
+ */
+template <typename T>
+std::vector<PathResult> KMedoids::fit_path_impl(const T& input_data, std::string loss, const std::vector<size_t>& k_values) {
+  fitStart = std::chrono::steady_clock::now();
+  sampler.seed(seed);
+  KMedoids::setLossFn(loss);
+  // datapoints are the rows of the input, or its columns when precomputed
+  const arma::uword N = input_data.n_rows;
+  if (k_values.empty() ||
+      *std::min_element(k_values.begin(), k_values.end()) == 0 ||
+      *std::max_element(k_values.begin(), k_values.end()) > N) {
+    throw std::invalid_argument("error: numbers of medoids must be between 1 and the number of datapoints");
+  }
+  n_medoids = *std::max_element(k_values.begin(), k_values.end());
+  initialMedoids.reset();
+  std::vector<PathResult> results(k_values.size());
+  withInputData(input_data, nullptr, [&](const T& points) {
+    dispatchLossFn(points, [&](const auto& lossFn) {
+      fit_path_run(points, k_values, results, lossFn);
+    });
+  });
+  return results;
+}
+
+/**
+ * \brief Schedules the jobs of KMedoids::fit_many
+ *
+ * @param models Models to fit, one per dataset
+ * @param input_data Input data of each job
+ * @param k_values Number of medoids of each job
+ * @param loss The loss function used during medoid computation
+ */
+template <typename T>
+void KMedoids::fit_many_impl(const std::vector<KMedoids*>& models, const std::vector<T>& input_data, const std::vector<size_t>& k_values, std::string loss) {
+  if (models.size() != input_data.size() || k_values.size() != input_data.size()) {
+    throw std::invalid_argument("error: fit_many needs one model and one number of medoids per dataset");
+  }
+  // an unknown loss fails before any job runs
+  KMedoids::parseLossFn(loss);
+  std::vector<size_t> small_jobs;
+  std::vector<size_t> large_jobs;
+  for (size_t i = 0; i < models.size(); i++) {
+    KMedoids& model = *models[i];
+    model.n_medoids = k_values[i];
+    model.algorithm = algorithm;
+    model.algorithmType = algorithmType;
+    model.max_iter = max_iter;
+    // concurrent jobs would write the same log file
+    model.verbosity = 0;
+    model.logFilename = logFilename;
+    model.seed = RandomStream(seed, i).next();
+    model.batchSize = batchSize;
+    model.buildConfidence = buildConfidence;
+    model.swapConfidence = swapConfidence;
+    model.adaptiveBatch = adaptiveBatch;
+    model.pilotErrorRate = pilotErrorRate;
+    model.timeBudget = timeBudget;
+    model.lossTolerance = lossTolerance;
+    model.cacheBytes = cacheBytes;
+    model.numaMode = numaMode;
+    // datapoints are the rows of the input, or its columns when precomputed
+    (input_data[i].n_rows <= serialFitPoints ? small_jobs : large_jobs).push_back(i);
+  }
+  // the largest small jobs are handed out first, so no thread is left
+  // with a large one at the end
+  std::stable_sort(small_jobs.begin(), small_jobs.end(), [&](size_t a, size_t b) {
+    return input_data[a].n_rows > input_data[b].n_rows;
+  });
+
+  std::vector<std::exception_ptr> errors(models.size());
+  {
+    // the pool is pinned as a whole, never from inside a job; each small
+    // job then touches its data on the thread, and so the node, running it
+    std::unique_ptr<numa::ThreadPinning> pinning;
+    if (numaMode && !small_jobs.empty()) {
+      pinning.reset(new numa::ThreadPinning());
+    }
+    // the parallel regions of a small job run on its own thread only
+    const int levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(1);
+#pragma omp parallel for schedule(dynamic)
+    for (size_t j = 0; j < small_jobs.size(); j++) {
+      const size_t i = small_jobs[j];
+      models[i]->numaMode = false;
+      try {
+        models[i]->fit(input_data[i], loss);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+      models[i]->numaMode = numaMode;
+    }
+    omp_set_max_active_levels(levels);
+  }
+
+  for (size_t i : large_jobs) {
+    try {
+      models[i]->fit(input_data[i], loss);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  }
+  for (const std::exception_ptr& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+/**
+ * \brief Tunes the build and swap confidences on subsamples of the data
+ *
+ * Runs the selected algorithm on pilotRuns random subsamples of pilotSize
+ * datapoints, once for each candidate scaling of the current build and swap
+ * confidences. On each subsample the most conservative scaling is the
+ * reference, and a run of another scaling is an error when it ends at a
+ * higher loss. The confidences are then set to the scaling with the fewest
+ * distance calls among those whose error rate is at most pilotErrorRate; the
+ * bound N x k x confidence keeps the same meaning on the full data.
+ *
+ * @param input_data Input data to find the medoids of
+ * @param loss The loss function used during medoid computation
+ * @param transposed Whether input_data holds one datapoint per column
+ */
+template <typename T>
+void KMedoids::pilot_confidence(const T& input_data, std::string loss, bool transposed) {
+  // datapoints are the rows of the input, or its columns when transposed
+  const arma::uword N = transposed ? input_data.n_cols : input_data.n_rows;
+  const size_t n = std::min<size_t>(N, pilotSize);
+  if (n <= size_t(n_medoids)) {
+    return;
+  }
+  // candidate scalings, the most conservative last
+  const std::vector<double> scales = {0.001, 0.01, 0.1, 1, 10};
+  const size_t base_build = buildConfidence;
+  const size_t base_swap = swapConfidence;
+  std::vector<size_t> errors(scales.size(), 0);
+  std::vector<size_t> calls(scales.size(), 0);
+  for (size_t r = 0; r < pilotRuns; r++) {
+    const arma::uvec sample = arma::sort(sampler.draw(N, n));
+    const T subsample = pilotSample(input_data, sample, transposed);
+    std::vector<double> losses(scales.size());
+    for (size_t c = 0; c < scales.size(); c++) {
+      KMedoids pilot(n_medoids, algorithm, 0, max_iter, logFilename, sampler.next());
+      pilot.batchSize = batchSize;
+      pilot.adaptiveBatch = adaptiveBatch;
+      pilot.buildConfidence = std::max<size_t>(1, std::llround(base_build * scales[c]));
+      pilot.swapConfidence = std::max<size_t>(1, std::llround(base_swap * scales[c]));
+      pilot.fit(subsample, loss);
+      calls[c] += pilot.distanceCalls;
+      losses[c] = arma::accu(pilot.bestDistances);
+    }
+    for (size_t c = 0; c + 1 < scales.size(); c++) {
+      if (losses[c] > losses.back() * (1 + 1e-9)) {
+        errors[c]++;
+      }
+    }
+  }
+  size_t chosen = scales.size() - 1;
+  for (size_t c = 0; c < scales.size(); c++) {
+    if (double(errors[c]) / pilotRuns <= pilotErrorRate && calls[c] < calls[chosen]) {
+      chosen = c;
+    }
+  }
+  buildConfidence = std::max<size_t>(1, std::llround(base_build * scales[chosen]));
+  swapConfidence = std::max<size_t>(1, std::llround(base_swap * scales[chosen]));
+}
+
+/**
+ * \brief Draws the pilot subsample of dense data
+ *
+ * @param input_data Input data to find the medoids of
+ * @param sample Sorted indices of the datapoints of the subsample
+ * @param transposed Whether input_data holds one datapoint per column
+ * @return The subsample, one datapoint per row, or the dissimilarities
+ * between the sampled datapoints when precomputed
+ */
+template <typename eT>
+arma::Mat<eT> KMedoids::pilotSample(const arma::Mat<eT>& input_data, const arma::uvec& sample, bool transposed) {
+  if (lossType == LossType::PRECOMPUTED) {
+    return input_data.submat(sample, sample);
+  }
+  if (transposed) {
+    return arma::trans(input_data.cols(sample));
+  }
+  return input_data.rows(sample);
+}
+
+/**
+ * \brief Draws the pilot subsample of sparse data
+ *
+ * Gathers the compressed columns of the sampled datapoints directly, so the
+ * subsample costs as much as its nonzeros.
+ *
+ * @param input_data Sparse input data to find the medoids of
+ * @param sample Sorted indices of the datapoints of the subsample
+ * @param transposed Whether input_data holds one datapoint per column
+ * @return The subsample, one datapoint per row, or the dissimilarities
+ * between the sampled datapoints when precomputed
+ */
+template <typename eT>
+arma::SpMat<eT> KMedoids::pilotSample(const arma::SpMat<eT>& input_data, const arma::uvec& sample, bool transposed) {
+  auto gather = [&](const arma::SpMat<eT>& m) {
+    m.sync();
+    std::vector<arma::uword> row_indices;
+    std::vector<arma::uword> col_ptrs(1, 0);
+    std::vector<eT> values;
+    for (arma::uword c : sample) {
+      for (arma::uword i = m.col_ptrs[c]; i < m.col_ptrs[c + 1]; i++) {
+        row_indices.push_back(m.row_indices[i]);
+        values.push_back(m.values[i]);
+      }
+      col_ptrs.push_back(row_indices.size());
+    }
+    return arma::SpMat<eT>(arma::uvec(row_indices), arma::uvec(col_ptrs),
+                           arma::Col<eT>(values), m.n_rows, sample.n_elem);
+  };
+  if (lossType == LossType::PRECOMPUTED) {
+    return gather(arma::SpMat<eT>(arma::trans(gather(input_data))));
+  }
+  if (transposed) {
+    return arma::trans(gather(input_data));
+  }
+  return arma::trans(gather(arma::SpMat<eT>(arma::trans(input_data))));
+}
+
+/**
+ * \brief Stores the input data and runs fn on it
+ *
+ * Resets the state kept from the previous fit and calls fn with the data in
+ * the layout the algorithm works on, one datapoint per column. The input is
+ * transposed into the data member of its type, except for precomputed
+ * dissimilarities and mapped data, which fn reads in place.
+ *
+ * @param input_data Input data, one datapoint per row unless mapped
+ * @param mapped Mapping input_data aliases, already transposed; null for
+ * data held in memory
+ * @param fn Callable taking the transposed data
+ */
+template <typename T, typename Fn>
+void KMedoids::withInputData(const T& input_data, const MappedMatrix* mapped, Fn fn) {
+  // threads are pinned before the data is touched, so each datapoint is
+  // placed on the node of the thread that scans it
+  std::unique_ptr<numa::ThreadPinning> pinning;
+  if (numaMode) {
+    pinning.reset(new numa::ThreadPinning());
+  }
+  // only one copy of the dataset is kept, whatever its precision or layout
+  data.reset();
+  fdata.reset();
+  spdata.reset();
+  nStored = 0;
+  mappedData = mapped;
+  sqNorms.reset();
+  bestDistances.reset();
+  secondDistances.reset();
+  secondLabels.reset();
+  if (lossType == LossType::PRECOMPUTED) {
+    if (input_data.n_rows != input_data.n_cols) {
+      throw std::invalid_argument("error: precomputed loss requires a square dissimilarity matrix");
+    }
+    fn(input_data);
+  } else if (mapped != nullptr) {
+    fn(input_data);
+  } else {
+    T& transposed = storedData<T>();
+    if (numaMode) {
+      numa::firstTouchTranspose(input_data, transposed);
+    } else {
+      transposed = arma::trans(input_data);
+    }
+    nStored = transposed.n_cols;
+    fn(transposed);
+  }
+  mappedData = nullptr;
+}
 
 /**
  * \brief Runs naive PAM algorithm.
  *
  * Run the naive PAM algorithm to identify a dataset's medoids.
  *
- * @param input_data Input data to find the medoids of
+ * @param data Transposed input data to find the medoids of
+ * @param lossFn Distance policy used for every distance evaluation
  */
-void KMedoids::fit_naive(arma::mat input_data) {
-  data = input_data;
-  data = arma::trans(data);
+template <typename T, typename Distance>
+void KMedoids::fit_naive(const T& data, const Distance& lossFn) {
   arma::rowvec medoid_indices(n_medoids);
-  // runs build step
-  KMedoids::build_naive(data, medoid_indices);
+  if (initialMedoids.n_elem > 0) {
+    // warm start: the swap step starts from the given medoids
+    medoid_indices = arma::conv_to<arma::rowvec>::from(initialMedoids);
+  } else {
+    // runs build step
+    KMedoids::build_naive(data, medoid_indices, lossFn);
+  }
+  if (distanceCounter != nullptr) {
+    buildDistanceCalls = distanceCounter->total();
+  }
   steps = 0;
 
   medoid_indices_build = medoid_indices;
   arma::rowvec assignments(data.n_cols);
   size_t i = 0;
   bool medoidChange = true;
+  double previous_loss = std::numeric_limits<double>::infinity();
+  stopReason = StopReason::CONVERGED;
   while (i < max_iter && medoidChange) {
+    if (interrupted()) {
+      break;
+    }
     auto previous(medoid_indices);
     // runs swa step as necessary
-    KMedoids::swap_naive(data, medoid_indices, assignments);
+    KMedoids::swap_naive(data, medoid_indices, assignments, lossFn);
     medoidChange = arma::any(medoid_indices != previous);
     i++;
+    if (medoidChange && !logHelper.loss_swap.empty()) {
+      const double loss = logHelper.loss_swap.back();
+      if (stopEarly(previous_loss, loss)) {
+        break;
+      }
+      previous_loss = loss;
+    }
+  }
+  if (stopReason == StopReason::CONVERGED && medoidChange) {
+    stopReason = StopReason::MAX_ITER;
   }
   medoid_indices_final = medoid_indices;
   labels = assignments;
@@ -295,10 +1631,13 @@ void KMedoids::fit_naive(arma::mat input_data) {
  * @param data Transposed input data to find the medoids of
  * @param medoid_indices Uninitialized array of medoids that is modified in place
  * as medoids are identified
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 void KMedoids::build_naive(
-  arma::mat& data, 
-  arma::rowvec& medoid_indices)
+  const T& data, 
+  arma::rowvec& medoid_indices,
+  const Distance& lossFn)
 { 
   size_t N = data.n_cols;
   int p = (buildConfidence * N); // reciprocal
@@ -311,15 +1650,15 @@ void KMedoids::build_naive(
     double minDistance = std::numeric_limits<double>::infinity();
     int best = 0;
     KMedoids::build_sigma(
-           data, best_distances, sigma, batchSize, use_absolute); // computes std dev amongst batch of reference points
+           data, best_distances, sigma, batchSize, use_absolute, lossFn); // computes std dev amongst batch of reference points
     // fixes a base datapoint
     for (int i = 0; i < data.n_cols; i++) {
       double total = 0;
       for (size_t j = 0; j < data.n_cols; j++) {
         // computes distance between base and all other points
-        double cost = (this->*lossFn)(data, i, j);
+        double cost = lossFn(data, i, j);
         for (size_t medoid = 0; medoid < k; medoid++) {
-          double current = (this->*lossFn)(data, medoid_indices(medoid), j);
+          double current = lossFn(data, medoid_indices(medoid), j);
           // compares this for cost of the medoid
           if (current < cost) {
             cost = current;
@@ -336,12 +1675,7 @@ void KMedoids::build_naive(
     medoid_indices(k) = best;
 
     // don't need to do this on final iteration
-    for (size_t l = 0; l < N; l++) {
-        double cost = (this->*lossFn)(data, l, medoid_indices(k));
-        if (cost < best_distances(l)) {
-            best_distances(l) = cost;
-        }
-    }
+    refresh_best_distances(data, medoid_indices(k), best_distances, lossFn);
     use_absolute = false; // use difference of loss for sigma and sampling,
                           // not absolute
     logHelper.loss_build.push_back(minDistance/N);
@@ -362,11 +1696,14 @@ void KMedoids::build_naive(
  * that is modified in place as better medoids are identified
  * @param assignments Uninitialized array of indices corresponding to each
  * datapoint assigned the index of the medoid it is closest to
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 void KMedoids::swap_naive(
-  arma::mat& data, 
+  const T& data, 
   arma::rowvec& medoid_indices,
-  arma::rowvec& assignments)
+  arma::rowvec& assignments,
+  const Distance& lossFn)
 {
   double minDistance = std::numeric_limits<double>::infinity();
   size_t best = 0;
@@ -376,17 +1713,25 @@ void KMedoids::swap_naive(
   arma::mat sigma(n_medoids, N, arma::fill::zeros);
   arma::rowvec best_distances(N);
   arma::rowvec second_distances(N);
+  arma::rowvec second_assignments(N);
 
   // calculate quantities needed for swap, best_distances and sigma
-  calc_best_distances_swap(
-    data, medoid_indices, best_distances, second_distances, assignments);
+  calc_best_distances_swap(data,
+                           medoid_indices,
+                           best_distances,
+                           second_distances,
+                           assignments,
+                           second_assignments,
+                           lossFn);
 
   swap_sigma(data,
               sigma,
               batchSize,
+              arma::regspace<arma::uvec>(0, N - 1),
               best_distances,
               second_distances,
-              assignments);
+              assignments,
+              lossFn);
   
   // write the sigma distribution to logfile
   sigma_log(sigma);
@@ -398,12 +1743,12 @@ void KMedoids::swap_naive(
       double total = 0;
       for (size_t j = 0; j < data.n_cols; j++) {
         // compute distance between base point and every other datapoint
-        double cost = (this->*lossFn)(data, i, j);
+        double cost = lossFn(data, i, j);
         for (size_t medoid = 0; medoid < n_medoids; medoid++) {
           if (medoid == k) {
             continue;
           }
-          double current = (this->*lossFn)(data, medoid_indices(medoid), j);
+          double current = lossFn(data, medoid_indices(medoid), j);
           if (current < cost) {
             cost = current;
           }
@@ -426,27 +1771,111 @@ void KMedoids::swap_naive(
 }
 
 /**
- * \brief Runs BanditPAM algorithm.
+ * \brief Runs BanditPAM algorithm.
+ *
+ * Run the BanditPAM algorithm to identify a dataset's medoids.
+ *
+ * @param data Transposed input data to find the medoids of
+ * @param lossFn Distance policy used for every distance evaluation
+ */
+template <typename T, typename Distance>
+void KMedoids::fit_bpam(const T& data, const Distance& lossFn) {
+  T medoids_mat(data.n_rows, n_medoids);
+  arma::rowvec medoid_indices(n_medoids);
+  if (initialMedoids.n_elem > 0) {
+    // warm start: the swap step starts from the given medoids
+    medoid_indices = arma::conv_to<arma::rowvec>::from(initialMedoids);
+    for (size_t k = 0; k < size_t(n_medoids); k++) {
+      medoids_mat.col(k) = data.col(initialMedoids(k));
+    }
+  } else {
+    // runs build step
+    KMedoids::build(data, medoid_indices, medoids_mat, lossFn);
+  }
+  if (distanceCounter != nullptr) {
+    buildDistanceCalls = distanceCounter->total();
+  }
+  steps = 0;
+
+  medoid_indices_build = medoid_indices;
+  arma::rowvec assignments(data.n_cols);
+  // runs swap step
+  if (algorithmType == AlgorithmType::FASTERPAM) {
+    KMedoids::swap_eager(data, medoid_indices, medoids_mat, assignments, lossFn);
+  } else {
+    KMedoids::swap(data, medoid_indices, medoids_mat, assignments, lossFn);
+  }
+  medoid_indices_final = medoid_indices;
+  labels = assignments;
+}
+
+/**
+ * \brief Runs the build step once and the swap step for each k
  *
- * Run the BanditPAM algorithm to identify a dataset's medoids.
+ * The build medoids for each k are the first k medoids of a single build up
+ * to the largest k. Each k then runs the swap step of the selected algorithm
+ * on its own KMedoids, warm-started from its build medoids; the different k
+ * run on different threads and share lossFn, including its distance cache.
  *
- * @param input_data Input data to find the medoids of
+ * @param data Transposed input data to find the medoids of
+ * @param k_values Numbers of medoids to find
+ * @param results Set to the fit of each entry of k_values
+ * @param lossFn Distance policy used for every distance evaluation
  */
-void KMedoids::fit_bpam(arma::mat input_data) {
-  data = input_data;
-  data = arma::trans(data);
-  arma::mat medoids_mat(data.n_rows, n_medoids);
+template <typename T, typename Distance>
+void KMedoids::fit_path_run(
+  const T& data,
+  const std::vector<size_t>& k_values,
+  std::vector<PathResult>& results,
+  const Distance& lossFn)
+{
+  T medoids_mat(data.n_rows, n_medoids);
   arma::rowvec medoid_indices(n_medoids);
-  // runs build step
-  KMedoids::build(data, medoid_indices, medoids_mat);
-  steps = 0;
-
+  if (algorithmType == AlgorithmType::NAIVE) {
+    KMedoids::build_naive(data, medoid_indices, lossFn);
+  } else {
+    KMedoids::build(data, medoid_indices, medoids_mat, lossFn);
+  }
   medoid_indices_build = medoid_indices;
-  arma::rowvec assignments(data.n_cols);
-  // runs swap step
-  KMedoids::swap(data, medoid_indices, medoids_mat, assignments);
-  medoid_indices_final = medoid_indices;
-  labels = assignments;
+  buildDistanceCalls = distanceCounter->total();
+
+  // larger k take longer to swap, so the k are handed out one at a time
+#pragma omp parallel for schedule(dynamic)
+  for (size_t r = 0; r < k_values.size(); r++) {
+    const size_t k = k_values[r];
+    // each k draws from its own stream, whichever thread runs it, seeded as
+    // a fit warm-started from its build medoids with the seed of its result
+    KMedoids path(k, algorithm, 0, max_iter, logFilename, RandomStream(seed, k).next());
+    path.sampler.seed(path.seed);
+    path.lossType = lossType;
+    path.lp = lp;
+    path.batchSize = batchSize;
+    path.buildConfidence = buildConfidence;
+    path.swapConfidence = swapConfidence;
+    path.adaptiveBatch = adaptiveBatch;
+    path.fitStart = fitStart;
+    path.timeBudget = timeBudget;
+    path.lossTolerance = lossTolerance;
+    path.initialMedoids = arma::conv_to<arma::urowvec>::from(medoid_indices.cols(0, k - 1));
+    if (algorithmType == AlgorithmType::NAIVE) {
+      path.fit_naive(data, lossFn);
+    } else {
+      path.fit_bpam(data, lossFn);
+    }
+    results[r].k = k;
+    results[r].build_medoids = path.medoid_indices_build;
+    results[r].medoids = path.medoid_indices_final;
+    results[r].labels = path.labels;
+    results[r].loss = path.calc_loss(data, path.medoid_indices_final, lossFn);
+    results[r].steps = path.steps;
+    results[r].seed = path.seed;
+  }
+
+  // the model keeps the fit of the largest k
+  const size_t largest = std::max_element(k_values.begin(), k_values.end()) - k_values.begin();
+  medoid_indices_final = results[largest].medoids;
+  labels = results[largest].labels;
+  steps = results[largest].steps;
 }
 
 /**
@@ -462,88 +1891,59 @@ void KMedoids::fit_bpam(arma::mat input_data) {
  * as medoids are identified
  * @param medoids Matrix of possible medoids that is updated as the bandit
  * learns which datapoints will be unlikely to be good candidates
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 void KMedoids::build(
-  arma::mat& data,
+  const T& data,
   arma::rowvec& medoid_indices,
-  arma::mat& medoids)
+  T& medoids,
+  const Distance& lossFn)
 {
     // Parameters
     size_t N = data.n_cols;
-    arma::rowvec N_mat(N);
-    N_mat.fill(N);
-    int p = (buildConfidence * N); // reciprocal of
+    // computed in double, buildConfidence * N overflows int for large N
+    const double p = double(buildConfidence) * N; // reciprocal of
+    const double log_p = std::log(double(buildConfidence) * N);
     bool use_absolute = true;
-    arma::rowvec estimates(N, arma::fill::zeros);
     arma::rowvec best_distances(N);
     best_distances.fill(std::numeric_limits<double>::infinity());
     arma::rowvec sigma(N); // standard deviation of induced losses on reference points
-    arma::urowvec candidates(
-      N,
-      arma::fill::ones); // one hot encoding of candidates -- points not filtered out yet
-    arma::rowvec lcbs(N);
-    arma::rowvec ucbs(N);
-    arma::rowvec T_samples(N, arma::fill::zeros); // number of times calculating induced loss for reference point
-    arma::rowvec exact_mask(N, arma::fill::zeros); // computed the loss exactly for this datapoint
+    ArmSet arms; // candidates -- points not filtered out yet
 
     for (size_t k = 0; k < n_medoids; k++) {
         // instantiate medoids one-by-online
         size_t step_count = 0;
-        candidates.fill(1);
-        T_samples.fill(0);
-        exact_mask.fill(0);
-        estimates.fill(0);
+        arms.reset(N);
         KMedoids::build_sigma(
-           data, best_distances, sigma, batchSize, use_absolute); // computes std dev amongst batch of reference points
-
-        while (arma::sum(candidates) > precision) { // while some candidates exist
-            arma::umat compute_exactly =
-              ((T_samples + batchSize) >= N_mat) != exact_mask;
-            if (arma::accu(compute_exactly) > 0) {
-                arma::uvec targets = find(compute_exactly);
-                logHelper.comp_exact_build.push_back(targets.n_rows);
-                arma::rowvec result =
-                  build_target(data, targets, N, best_distances, use_absolute); // induced loss for these targets over all reference points
-                estimates.cols(targets) = result;
-                ucbs.cols(targets) = result;
-                lcbs.cols(targets) = result;
-                exact_mask.cols(targets).fill(1);
-                T_samples.cols(targets) += N;
-                candidates.cols(targets).fill(0);
+           data, best_distances, sigma, batchSize, use_absolute, lossFn); // computes std dev amongst batch of reference points
+
+        while (arms.size() > 0) { // while some candidates exist
+            const size_t round_batch = roundBatchSize(arms.size(), N, N);
+            // compute exactly if it's been sampled more than N times
+            const size_t n_exact = arms.resolveExact(round_batch, N, [&](arma::uvec targets) {
+                // induced loss for these targets over all reference points
+                return build_target(data, targets, N, best_distances, use_absolute, lossFn);
+            });
+            if (n_exact > 0) {
+                logHelper.comp_exact_build.push_back(n_exact);
             }
-            if (arma::sum(candidates) < precision) {
+            if (arms.size() == 0) {
                 break;
             }
-            arma::uvec targets = arma::find(candidates);
-            arma::rowvec result = build_target(
-              data, targets, batchSize, best_distances, use_absolute); // induced loss for the targets (sample)
-            estimates.cols(targets) =
-              ((T_samples.cols(targets) % estimates.cols(targets)) +
-               (result * batchSize)) /
-              (batchSize + T_samples.cols(targets)); // update the running average
-            T_samples.cols(targets) += batchSize;
-            arma::rowvec adjust(targets.n_rows);
-            adjust.fill(p);
-            adjust = arma::log(adjust);
-            arma::rowvec cb_delta =
-              sigma.cols(targets) %
-              arma::sqrt(adjust / T_samples.cols(targets));
-            ucbs.cols(targets) = estimates.cols(targets) + cb_delta;
-            lcbs.cols(targets) = estimates.cols(targets) - cb_delta;
-            candidates = (lcbs < ucbs.min()) && (exact_mask == 0);
+            arms.sample(round_batch, sigma, log_p, [&](arma::uvec targets) {
+                // induced loss for the targets (sample)
+                return build_target(data, targets, round_batch, best_distances, use_absolute, lossFn);
+            });
+            arms.prune(arms.minUcb());
             step_count++;
         }
 
-        medoid_indices.at(k) = lcbs.index_min();
-        medoids.unsafe_col(k) = data.unsafe_col(medoid_indices(k));
+        medoid_indices.at(k) = arms.best();
+        medoids.col(k) = data.col(medoid_indices(k));
 
         // don't need to do this on final iteration
-        for (size_t i = 0; i < N; i++) {
-            double cost = (this->*lossFn)(data, i, medoid_indices(k));
-            if (cost < best_distances(i)) {
-                best_distances(i) = cost;
-            }
-        }
+        refresh_best_distances(data, medoid_indices(k), best_distances, lossFn);
         use_absolute = false; // use difference of loss for sigma and sampling,
                               // not absolute
         logHelper.loss_build.push_back(arma::mean(arma::mean(best_distances)));
@@ -563,34 +1963,42 @@ void KMedoids::build(
  * @param best_distances Array of best distances from each point to previous set
  * of medoids
  * @param use_aboslute Determines whether the absolute cost is added to the total
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 void KMedoids::build_sigma(
-  arma::mat& data,
+  const T& data,
   arma::rowvec& best_distances,
   arma::rowvec& sigma,
   arma::uword batch_size,
-  bool use_absolute)
+  bool use_absolute,
+  const Distance& lossFn)
 {
     size_t N = data.n_cols;
-    // without replacement, requires updated version of armadillo
-    arma::uvec tmp_refs = arma::randperm(N, batch_size);
-    arma::vec sample(batch_size);
+    const arma::uvec& tmp_refs = sampler.draw(N, batch_size);
+    scratch.gather(tmp_refs, best_distances);
+    const double* ref_best = scratch.refBest.data();
+    arma::Mat<typename T::elem_type>& distances = scratch.distances<typename T::elem_type>();
+    const size_t tile = std::max<size_t>(1, blockElems / batch_size);
+    // distances from a tile of points to the whole batch are evaluated at once
+    for (size_t start = 0; start < N; start += tile) {
+        arma::uvec points = arma::regspace<arma::uvec>(start, std::min(start + tile, N) - 1);
+        lossFn.block(data, points, tmp_refs, distances);
 // for each possible swap
 #pragma omp parallel for
-    for (size_t i = 0; i < N; i++) {
-        // gather a sample of points
-        for (size_t j = 0; j < batch_size; j++) {
-            double cost = (this->*lossFn)(data, i, tmp_refs(j));
-            if (use_absolute) {
-                sample(j) = cost;
-            } else {
-                sample(j) = cost < best_distances(tmp_refs(j))
-                              ? cost
-                              : best_distances(tmp_refs(j));
-                sample(j) -= best_distances(tmp_refs(j));
+        for (size_t i = 0; i < points.n_rows; i++) {
+            // dispersion of the induced losses on the batch, in one pass
+            RunningStddev sample;
+            for (size_t j = 0; j < tmp_refs.n_rows; j++) {
+                double cost = distances(i, j);
+                if (use_absolute) {
+                    sample.push(cost);
+                } else {
+                    sample.push((cost < ref_best[j] ? cost : ref_best[j]) - ref_best[j]);
+                }
             }
+            sigma(points(i)) = sample.value();
         }
-        sigma(i) = arma::stddev(sample);
     }
     arma::rowvec P = {0.25, 0.5, 0.75};
     arma::rowvec Q = arma::quantile(sigma, P);
@@ -617,35 +2025,58 @@ void KMedoids::build_sigma(
  * @param best_distances Array of best distances from each point to previous set
  * of medoids
  * @param use_absolute Determines whether the absolute cost is added to the total
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 arma::rowvec KMedoids::build_target(
-  arma::mat& data,
+  const T& data,
   arma::uvec& target,
   size_t batch_size,
   arma::rowvec& best_distances,
-  bool use_absolute)
+  bool use_absolute,
+  const Distance& lossFn)
 {
     size_t N = data.n_cols;
     arma::rowvec estimates(target.n_rows, arma::fill::zeros);
-    arma::uvec tmp_refs = arma::randperm(N,
-                                   batch_size); // without replacement, requires
-                                                // updated version of armadillo
+    const arma::uvec& tmp_refs = sampler.draw(N, batch_size);
+    scratch.gather(tmp_refs, best_distances);
+    const double* ref_best = scratch.refBest.data();
+    const size_t B = tmp_refs.n_rows;
+    arma::Mat<typename T::elem_type>& distances = scratch.distances<typename T::elem_type>();
+    const size_t tile = std::max<size_t>(1, blockElems / batch_size);
+    // distances from a tile of targets to the whole batch are evaluated at once
+    for (size_t start = 0; start < target.n_rows; start += tile) {
+        arma::uvec points = target.rows(start, std::min<size_t>(start + tile, target.n_rows) - 1);
+        lossFn.block(data, points, tmp_refs, distances);
+        // each target's sum is split over chunks of the batch, so a few
+        // targets computed exactly still keep every thread busy
+        const size_t chunks = referenceChunks(points.n_rows, B);
+        const size_t chunk = (B + chunks - 1) / chunks;
+        scratch.partials.resize(points.n_rows * chunks);
+        double* partials = scratch.partials.data();
+#pragma omp parallel for schedule(dynamic)
+        for (size_t t = 0; t < points.n_rows * chunks; t++) {
+            const size_t i = t / chunks;
+            double total = 0;
+            for (size_t j = (t % chunks) * chunk; j < std::min(B, (t % chunks + 1) * chunk); j++) {
+                double cost = distances(i, j);
+                if (use_absolute) {
+                    total += cost;
+                } else {
+                    total += cost < ref_best[j] ? cost : ref_best[j];
+                    total -= ref_best[j];
+                }
+            }
+            partials[t] = total;
+        }
 #pragma omp parallel for
-    for (size_t i = 0; i < target.n_rows; i++) {
-        double total = 0;
-        for (size_t j = 0; j < tmp_refs.n_rows; j++) {
-            double cost =
-              (this->*lossFn)(data, tmp_refs(j), target(i));
-            if (use_absolute) {
-                total += cost;
-            } else {
-                total += cost < best_distances(tmp_refs(j))
-                           ? cost
-                           : best_distances(tmp_refs(j));
-                total -= best_distances(tmp_refs(j));
+        for (size_t i = 0; i < points.n_rows; i++) {
+            double total = 0;
+            for (size_t c = 0; c < chunks; c++) {
+                total += partials[i * chunks + c];
             }
+            estimates(start + i) = total / B;
         }
-        estimates(i) = total / batch_size;
     }
     return estimates;
 }
@@ -665,106 +2096,106 @@ arma::rowvec KMedoids::build_target(
  * learns which datapoints will be unlikely to be good candidates
  * @param assignments Uninitialized array of indices corresponding to each
  * datapoint assigned the index of the medoid it is closest to
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 void KMedoids::swap(
-  arma::mat& data,
+  const T& data,
   arma::rowvec& medoid_indices,
-  arma::mat& medoids,
-  arma::rowvec& assignments)
+  T& medoids,
+  arma::rowvec& assignments,
+  const Distance& lossFn)
 {
     size_t N = data.n_cols;
-    int p = (N * n_medoids * swapConfidence); // reciprocal
+    // computed in double, N * k * swapConfidence overflows int for large N
+    const double p = double(N) * n_medoids * swapConfidence; // reciprocal
+    const double log_p = std::log(double(N) * n_medoids * swapConfidence);
 
     arma::mat sigma(n_medoids, N, arma::fill::zeros);
 
     arma::rowvec best_distances(N);
     arma::rowvec second_distances(N);
+    arma::rowvec second_assignments(N);
     size_t iter = 0;
     bool swap_performed = true;
-    arma::umat candidates(n_medoids, N, arma::fill::ones);
-    arma::umat exact_mask(n_medoids, N, arma::fill::zeros);
-    arma::mat estimates(n_medoids, N, arma::fill::zeros);
-    arma::mat lcbs(n_medoids, N);
-    arma::mat ucbs(n_medoids, N);
-    arma::umat T_samples(n_medoids, N, arma::fill::zeros);
+    ArmSet arms; // candidate swaps, each encoded as n * n_medoids + k
+
+    // calculate quantities needed for swap, best_distances and sigma; they
+    // are kept up to date incrementally after every swap
+    calc_best_distances_swap(data,
+                             medoid_indices,
+                             best_distances,
+                             second_distances,
+                             assignments,
+                             second_assignments,
+                             lossFn);
+
+    // the medoids of the lowest loss are kept if the step stops early
+    double previous_loss = arma::mean(best_distances);
+    double best_loss = previous_loss;
+    arma::rowvec best_medoids = medoid_indices;
+    stopReason = StopReason::CONVERGED;
 
     // continue making swaps while loss is decreasing
     while (swap_performed && iter < max_iter) {
         iter++;
 
-        // calculate quantities needed for swap, best_distances and sigma
-        calc_best_distances_swap(
-          data, medoid_indices, best_distances, second_distances, assignments);
-
         swap_sigma(data,
                    sigma,
                    batchSize,
+                   arma::regspace<arma::uvec>(0, N - 1),
                    best_distances,
                    second_distances,
-                   assignments);
+                   assignments,
+                   lossFn);
 
-        candidates.fill(1);
-        exact_mask.fill(0);
-        estimates.fill(0);
-        T_samples.fill(0);
-
-        // while there is at least one candidate (double comparison issues)
-        while (arma::accu(candidates) > 0.5) {
-            calc_best_distances_swap(
-              data, medoid_indices, best_distances, second_distances, assignments);
+        arms.reset(n_medoids * N);
 
+        // while there is at least one candidate
+        bool stopped = false;
+        while (arms.size() > 0) {
+            const size_t round_batch = roundBatchSize(arms.size(), n_medoids * N, N);
             // compute exactly if it's been samples more than N times and hasn't
             // been computed exactly already
-            arma::umat compute_exactly =
-              ((T_samples + batchSize) >= N) != (exact_mask);
-            arma::uvec targets = arma::find(compute_exactly);
-
-            if (targets.size() > 0) {
-                logHelper.comp_exact_swap.push_back(targets.size());
-                arma::vec result = swap_target(data,
-                                               medoid_indices,
-                                               targets,
-                                               N,
-                                               best_distances,
-                                               second_distances,
-                                               assignments);
-                estimates.elem(targets) = result;
-                ucbs.elem(targets) = result;
-                lcbs.elem(targets) = result;
-                exact_mask.elem(targets).fill(1);
-                T_samples.elem(targets) += N;
-
-                candidates = (lcbs < ucbs.min()) && (exact_mask == 0);
+            const size_t n_exact = arms.resolveExact(round_batch, N, [&](arma::uvec targets) {
+                return swap_target(data,
+                                   medoid_indices,
+                                   targets,
+                                   N,
+                                   best_distances,
+                                   second_distances,
+                                   assignments,
+                                   lossFn);
+            });
+            if (n_exact > 0) {
+                logHelper.comp_exact_swap.push_back(n_exact);
+                arms.prune(arms.minUcb());
             }
-            if (arma::accu(candidates) < precision) {
+            if (arms.size() == 0) {
+                break;
+            }
+            arms.sample(round_batch, sigma, log_p, [&](arma::uvec targets) {
+                return swap_target(data,
+                                   medoid_indices,
+                                   targets,
+                                   round_batch,
+                                   best_distances,
+                                   second_distances,
+                                   assignments,
+                                   lossFn);
+            });
+            arms.prune(arms.minUcb());
+            if (interrupted()) {
+                stopped = true;
                 break;
             }
-            targets = arma::find(candidates);
-            arma::vec result = swap_target(data,
-                                           medoid_indices,
-                                           targets,
-                                           batchSize,
-                                           best_distances,
-                                           second_distances,
-                                           assignments);
-            estimates.elem(targets) =
-              ((T_samples.elem(targets) % estimates.elem(targets)) +
-               (result * batchSize)) /
-              (batchSize + T_samples.elem(targets));
-            T_samples.elem(targets) += batchSize;
-            arma::vec adjust(targets.n_rows);
-            adjust.fill(p);
-            adjust = arma::log(adjust);
-            arma::vec cb_delta = sigma.elem(targets) %
-                                 arma::sqrt(adjust / T_samples.elem(targets));
-
-            ucbs.elem(targets) = estimates.elem(targets) + cb_delta;
-            lcbs.elem(targets) = estimates.elem(targets) - cb_delta;
-            candidates = (lcbs < ucbs.min()) && (exact_mask == 0);
-            targets = arma::find(candidates);
+        }
+        // an unfinished race commits nothing
+        if (stopped) {
+            break;
         }
         // now switch medoids
-        arma::uword new_medoid = lcbs.index_min();
+        arma::uword new_medoid = arms.best();
         // extract medoid of swap
         size_t k = new_medoid % medoids.n_cols;
 
@@ -775,12 +2206,394 @@ void KMedoids::swap(
 
         medoid_indices(k) = n;
         medoids.col(k) = data.col(medoid_indices(k));
-        calc_best_distances_swap(
-          data, medoid_indices, best_distances, second_distances, assignments);
+        if (swap_performed) {
+            update_best_distances_swap(data,
+                                       medoid_indices,
+                                       k,
+                                       best_distances,
+                                       second_distances,
+                                       assignments,
+                                       second_assignments,
+                                       lossFn);
+        }
         sigma_log(sigma);
         logHelper.loss_swap.push_back(arma::mean(arma::mean(best_distances)));
         logHelper.p_swap.push_back((float)1/(float)p);
+
+        const double loss = logHelper.loss_swap.back();
+        if (loss < best_loss) {
+            best_loss = loss;
+            best_medoids = medoid_indices;
+        }
+        if (swap_performed && stopEarly(previous_loss, loss)) {
+            break;
+        }
+        previous_loss = loss;
+    }
+    if (stopReason == StopReason::CONVERGED && swap_performed) {
+        stopReason = StopReason::MAX_ITER;
+    }
+    // a swap chosen from estimates may have raised the loss before an early
+    // stop; a converged step keeps its final medoids as before
+    const bool stopped_early = stopReason == StopReason::TIME_BUDGET ||
+                               stopReason == StopReason::LOSS_TOLERANCE ||
+                               stopReason == StopReason::CANCELLED;
+    if (stopped_early && best_loss < arma::mean(best_distances)) {
+        medoid_indices = best_medoids;
+        for (size_t k = 0; k < n_medoids; k++) {
+            medoids.col(k) = data.col(medoid_indices(k));
+        }
+        calc_best_distances_swap(data,
+                                 medoid_indices,
+                                 best_distances,
+                                 second_distances,
+                                 assignments,
+                                 second_assignments,
+                                 lossFn);
+    }
+    // kept for KMedoids::partial_fit
+    bestDistances = best_distances;
+    secondDistances = second_distances;
+    secondLabels = second_assignments;
+}
+
+/**
+ * \brief Eager swap step for BanditPAM
+ *
+ * Runs the swap step in the style of FasterPAM: instead of racing all k x N
+ * arms before committing the single best swap, the candidate points are
+ * visited in random order, a block at a time, and the arms (k, n) of the
+ * block are raced against each other. As soon as the confidence bound of an
+ * arm proves that it decreases the loss, the most promising such arm is
+ * swapped in, the best and second best distances are updated incrementally,
+ * and the race continues with the next block. The step ends after a full
+ * pass over the candidates that commits no swap, or after max_iter passes.
+ *
+ * @param data Transposed input data to find the medoids of
+ * @param medoid_indices Array of medoid indices created from the build step
+ * that is modified in place as better medoids are identified
+ * @param medoids Matrix of possible medoids that is updated as the bandit
+ * learns which datapoints will be unlikely to be good candidates
+ * @param assignments Uninitialized array of indices corresponding to each
+ * datapoint assigned the index of the medoid it is closest to
+ * @param lossFn Distance policy used for every distance evaluation
+ */
+template <typename T, typename Distance>
+void KMedoids::swap_eager(
+  const T& data,
+  arma::rowvec& medoid_indices,
+  T& medoids,
+  arma::rowvec& assignments,
+  const Distance& lossFn)
+{
+    size_t N = data.n_cols;
+    size_t K = n_medoids;
+    // computed in double, N * k * swapConfidence overflows int for large N
+    const double p = double(N) * n_medoids * swapConfidence; // reciprocal
+    const double log_p = std::log(double(N) * n_medoids * swapConfidence);
+
+    arma::mat sigma(n_medoids, N, arma::fill::zeros);
+    arma::rowvec best_distances(N);
+    arma::rowvec second_distances(N);
+    arma::rowvec second_assignments(N);
+    calc_best_distances_swap(data,
+                             medoid_indices,
+                             best_distances,
+                             second_distances,
+                             assignments,
+                             second_assignments,
+                             lossFn);
+
+    // only swaps that provably lower the loss are committed, so the current
+    // medoids are the best so far whenever the step stops
+    double previous_loss = arma::mean(best_distances);
+    stopReason = StopReason::CONVERGED;
+
+    size_t pass = 0;
+    bool swap_performed = true;
+    while (swap_performed && pass < size_t(max_iter)) {
+        pass++;
+        swap_performed = false;
+        // the dispersion of the arms is refreshed once per pass
+        swap_sigma(data,
+                   sigma,
+                   batchSize,
+                   arma::regspace<arma::uvec>(0, N - 1),
+                   best_distances,
+                   second_distances,
+                   assignments,
+                   lossFn);
+        arma::uvec order = sampler.draw(N, N);
+        for (size_t start = 0; start < N; start += batchSize) {
+            if (interrupted()) {
+                break;
+            }
+            // current medoids are not candidates
+            arma::uvec block = arma::sort(
+              order.rows(start, std::min<size_t>(start + batchSize, N) - 1));
+            std::vector<arma::uword> block_targets;
+            for (arma::uword n : block) {
+                if (arma::any(medoid_indices == n)) {
+                    continue;
+                }
+                for (size_t k = 0; k < K; k++) {
+                    block_targets.push_back(n * K + k);
+                }
+            }
+            if (block_targets.empty()) {
+                continue;
+            }
+            arma::uvec targets(block_targets);
+            arma::vec arm_sigma(targets.n_rows);
+            for (size_t a = 0; a < targets.n_rows; a++) {
+                arm_sigma(a) = sigma(targets(a) % K, targets(a) / K);
+            }
+            size_t unbounded = std::numeric_limits<size_t>::max();
+            arma::sword committed = race_swaps(data,
+                                               medoid_indices,
+                                               targets,
+                                               arm_sigma,
+                                               best_distances,
+                                               second_distances,
+                                               assignments,
+                                               log_p,
+                                               unbounded,
+                                               lossFn);
+            if (committed < 0) {
+                continue;
+            }
+
+            size_t n = targets(committed) / K;
+            size_t k = targets(committed) % K;
+            medoid_indices(k) = n;
+            medoids.col(k) = data.col(n);
+            update_best_distances_swap(data,
+                                       medoid_indices,
+                                       k,
+                                       best_distances,
+                                       second_distances,
+                                       assignments,
+                                       second_assignments,
+                                       lossFn);
+            swap_performed = true;
+            steps++;
+        }
+        sigma_log(sigma);
+        logHelper.loss_swap.push_back(arma::mean(best_distances));
+        logHelper.p_swap.push_back((float)1/(float)p);
+
+        const double loss = logHelper.loss_swap.back();
+        if (stopReason == StopReason::TIME_BUDGET ||
+            stopReason == StopReason::CANCELLED ||
+            (swap_performed && stopEarly(previous_loss, loss))) {
+            break;
+        }
+        previous_loss = loss;
+    }
+    if (stopReason == StopReason::CONVERGED && swap_performed) {
+        stopReason = StopReason::MAX_ITER;
+    }
+    // kept for KMedoids::partial_fit
+    bestDistances = best_distances;
+    secondDistances = second_distances;
+    secondLabels = second_assignments;
+}
+
+/**
+ * \brief Races a block of swap arms until one provably decreases the loss
+ *
+ * Samples batches of reference points for the active arms of targets and
+ * narrows their confidence bounds, computing an arm exactly once it has been
+ * sampled N times. Arms whose lower bound is not below zero drop out. As soon
+ * as the upper bound of some arm is below zero, the one of those with the
+ * lowest estimate is returned.
+ *
+ * @param data Transposed input data to find the medoids of
+ * @param medoid_indices Array of current medoid indices
+ * @param targets Arms of the race, each encoded as n * k + medoid
+ * @param arm_sigma Dispersion parameter of each arm
+ * @param best_distances Array of best distances from each point to the
+ * current medoids
+ * @param second_distances Array of second smallest distances from each point
+ * to the current medoids
+ * @param assignments Assignments of datapoints to their closest medoid
+ * @param log_p Logarithm of the reciprocal of the error probability
+ * @param rounds Number of sampling rounds the race may use; decremented by
+ * the rounds used
+ * @param lossFn Distance policy used for every distance evaluation
+ * @return Index in targets of the arm to swap in, or -1 if no arm provably
+ * decreases the loss
+ */
+template <typename T, typename Distance>
+arma::sword KMedoids::race_swaps(
+  const T& data,
+  arma::rowvec& medoid_indices,
+  arma::uvec& targets,
+  const arma::vec& arm_sigma,
+  arma::rowvec& best_distances,
+  arma::rowvec& second_distances,
+  arma::rowvec& assignments,
+  double log_p,
+  size_t& rounds,
+  const Distance& lossFn)
+{
+    size_t N = data.n_cols;
+    ArmSet arms; // indices in targets of the active arms
+    arms.reset(targets.n_rows);
+
+    arma::sword committed = -1;
+    while (committed < 0 && arms.size() > 0 && rounds > 0) {
+        rounds--;
+        const size_t racing = arms.size();
+        const size_t round_batch = roundBatchSize(racing, targets.n_rows, N);
+        const size_t n_exact = arms.resolveExact(round_batch, N, [&](arma::uvec exact) {
+            arma::uvec exact_targets = targets.elem(exact);
+            return swap_target(data,
+                               medoid_indices,
+                               exact_targets,
+                               N,
+                               best_distances,
+                               second_distances,
+                               assignments,
+                               lossFn);
+        });
+        if (n_exact > 0) {
+            logHelper.comp_exact_swap.push_back(n_exact);
+        }
+        arms.sample(round_batch, arm_sigma, log_p, [&](arma::uvec sampled) {
+            arma::uvec sampled_targets = targets.elem(sampled);
+            return swap_target(data,
+                               medoid_indices,
+                               sampled_targets,
+                               round_batch,
+                               best_distances,
+                               second_distances,
+                               assignments,
+                               lossFn);
+        });
+        // arms whose upper bound is below zero provably decrease the
+        // loss; commit the one with the lowest estimate
+        committed = arms.bestBelow(-precision, racing);
+        // arms that provably do not decrease the loss drop out
+        arms.prune(0);
+    }
+    return committed;
+}
+
+/**
+ * \brief Swap step for datapoints appended by KMedoids::partial_fit
+ *
+ * Assigns the appended datapoints to their closest and second closest
+ * medoids, reusing the distances kept from the last fit for the others, and
+ * races the swaps of the appended datapoints into each medoid slot with
+ * race_swaps. A swap that provably decreases the loss is committed and the
+ * race restarts, until no arm can or max_rounds sampling rounds are spent.
+ *
+ * @param data Transposed data, the appended datapoints last
+ * @param first_new Index of the first appended datapoint
+ * @param max_rounds Maximum number of sampling rounds of the bandit race
+ * @param lossFn Distance policy used for every distance evaluation
+ */
+template <typename T, typename Distance>
+void KMedoids::stream_swap(
+  const T& data,
+  size_t first_new,
+  size_t max_rounds,
+  const Distance& lossFn)
+{
+    size_t N = data.n_cols;
+    size_t K = n_medoids;
+    const double log_p = std::log(double(N) * n_medoids * swapConfidence);
+    arma::rowvec medoid_indices = medoid_indices_final;
+
+    if (bestDistances.n_elem == first_new) {
+        labels.resize(N);
+        bestDistances.resize(N);
+        secondDistances.resize(N);
+        secondLabels.resize(N);
+#pragma omp parallel for
+        for (size_t i = first_new; i < N; i++) {
+            scan_medoids_swap(data,
+                              medoid_indices,
+                              i,
+                              bestDistances,
+                              secondDistances,
+                              labels,
+                              secondLabels,
+                              lossFn);
+        }
+    } else {
+        // the naive algorithm keeps no distances; assign every datapoint once
+        labels.set_size(N);
+        bestDistances.set_size(N);
+        secondDistances.set_size(N);
+        secondLabels.set_size(N);
+        calc_best_distances_swap(data,
+                                 medoid_indices,
+                                 bestDistances,
+                                 secondDistances,
+                                 labels,
+                                 secondLabels,
+                                 lossFn);
+    }
+
+    arma::uvec candidates = arma::regspace<arma::uvec>(first_new, N - 1);
+    arma::mat sigma(K, candidates.n_rows);
+    size_t rounds = max_rounds;
+    while (rounds > 0) {
+        swap_sigma(data,
+                   sigma,
+                   batchSize,
+                   candidates,
+                   bestDistances,
+                   secondDistances,
+                   labels,
+                   lossFn);
+        // appended datapoints already swapped in are not candidates
+        std::vector<arma::uword> stream_targets;
+        std::vector<double> stream_sigma;
+        for (size_t c = 0; c < candidates.n_rows; c++) {
+            if (arma::any(medoid_indices == candidates(c))) {
+                continue;
+            }
+            for (size_t k = 0; k < K; k++) {
+                stream_targets.push_back(candidates(c) * K + k);
+                stream_sigma.push_back(sigma(k, c));
+            }
+        }
+        if (stream_targets.empty()) {
+            break;
+        }
+        arma::uvec targets(stream_targets);
+        arma::vec arm_sigma(stream_sigma);
+        arma::sword committed = race_swaps(data,
+                                           medoid_indices,
+                                           targets,
+                                           arm_sigma,
+                                           bestDistances,
+                                           secondDistances,
+                                           labels,
+                                           log_p,
+                                           rounds,
+                                           lossFn);
+        if (committed < 0) {
+            break;
+        }
+
+        size_t n = targets(committed) / K;
+        size_t k = targets(committed) % K;
+        medoid_indices(k) = n;
+        update_best_distances_swap(data,
+                                   medoid_indices,
+                                   k,
+                                   bestDistances,
+                                   secondDistances,
+                                   labels,
+                                   secondLabels,
+                                   lossFn);
+        steps++;
     }
+    medoid_indices_final = medoid_indices;
 }
 
 /**
@@ -796,30 +2609,156 @@ void KMedoids::swap(
  * @param second_best_distances Array of second smallest distances from each
  * point to previous set of medoids
  * @param assignments Assignments of datapoints to their closest medoid
+ * @param second_assignments Assignments of datapoints to their second closest
+ * medoid
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 void KMedoids::calc_best_distances_swap(
-  arma::mat& data,
+  const T& data,
+  arma::rowvec& medoid_indices,
+  arma::rowvec& best_distances,
+  arma::rowvec& second_distances,
+  arma::rowvec& assignments,
+  arma::rowvec& second_assignments,
+  const Distance& lossFn)
+{
+#pragma omp parallel for
+    for (size_t i = 0; i < data.n_cols; i++) {
+        scan_medoids_swap(data,
+                          medoid_indices,
+                          i,
+                          best_distances,
+                          second_distances,
+                          assignments,
+                          second_assignments,
+                          lossFn);
+    }
+}
+
+/**
+ * \brief Finds the two closest medoids of one datapoint
+ *
+ * Evaluates the distance from datapoint i to every medoid and records the
+ * closest and second closest ones.
+ *
+ * @param data Transposed input data to find the medoids of
+ * @param medoid_indices Array of medoid indices corresponding to dataset entries
+ * @param i Index of the datapoint
+ * @param best_distances Array of best distances from each point to the medoids
+ * @param second_best_distances Array of second smallest distances from each
+ * point to the medoids
+ * @param assignments Assignments of datapoints to their closest medoid
+ * @param second_assignments Assignments of datapoints to their second closest
+ * medoid
+ * @param lossFn Distance policy used for every distance evaluation
+ */
+template <typename T, typename Distance>
+void KMedoids::scan_medoids_swap(
+  const T& data,
+  arma::rowvec& medoid_indices,
+  size_t i,
+  arma::rowvec& best_distances,
+  arma::rowvec& second_distances,
+  arma::rowvec& assignments,
+  arma::rowvec& second_assignments,
+  const Distance& lossFn)
+{
+    double best = std::numeric_limits<double>::infinity();
+    double second = std::numeric_limits<double>::infinity();
+    size_t best_k = 0;
+    size_t second_k = 0;
+    for (size_t k = 0; k < medoid_indices.n_cols; k++) {
+        double cost = lossFn(data, medoid_indices(k), i);
+        if (cost < best) {
+            second_k = best_k;
+            second = best;
+            best_k = k;
+            best = cost;
+        } else if (cost < second) {
+            second_k = k;
+            second = cost;
+        }
+    }
+    best_distances(i) = best;
+    second_distances(i) = second;
+    assignments(i) = best_k;
+    second_assignments(i) = second_k;
+}
+
+/**
+ * \brief Updates distances in swap step after a swap
+ *
+ * Updates the best and second best distances for each datapoint after the
+ * medoid in slot k has been replaced, using only the distances to the new
+ * medoid. Only the datapoints whose closest or second closest medoid was the
+ * replaced one, and for which the new medoid is not close enough to settle
+ * the update, are compared against every medoid again.
+ *
+ * @param data Transposed input data to find the medoids of
+ * @param medoid_indices Array of medoid indices, with slot k already replaced
+ * @param k Slot of the replaced medoid
+ * @param best_distances Array of best distances from each point to the medoids
+ * @param second_best_distances Array of second smallest distances from each
+ * point to the medoids
+ * @param assignments Assignments of datapoints to their closest medoid
+ * @param second_assignments Assignments of datapoints to their second closest
+ * medoid
+ * @param lossFn Distance policy used for every distance evaluation
+ */
+template <typename T, typename Distance>
+void KMedoids::update_best_distances_swap(
+  const T& data,
   arma::rowvec& medoid_indices,
+  size_t k,
   arma::rowvec& best_distances,
   arma::rowvec& second_distances,
-  arma::rowvec& assignments)
+  arma::rowvec& assignments,
+  arma::rowvec& second_assignments,
+  const Distance& lossFn)
 {
 #pragma omp parallel for
     for (size_t i = 0; i < data.n_cols; i++) {
-        double best = std::numeric_limits<double>::infinity();
-        double second = std::numeric_limits<double>::infinity();
-        for (size_t k = 0; k < medoid_indices.n_cols; k++) {
-            double cost = (this->*lossFn)(data, medoid_indices(k), i);
-            if (cost < best) {
+        double cost = lossFn(data, medoid_indices(k), i);
+        if (assignments(i) == k) {
+            // the second closest medoid is unchanged, so the new medoid
+            // stays the closest one if it beats it
+            if (cost <= second_distances(i)) {
+                best_distances(i) = cost;
+                continue;
+            }
+        } else if (second_assignments(i) == k) {
+            // every other medoid is at least as far as the replaced one was
+            if (cost < best_distances(i)) {
+                second_distances(i) = best_distances(i);
+                second_assignments(i) = assignments(i);
+                best_distances(i) = cost;
                 assignments(i) = k;
-                second = best;
-                best = cost;
-            } else if (cost < second) {
-                second = cost;
+                continue;
+            } else if (cost <= second_distances(i)) {
+                second_distances(i) = cost;
+                continue;
             }
+        } else {
+            if (cost < best_distances(i)) {
+                second_distances(i) = best_distances(i);
+                second_assignments(i) = assignments(i);
+                best_distances(i) = cost;
+                assignments(i) = k;
+            } else if (cost < second_distances(i)) {
+                second_distances(i) = cost;
+                second_assignments(i) = k;
+            }
+            continue;
         }
-        best_distances(i) = best;
-        second_distances(i) = second;
+        scan_medoids_swap(data,
+                          medoid_indices,
+                          i,
+                          best_distances,
+                          second_distances,
+                          assignments,
+                          second_assignments,
+                          lossFn);
     }
 }
 
@@ -839,48 +2778,97 @@ void KMedoids::calc_best_distances_swap(
  * @param second_best_distances Array of second smallest distances from each
  * point to previous set of medoids
  * @param assignments Assignments of datapoints to their closest medoid
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 arma::vec KMedoids::swap_target(
-  arma::mat& data,
+  const T& data,
   arma::rowvec& medoid_indices,
   arma::uvec& targets,
   size_t batch_size,
   arma::rowvec& best_distances,
   arma::rowvec& second_best_distances,
-  arma::rowvec& assignments)
+  arma::rowvec& assignments,
+  const Distance& lossFn)
 {
     size_t N = data.n_cols;
+    size_t K = medoid_indices.n_cols;
     arma::vec estimates(targets.n_rows, arma::fill::zeros);
-    arma::uvec tmp_refs = arma::randperm(N,
-                                   batch_size); // without replacement, requires
-                                                // updated version of armadillo
-
-// for each considered swap
-#pragma omp parallel for
-    for (size_t i = 0; i < targets.n_rows; i++) {
-        double total = 0;
-        // extract data point of swap
-        size_t n = targets(i) / medoid_indices.n_cols;
-        size_t k = targets(i) % medoid_indices.n_cols;
-        // calculate total loss for some subset of the data
-        for (size_t j = 0; j < batch_size; j++) {
-            double cost = (this->*lossFn)(data, n, tmp_refs(j));
-            if (k == assignments(tmp_refs(j))) {
-                if (cost < second_best_distances(tmp_refs(j))) {
-                    total += cost;
-                } else {
-                    total += second_best_distances(tmp_refs(j));
+    const arma::uvec& tmp_refs = sampler.draw(N, batch_size);
+    scratch.gather(tmp_refs, best_distances, &second_best_distances, &assignments);
+    const double* ref_best = scratch.refBest.data();
+    const double* ref_second = scratch.refSecond.data();
+    const size_t* ref_assignment = scratch.refAssignment.data();
+    const size_t B = tmp_refs.n_rows;
+    scratch.reserveThreads();
+    arma::Mat<typename T::elem_type>& distances = scratch.distances<typename T::elem_type>();
+    const size_t tile = std::max<size_t>(1, blockElems / batch_size);
+    // distances from the points of a tile of swaps to the whole batch are
+    // evaluated at once
+    for (size_t start = 0; start < targets.n_rows; start += tile) {
+        const size_t end = std::min<size_t>(start + tile, targets.n_rows);
+        // targets come sorted (ArmSet keeps live arms in order), so the
+        // swaps sharing a candidate point are adjacent; each candidate gets
+        // a single row
+        std::vector<arma::uword> candidates;
+        std::vector<size_t> first_target;
+        for (size_t i = start; i < end; i++) {
+            if (candidates.empty() || candidates.back() != targets(i) / K) {
+                candidates.push_back(targets(i) / K);
+                first_target.push_back(i);
+            }
+        }
+        first_target.push_back(end);
+        lossFn.block(data, arma::uvec(candidates), tmp_refs, distances);
+
+        // each candidate's sums are split over chunks of the batch, so a
+        // few candidates computed exactly still keep every thread busy; a
+        // tile keeps the part of the change in loss shared by all slots,
+        // then the change of every medoid slot k beyond it
+        const size_t chunks = referenceChunks(candidates.size(), B);
+        const size_t chunk = (B + chunks - 1) / chunks;
+        scratch.partials.resize(candidates.size() * chunks * (K + 1));
+        double* partials = scratch.partials.data();
+#pragma omp parallel
+        {
+            // accumulated per thread, then copied out, so neighbouring tiles
+            // never share a cache line while being summed
+            double* sums = scratch.local(K + 1);
+// for each (candidate point, chunk of the batch)
+#pragma omp for schedule(dynamic)
+            for (size_t t = 0; t < candidates.size() * chunks; t++) {
+                const size_t r = t / chunks;
+                std::fill(sums, sums + K + 1, 0.0);
+                // calculate total loss for some subset of the data, scoring
+                // all K swaps of the candidate from the same distances
+                for (size_t j = (t % chunks) * chunk; j < std::min(B, (t % chunks + 1) * chunk); j++) {
+                    const double cost = distances(r, j);
+                    const double best = ref_best[j];
+                    const double kept = cost < best ? cost : best;
+                    sums[0] += kept - best;
+                    // swapping out the reference's own medoid leaves it with
+                    // its second best distance instead
+                    const double second = ref_second[j];
+                    const double lost = cost < second ? cost : second;
+                    sums[1 + ref_assignment[j]] += lost - kept;
                 }
-            } else {
-                if (cost < best_distances(tmp_refs(j))) {
-                    total += cost;
-                } else {
-                    total += best_distances(tmp_refs(j));
+                std::copy(sums, sums + K + 1, partials + t * (K + 1));
+            }
+        }
+        // reduce the chunks of each candidate
+#pragma omp parallel for
+        for (size_t r = 0; r < candidates.size(); r++) {
+            for (size_t i = first_target[r]; i < first_target[r + 1]; i++) {
+                // extract medoid of swap
+                const size_t k = targets(i) % K;
+                double total = 0;
+                for (size_t c = 0; c < chunks; c++) {
+                    const double* sums = partials + (r * chunks + c) * (K + 1);
+                    total += sums[0] + sums[1 + k];
                 }
+                estimates(i) = total / B;
             }
-            total -= best_distances(tmp_refs(j));
         }
-        estimates(i) = total / tmp_refs.n_rows;
     }
     return estimates;
 }
@@ -888,60 +2876,66 @@ arma::vec KMedoids::swap_target(
 /**
  * \brief Calculates confidence intervals in swap step
  *
- * Calculates the confidence intervals about the reward for each arm
+ * Calculates the confidence intervals about the reward for each arm whose
+ * candidate datapoint is in candidates
  *
  * @param data Transposed input data to find the medoids of
- * @param sigma Dispersion paramater for each datapoint
+ * @param sigma Dispersion paramater for each arm, one column per candidate
  * @param batch_size Number of datapoints sampled for updating confidence
  * intervals
+ * @param candidates Datapoints considered for swapping in
  * @param best_distances Array of best distances from each point to previous set
  * of medoids
  * @param second_best_distances Array of second smallest distances from each
  * point to previous set of medoids
  * @param assignments Assignments of datapoints to their closest medoid
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 void KMedoids::swap_sigma(
-  arma::mat& data,
+  const T& data,
   arma::mat& sigma,
   size_t batch_size,
+  const arma::uvec& candidates,
   arma::rowvec& best_distances,
   arma::rowvec& second_best_distances,
-  arma::rowvec& assignments)
+  arma::rowvec& assignments,
+  const Distance& lossFn)
 {
     size_t N = data.n_cols;
+    size_t C = candidates.n_rows;
     size_t K = sigma.n_rows;
-    arma::uvec tmp_refs = arma::randperm(N,
-                                   batch_size); // without replacement, requires
-                                                // updated version of armadillo
-
-    arma::vec sample(batch_size);
+    const arma::uvec& tmp_refs = sampler.draw(N, batch_size);
+    scratch.gather(tmp_refs, best_distances, &second_best_distances, &assignments);
+    const double* ref_best = scratch.refBest.data();
+    const double* ref_second = scratch.refSecond.data();
+    const size_t* ref_assignment = scratch.refAssignment.data();
+
+    arma::Mat<typename T::elem_type>& distances = scratch.distances<typename T::elem_type>();
+    const size_t tile = std::max<size_t>(1, blockElems / batch_size);
+    // distances from a tile of points to the whole batch are evaluated at once
+    // and shared by the K swaps of each point
+    for (size_t start = 0; start < C; start += tile) {
+        arma::uvec points = candidates.rows(start, std::min(start + tile, C) - 1);
+        lossFn.block(data, points, tmp_refs, distances);
 // for each considered swap
 #pragma omp parallel for
-    for (size_t i = 0; i < K * N; i++) {
-        // extract data point of swap
-        size_t n = i / K;
-        size_t k = i % K;
-
-        // calculate change in loss for some subset of the data
-        for (size_t j = 0; j < batch_size; j++) {
-            double cost = (this->*lossFn)(data, n,tmp_refs(j));
-
-            if (k == assignments(tmp_refs(j))) {
-                if (cost < second_best_distances(tmp_refs(j))) {
-                    sample(j) = cost;
-                } else {
-                    sample(j) = second_best_distances(tmp_refs(j));
-                }
-            } else {
-                if (cost < best_distances(tmp_refs(j))) {
-                    sample(j) = cost;
-                } else {
-                    sample(j) = best_distances(tmp_refs(j));
-                }
+        for (size_t i = start * K; i < (start + points.n_rows) * K; i++) {
+            // extract candidate of swap
+            size_t c = i / K;
+            size_t k = i % K;
+
+            // dispersion of the change in loss on the batch, in one pass
+            RunningStddev sample;
+            for (size_t j = 0; j < tmp_refs.n_rows; j++) {
+                double cost = distances(c - start, j);
+                // swapping out the reference's own medoid leaves it with its
+                // second best distance instead
+                const double kept = k == ref_assignment[j] ? ref_second[j] : ref_best[j];
+                sample.push((cost < kept ? cost : kept) - ref_best[j]);
             }
-            sample(j) -= best_distances(tmp_refs(j));
+            sigma(k, c) = sample.value();
         }
-        sigma(k, n) = arma::stddev(sample);
     }
 }
 
@@ -967,100 +2961,61 @@ void KMedoids::sigma_log(arma::mat& sigma) {
   logHelper.sigma_swap.push_back(sigma_out.str());
 };
 
+/**
+ * \brief Lowers the best distances to those to a new medoid
+ *
+ * Evaluates the distance from the new medoid to each datapoint in parallel
+ * with the policy's per-point kernel, which reads the datapoints in place
+ * rather than gathering them into a block.
+ *
+ * @param data Transposed input data to find the medoids of
+ * @param medoid Index of the new medoid
+ * @param best_distances Array of best distances from each point to the
+ * medoids so far, updated in place
+ * @param lossFn Distance policy used for every distance evaluation
+ */
+template <typename T, typename Distance>
+void KMedoids::refresh_best_distances(
+  const T& data,
+  arma::uword medoid,
+  arma::rowvec& best_distances,
+  const Distance& lossFn)
+{
+    const size_t N = data.n_cols;
+#pragma omp parallel for
+    for (size_t i = 0; i < N; i++) {
+        best_distances(i) = std::min(best_distances(i), lossFn(data, medoid, i));
+    }
+}
+
 /**
  * \brief Calculate loss for medoids
  *
  * Calculates the loss under the previously identified loss function of the
- * medoid indices.
+ * medoid indices. Each datapoint is reduced to its closest medoid in
+ * parallel with the policy's per-point kernel, so no copy of the dataset is
+ * made.
  *
  * @param data Transposed input data to find the medoids of
  * @param medoid_indices Indices of the medoids in the dataset.
+ * @param lossFn Distance policy used for every distance evaluation
  */
+template <typename T, typename Distance>
 double KMedoids::calc_loss(
-  arma::mat& data,
-  arma::rowvec& medoid_indices)
+  const T& data,
+  arma::rowvec& medoid_indices,
+  const Distance& lossFn)
 {
+    const size_t N = data.n_cols;
+    const arma::uvec medoids = arma::conv_to<arma::uvec>::from(medoid_indices);
     double total = 0;
-
-    for (size_t i = 0; i < data.n_cols; i++) {
+#pragma omp parallel for reduction(+:total)
+    for (size_t i = 0; i < N; i++) {
         double cost = std::numeric_limits<double>::infinity();
-        for (size_t k = 0; k < n_medoids; k++) {
-            double currCost = (this->*lossFn)(data, medoid_indices(k), i);
-            if (currCost < cost) {
-                cost = currCost;
-            }
+        for (size_t k = 0; k < medoids.n_elem; k++) {
+            cost = std::min(cost, lossFn(data, medoids(k), i));
         }
         total += cost;
     }
     return total;
 }
-
-// Loss and miscellaneous functions
-
-/**
- * \brief LP loss
- *
- * Calculates the LP loss between the datapoints at index i and j of the dataset
- *
- * @param data Transposed input data to find the medoids of
- * @param i Index of first datapoint
- * @param j Index of second datapoint
- */
-double KMedoids::LP(arma::mat& data, int i, int j) const {
-    return arma::norm(data.col(i) - data.col(j), lp);
-}
-
-/**
- * \brief L2 loss
- *
- * Calculates the L2 loss between the datapoints at index i and j of the dataset
- *
- * @param i Index of first datapoint
- * @param j Index of second datapoint
- */
-//double KMedoids::L2(int i, int j) const {
-//    return arma::norm(data.col(i) - data.col(j), 2);
-//}
-
-/**
- * \brief cos loss
- *
- * Calculates the cosine loss between the datapoints at index i and j of the
- * dataset
- *
- * @param data Transposed input data to find the medoids of
- * @param i Index of first datapoint
- * @param j Index of second datapoint
- */
-double KMedoids::cos(arma::mat& data, int i, int j) const {
-    return arma::dot(data.col(i), data.col(j)) / (arma::norm(data.col(i))
-                                                    * arma::norm(data.col(j)));
-}
-
-/**
- * \brief Manhattan loss
- *
- * Calculates the Manhattan loss between the datapoints at index i and j of the
- * dataset
- *
- * @param data Transposed input data to find the medoids of
- * @param i Index of first datapoint
- * @param j Index of second datapoint
- */
-double KMedoids::manhattan(arma::mat& data, int i, int j) const {
-    return arma::accu(arma::abs(data.col(i) - data.col(j)));
-}
-
-/**
- * \brief L_INFINITY loss
- *
- * Calculates the Manhattan loss between the datapoints at index i and j of the
- * dataset
- *
- * @param data Transposed input data to find the medoids of
- * @param i Index of first datapoint
- * @param j Index of second datapoint
- */
-double KMedoids::LINF(arma::mat& data, int i, int j) const {
-    return arma::max(arma::abs(data.col(i) - data.col(j)));
-}
@@ -8,11 +8,16 @@
  */
 
 #include "kmedoids_ucb.hpp"
+#include "sharded.hpp"
 
 #include <carma.h>
 #include <armadillo>
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 #define STRINGIFY(x) #x
 #define MACRO_STRINGIFY(x) STRINGIFY(x)
@@ -37,6 +42,22 @@ int sum_thread_ids() {
   return sum;
 }
 
+/**
+ *  \brief Fit started by KMedoids.fit_async
+ *
+ *  Owned by its worker thread, which releases the Python references with the
+ *  GIL held.
+ */
+struct AsyncFit {
+    py::object model; ///< KMedoids object being fitted, kept alive by the fit
+
+    py::object future; ///< concurrent.futures.Future resolved with the model
+
+    py::tuple args; ///< positional arguments of the fit call
+
+    py::dict kwargs; ///< keyword arguments of the fit call
+};
+
 /**
  *  \brief Python wrapper for KMedoids class.
  *
@@ -53,17 +74,346 @@ public:
    * This is the primary function of the KMedoids module: this finds the build and swap
    * medoids for the desired data
    *
+   * float32 arrays are clustered in single precision without being converted
+   * to double; every other dtype is converted to double.
+   *
+   * With the "precomputed" loss, inputData is a symmetric N x N dissimilarity
+   * matrix. Contiguous arrays, including numpy.memmap arrays, are read in
+   * place without being copied.
+   *
+   * Passing medoids warm-starts the fit: the build step is skipped and the
+   * swap step starts from the given medoids (see initialMedoidsPython).
+   *
    * @param inputData Input data to find the medoids of
    * @param loss The loss function used during medoid computation
    * @param k The number of medoids to compute
+   * @param medoids Initial medoids, as indices or coordinates
+   * @param logFilename The name of the outputted log file
+   */
+  template <typename eT>
+  void fitPython(py::array_t<eT> inputData, std::string loss, std::string logFilename, py::kwargs kw) {
+    KMedsWrapper::setFitParams(logFilename, kw);
+    const bool contiguous = inputData.ndim() == 2 &&
+      (inputData.flags() & (py::array::c_style | py::array::f_style));
+    if (loss == "precomputed" && contiguous) {
+      // aliases the array; a C ordered matrix is read as its transpose, which
+      // is the same matrix since it is symmetric
+      const arma::Mat<eT> dists(const_cast<eT*>(inputData.data()),
+                                inputData.shape(1), inputData.shape(0), false, true);
+      KMedsWrapper::fitData(dists, loss, kw);
+      return;
+    }
+    KMedsWrapper::fitData(carma::arr_to_mat<eT>(inputData), loss, kw);
+  }
+
+  /**
+   * \brief Python binding for fitting a KMedoids object to sparse data
+   *
+   * Accepts any scipy.sparse matrix (CSR, CSC, COO, ...). Its compressed
+   * column arrays are handed to Armadillo directly, so the data is never
+   * densified. Sparse values are clustered in double precision. Objects that
+   * are not scipy.sparse matrices are converted to a double array and fit
+   * like dense data.
+   *
+   * @param inputData Sparse input data to find the medoids of
+   * @param loss The loss function used during medoid computation
+   * @param k The number of medoids to compute
    * @param logFilename The name of the outputted log file
    */
-  void fitPython(py::array_t<double> inputData, std::string loss, std::string logFilename, py::kwargs kw) {
+  void fitSparsePython(py::object inputData, std::string loss, std::string logFilename, py::kwargs kw) {
+    if (!py::hasattr(inputData, "tocsc")) {
+      fitPython<double>(inputData.cast<py::array_t<double>>(), loss, logFilename, kw);
+      return;
+    }
+    KMedsWrapper::setFitParams(logFilename, kw);
+    // work on a copy: the distance merges need sorted, duplicate-free indices
+    py::object csc = inputData.attr("tocsc")(py::arg("copy") = true);
+    csc.attr("sum_duplicates")();
+    py::array_t<arma::uword, py::array::forcecast> indices(csc.attr("indices"));
+    py::array_t<arma::uword, py::array::forcecast> indptr(csc.attr("indptr"));
+    py::array_t<double, py::array::forcecast> values(csc.attr("data"));
+    py::tuple shape = csc.attr("shape");
+    arma::sp_mat sparse(
+      arma::uvec(indices.data(), indices.size()),
+      arma::uvec(indptr.data(), indptr.size()),
+      arma::vec(values.data(), values.size()),
+      py::cast<arma::uword>(shape[0]),
+      py::cast<arma::uword>(shape[1]));
+    KMedsWrapper::fitData(sparse, loss, kw);
+  }
+
+  /**
+   * \brief Python binding for fitting a KMedoids object in the background
+   *
+   * Takes the arguments of fit and runs it on a new native thread, returning
+   * a running concurrent.futures.Future resolved with this object once the
+   * fit ends (wrap it with asyncio.wrap_future to await it). As for the
+   * futures of a concurrent.futures executor, the running fit cannot be
+   * cancelled through its future; cancel stops it instead. The object must
+   * not be used until the future is done.
+   */
+  py::object fitAsyncPython(py::args args, py::kwargs kw) {
+    py::object future = py::module::import("concurrent.futures").attr("Future")();
+    future.attr("set_running_or_notify_cancel")();
+    // a cancel made before the thread starts the fit still stops it
+    cancelRequested = false;
+    asyncPending = true;
+    AsyncFit* job = new AsyncFit{py::cast(this), future, args, kw};
+    std::thread([job]() {
+      py::gil_scoped_acquire acquire;
+      std::unique_ptr<AsyncFit> owned(job);
+      try {
+        // fit releases the GIL while the native fit runs
+        owned->model.attr("fit")(*owned->args, **owned->kwargs);
+        owned->model.cast<KMedsWrapper&>().asyncPending = false;
+        owned->future.attr("set_result")(owned->model);
+      } catch (py::error_already_set& error) {
+        owned->model.cast<KMedsWrapper&>().asyncPending = false;
+        owned->future.attr("set_exception")(error.value());
+      }
+    }).detach();
+    return future;
+  }
+
+  /**
+   * \brief Python binding for cancelling the running fit
+   *
+   * Asks the fit running on this object, from another thread or started by
+   * fit_async, to stop at its next swap round. The fit then keeps the best
+   * medoids found so far and stop_reason is "cancelled". Has no effect when
+   * no fit runs.
+   */
+  void cancelPython() {
+    cancelRequested = true;
+  }
+
+  /**
+   * \brief Python binding for fitting several numbers of medoids at once
+   *
+   * Runs the build step once up to the largest k and the swap step of every
+   * k in parallel. Returns one dict per entry of k_values, with the keys k,
+   * build_medoids, medoids, labels, loss (total distance of the datapoints
+   * to their medoids), steps and seed (with which a fit warm-started from
+   * build_medoids finds the same medoids). The KMedoids object keeps the
+   * fit of the largest k.
+   *
+   * @param inputData Input data to find the medoids of
+   * @param loss The loss function used during medoid computation
+   * @param kValues Numbers of medoids to find
+   */
+  template <typename eT>
+  py::list fitPathPython(py::array_t<eT> inputData, std::string loss, std::vector<size_t> kValues) {
+    const arma::Mat<eT> data = carma::arr_to_mat<eT>(inputData);
+    std::vector<PathResult> path;
+    {
+      py::gil_scoped_release release;
+      path = KMedoids::fit_path(data, loss, kValues);
+    }
+    py::list results;
+    for (const PathResult& result : path) {
+      py::dict fit;
+      fit["k"] = result.k;
+      fit["build_medoids"] = carma::row_to_arr<double>(arma::rowvec(result.build_medoids)).squeeze();
+      fit["medoids"] = carma::row_to_arr<double>(arma::rowvec(result.medoids)).squeeze();
+      fit["labels"] = carma::row_to_arr<double>(arma::rowvec(result.labels)).squeeze();
+      fit["loss"] = result.loss;
+      fit["steps"] = result.steps;
+      fit["seed"] = result.seed;
+      results.append(fit);
+    }
+    return results;
+  }
+
+  /**
+   * \brief Python binding for fitting many independent models at once
+   *
+   * Fits one new KMedoids per dataset with the settings of this object, its
+   * number of medoids taken from kValues, and returns them in order. Small
+   * datasets run one per thread, larger ones on every thread in turn.
+   *
+   * @param datasets Input data of each model
+   * @param kValues Number of medoids of each model
+   * @param loss The loss function used during medoid computation
+   */
+  template <typename eT>
+  py::list fitManyPython(std::vector<py::array_t<eT>> datasets, std::vector<size_t> kValues, std::string loss) {
+    std::vector<arma::Mat<eT>> data;
+    data.reserve(datasets.size());
+    std::vector<std::unique_ptr<KMedsWrapper>> owned;
+    std::vector<KMedoids*> models;
+    for (py::array_t<eT>& dataset : datasets) {
+      data.push_back(carma::arr_to_mat<eT>(dataset));
+      owned.emplace_back(new KMedsWrapper());
+      models.push_back(owned.back().get());
+    }
+    {
+      py::gil_scoped_release release;
+      KMedoids::fit_many(models, data, kValues, loss);
+    }
+    py::list fitted;
+    for (std::unique_ptr<KMedsWrapper>& model : owned) {
+      fitted.append(py::cast(model.release(), py::return_value_policy::take_ownership));
+    }
+    return fitted;
+  }
+
+  /**
+   * \brief Python binding for fitting a KMedoids object to data on disk
+   *
+   * Clusters a raw file of float64 datapoints stored one after the other,
+   * e.g. a C ordered array written with numpy.ndarray.tofile, without loading
+   * it: the file is memory-mapped and read in place. With the "precomputed"
+   * loss the file holds a symmetric N x N dissimilarity matrix and
+   * n_features is ignored.
+   *
+   * @param path Path to the raw data file
+   * @param nFeatures Number of features of each datapoint
+   * @param loss The loss function used during medoid computation
+   * @param logFilename The name of the outputted log file
+   */
+  void fitMappedPython(std::string path, arma::uword nFeatures, std::string loss, std::string logFilename, py::kwargs kw) {
+    KMedsWrapper::setFitParams(logFilename, kw);
+    KMedsWrapper::armCancel();
+    if (loss == "precomputed") {
+      MappedMatrix dists(path);
+      py::gil_scoped_release release;
+      KMedoids::fit(dists.mat(), loss);
+      return;
+    }
+    if (nFeatures == 0) {
+      throw py::value_error("n_features must be positive");
+    }
+    MappedMatrix points(path, nFeatures);
+    py::gil_scoped_release release;
+    KMedoids::fit(points, loss);
+  }
+
+  /**
+   * \brief Python binding for fitting on datapoints sharded across processes
+   *
+   * Runs BanditPAM with each worker, started with serve_shard, holding a
+   * shard of the datapoints. The labels follow the order of the workers.
+   *
+   * @param workers Address of each worker, "unix:<path>" or "<host>:<port>"
+   * @param loss The loss function used during medoid computation
+   * @param logFilename The name of the outputted log file
+   */
+  void fitShardedPython(std::vector<std::string> workers, std::string loss, std::string logFilename, py::kwargs kw) {
+    KMedsWrapper::setFitParams(logFilename, kw);
+    KMedsWrapper::armCancel();
+    py::gil_scoped_release release;
+    KMedoids::fit_sharded(workers, loss);
+  }
+
+  /**
+   * \brief Python binding for adding a batch of datapoints to a fitted model
+   *
+   * Appends the datapoints to those of the last fit call, assigns them to
+   * their closest medoids and runs a bounded number of bandit rounds to swap
+   * them in as medoids. The batch must have the dtype of the fitted data.
+   *
+   * @param newData New datapoints, one per row
+   * @param maxRounds Maximum number of sampling rounds of the bandit race
+   */
+  template <typename eT>
+  void partialFitPython(py::array_t<eT> newData, size_t maxRounds) {
+    const arma::Mat<eT> data = carma::arr_to_mat<eT>(newData);
+    py::gil_scoped_release release;
+    KMedoids::partial_fit(data, maxRounds);
+  }
+
+  /**
+   * \brief Fits the converted input data, warm-started if medoids is given
+   *
+   * The GIL is released while the fit runs, so other Python threads, including
+   * fits of other KMedoids objects, run meanwhile; data must stay valid until
+   * the fit returns.
+   *
+   * @param data Input data to find the medoids of, one datapoint per row
+   * @param loss The loss function used during medoid computation
+   * @param kw Keyword arguments of the fit call
+   */
+  template <typename Data>
+  void fitData(const Data& data, std::string loss, py::kwargs kw) {
+    KMedsWrapper::armCancel();
+    const bool warm = kw.contains("medoids");
+    const arma::urowvec initial = warm ? KMedsWrapper::initialMedoidsPython(kw["medoids"], data, loss) : arma::urowvec();
+    py::gil_scoped_release release;
+    if (warm) {
+      KMedoids::fit(data, loss, initial);
+    } else {
+      KMedoids::fit(data, loss);
+    }
+  }
+
+  /**
+   * \brief Clears the cancel flag of a fit about to start
+   *
+   * Called with the GIL held, as is cancelPython, so a cancel made while no
+   * fit runs never stops a later fit, except the one fit_async is starting.
+   */
+  void armCancel() {
+    if (!asyncPending) {
+      cancelRequested = false;
+    }
+    asyncPending = false;
+    KMedoids::setCancelFlag(&cancelRequested);
+  }
+
+  /**
+   * \brief Converts the medoids of a warm-started fit to datapoint indices
+   *
+   * A 1-D array is taken as datapoint indices. A 2-D array holds the
+   * coordinates of one medoid per row; each is snapped to the datapoint
+   * nearest to it in Euclidean distance, which also works for sparse data.
+   * Coordinates are meaningless for the "precomputed" loss.
+   *
+   * @param medoids Initial medoids, as indices or coordinates
+   * @param data Input data, one datapoint per row
+   * @param loss The loss function used during medoid computation
+   */
+  template <typename Data>
+  arma::urowvec initialMedoidsPython(py::handle medoids, const Data& data, std::string loss) {
+    typedef typename Data::elem_type eT;
+    py::array arr = py::array::ensure(medoids);
+    if (arr && arr.ndim() == 1) {
+      py::array_t<arma::uword, py::array::forcecast> indices(arr);
+      return arma::urowvec(indices.data(), indices.size());
+    }
+    if (!arr || arr.ndim() != 2 || loss == "precomputed") {
+      throw py::value_error("medoids must be datapoint indices, or coordinates with one medoid per row");
+    }
+    py::array_t<eT, py::array::c_style | py::array::forcecast> coords(arr);
+    if (arma::uword(coords.shape(1)) != data.n_cols) {
+      throw py::value_error("medoid coordinates must have as many columns as the data");
+    }
+    // the rows of a C ordered array are the columns of its column-major view
+    const arma::Mat<eT> medoid_cols(const_cast<eT*>(coords.data()), coords.shape(1), coords.shape(0), false, true);
+    // |x - c|^2 = |x|^2 - 2 x.c + |c|^2, where |c|^2 does not change the argmin
+    const arma::Col<eT> sq_norms(arma::sum(arma::square(data), 1));
+    const arma::Mat<eT> cross(data * medoid_cols);
+    arma::urowvec indices(medoid_cols.n_cols);
+    for (arma::uword m = 0; m < medoid_cols.n_cols; m++) {
+      indices(m) = arma::Col<eT>(sq_norms - 2 * cross.col(m)).index_min();
+    }
+    return indices;
+  }
+
+  /**
+   * \brief Applies the arguments shared by every fit binding
+   *
+   * Throws an error if the number of medoids is specified in neither the
+   * KMedoids object nor the fit call, and sets the logfile name.
+   *
+   * @param logFilename The name of the outputted log file
+   * @param kw Keyword arguments of the fit call; k overrides n_medoids
+   */
+  void setFitParams(std::string logFilename, py::kwargs kw) {
     // throw an error if the number of medoids is not specified in either 
     // the KMedoids object or the fitPython function
     try {
       if (KMedoids::getNMedoids() == NULL) {
-        if (kw.size() == 0) {
+        if (!kw.contains("k") && !kw.contains("medoids")) {
           throw py::value_error("Must specify number of medoids via n_medoids in KMedoids or k in fit function.");
         }
       }
@@ -72,11 +422,10 @@ public:
       throw;
     }
     // if k is specified here, we set the number of medoids as k and override previous value 
-    if ((kw.size() != 0) && (kw["k"])) {
+    if (kw.contains("k")) {
       KMedoids::setNMedoids(py::cast<int>(kw["k"]));
     }
     KMedoids::setLogFilename(logFilename);
-    KMedoids::fit(carma::arr_to_mat<double>(inputData), loss);
   }
 
   /**
@@ -118,6 +467,32 @@ public:
   int getStepsPython() {
     return KMedoids::getSteps();
   }
+
+  /**
+   *  \brief Returns why the swap step of the last fit stopped
+   *
+   *  Returns one of "converged", "max_iter", "time_budget",
+   *  "loss_tolerance" or "cancelled"
+   */
+  std::string getStopReasonPython() {
+    switch (KMedoids::getStopReason()) {
+      case StopReason::MAX_ITER:
+        return "max_iter";
+      case StopReason::TIME_BUDGET:
+        return "time_budget";
+      case StopReason::LOSS_TOLERANCE:
+        return "loss_tolerance";
+      case StopReason::CANCELLED:
+        return "cancelled";
+      default:
+        return "converged";
+    }
+  }
+
+private:
+  std::atomic<bool> cancelRequested{false}; ///< cancel flag of the fits of this object, set by cancelPython
+
+  bool asyncPending = false; ///< fit_async started a thread that has not started its fit yet
 };
 
 PYBIND11_MODULE(BanditPAM, m) {
@@ -125,24 +500,77 @@ PYBIND11_MODULE(BanditPAM, m) {
   m.def("get_max_threads", &omp_get_max_threads, "Returns max number of threads");
   m.def("set_num_threads", &omp_set_num_threads, "Set the maximum number of threads");
   m.def("sum_thread_ids", &sum_thread_ids, "Adds the ids of threads; used only for debugging");
+  m.def("serve_shard", [](py::array_t<double> data, std::string address) {
+          ShardWorker worker(carma::arr_to_mat<double>(data));
+          // the session blocks until the coordinator ends it
+          py::gil_scoped_release release;
+          worker.serve(address);
+        },
+        py::arg("data"), py::arg("address"),
+        "Serves a shard of datapoints, one per row, to one KMedoids.fit_sharded call");
+  m.def("get_simd_isa", []() { return std::string(simd::kernels<double>().isa); },
+        "Returns the instruction set selected for the distance kernels");
   py::class_<KMedsWrapper>(m, "KMedoids")
-      .def(py::init<int, std::string, int, int, std::string>(),
+      .def(py::init<int, std::string, int, int, std::string, size_t>(),
         py::arg("n_medoids") = NULL,
         py::arg("algorithm") = "BanditPAM",
         py::arg("verbosity") = 0,
         py::arg("maxIter") = 1000,
-        py::arg("logFilename") = "KMedoidsLogfile"
+        py::arg("logFilename") = "KMedoidsLogfile",
+        py::arg("seed") = 0
       )
       .def_property("n_medoids", &KMedsWrapper::getNMedoids, &KMedsWrapper::setNMedoids)
       .def_property("algorithm", &KMedsWrapper::getAlgorithm, &KMedsWrapper::setAlgorithm)
       .def_property("verbosity", &KMedsWrapper::getVerbosity, &KMedsWrapper::setVerbosity)
       .def_property("maxIter", &KMedsWrapper::getMaxIter, &KMedsWrapper::setMaxIter)
       .def_property("logFilename", &KMedsWrapper::getLogfileName, &KMedsWrapper::setLogFilename)
+      .def_property("cache_bytes", &KMedsWrapper::getCacheBytes, &KMedsWrapper::setCacheBytes)
+      .def_property("batch_size", &KMedsWrapper::getBatchSize, &KMedsWrapper::setBatchSize)
+      .def_property("build_confidence", &KMedsWrapper::getBuildConfidence, &KMedsWrapper::setBuildConfidence)
+      .def_property("swap_confidence", &KMedsWrapper::getSwapConfidence, &KMedsWrapper::setSwapConfidence)
+      .def_property("adaptive_batch", &KMedsWrapper::getAdaptiveBatch, &KMedsWrapper::setAdaptiveBatch)
+      .def_property("pilot_error_rate", &KMedsWrapper::getPilotErrorRate, &KMedsWrapper::setPilotErrorRate)
+      .def_property("time_budget", &KMedsWrapper::getTimeBudget, &KMedsWrapper::setTimeBudget)
+      .def_property("loss_tolerance", &KMedsWrapper::getLossTolerance, &KMedsWrapper::setLossTolerance)
+      .def_property("seed", &KMedsWrapper::getSeed, &KMedsWrapper::setSeed)
+      .def_property("numa", &KMedsWrapper::getNumaMode, &KMedsWrapper::setNumaMode)
       .def_property_readonly("medoids", &KMedsWrapper::getMedoidsFinalPython)
       .def_property_readonly("build_medoids", &KMedsWrapper::getMedoidsBuildPython)
       .def_property_readonly("labels", &KMedsWrapper::getLabelsPython)
       .def_property_readonly("steps", &KMedsWrapper::getStepsPython)
-      .def("fit", &KMedsWrapper::fitPython);
+      .def_property_readonly("stop_reason", &KMedsWrapper::getStopReasonPython)
+      .def_property_readonly("cache_hits", &KMedsWrapper::getCacheHits)
+      .def_property_readonly("cache_misses", &KMedsWrapper::getCacheMisses)
+      .def_property_readonly("distance_calls", &KMedsWrapper::getDistanceCalls)
+      .def_property_readonly("build_distance_calls", &KMedsWrapper::getBuildDistanceCalls)
+      .def_property_readonly("swap_distance_calls", &KMedsWrapper::getSwapDistanceCalls)
+      .def("fit", &KMedsWrapper::fitPython<double>)
+      .def("fit", &KMedsWrapper::fitPython<float>)
+      .def("fit", &KMedsWrapper::fitSparsePython)
+      .def("fit_async", &KMedsWrapper::fitAsyncPython,
+        "Runs fit on a native thread and returns a concurrent.futures.Future of the fitted model")
+      .def("cancel", &KMedsWrapper::cancelPython,
+        "Stops the running fit at its next swap round")
+      .def("fit_path", &KMedsWrapper::fitPathPython<double>,
+        py::arg("data"), py::arg("loss"), py::arg("k_values"))
+      .def("fit_path", &KMedsWrapper::fitPathPython<float>,
+        py::arg("data"), py::arg("loss"), py::arg("k_values"))
+      .def("fit_many", &KMedsWrapper::fitManyPython<double>,
+        py::arg("datasets"), py::arg("k_values"), py::arg("loss") = "L2")
+      .def("fit_many", &KMedsWrapper::fitManyPython<float>,
+        py::arg("datasets"), py::arg("k_values"), py::arg("loss") = "L2")
+      .def("fit_mapped", &KMedsWrapper::fitMappedPython,
+        py::arg("path"), py::arg("n_features"), py::arg("loss") = "L2",
+        py::arg("logFilename") = "KMedoidsLogfile")
+      .def("fit_sharded", &KMedsWrapper::fitShardedPython,
+        py::arg("workers"), py::arg("loss") = "L2",
+        py::arg("logFilename") = "KMedoidsLogfile")
+      .def("partial_fit", &KMedsWrapper::partialFitPython<double>,
+        py::arg("data"), py::arg("max_rounds") = 10)
+      .def("partial_fit", &KMedsWrapper::partialFitPython<float>,
+        py::arg("data"), py::arg("max_rounds") = 10)
+      .def("loss", &KMedsWrapper::loss,
+        "Returns the total distance of the fitted datapoints to their closest medoid");
 #ifdef VERSION_INFO
   m.attr("__version__") = MACRO_STRINGIFY(VERSION_INFO);
 #else
@@ -7,9 +7,21 @@
  *
  * Usage (from home repo directory):
  * ./src/build/BanditPAM -f [path/to/input] -k [number of clusters]
+ *
+ * With -l precomputed the input is an N x N dissimilarity matrix. A ".bin"
+ * input is read as raw column-major doubles through a memory mapping instead
+ * of being loaded. For other losses a ".bin" input holds one datapoint of
+ * -d [dimension] doubles after the other and is clustered out of core.
+ *
+ * Sharded fits run one worker per shard, each serving its input file with
+ * -w [address], and a coordinator given the comma separated worker
+ * addresses with -c [addresses] instead of an input file. Addresses are
+ * unix:<path> or <host>:<port>.
  */
 
 #include "kmedoids_ucb.hpp"
+#include "mapped_matrix.hpp"
+#include "sharded.hpp"
 
 #include <armadillo>
 #include <chrono>
@@ -17,12 +29,14 @@
 #include <unistd.h>
 #include <exception>
 #include <regex>
+#include <sstream>
 
 int main(int argc, char* argv[])
 {   
     std::string input_name;
     std::string log_file_name = "KMedoidsLogfile";
     int k;
+    arma::uword dimension = 0;
     int opt;
     int prev_ind;
     int verbosity = 0;
@@ -30,9 +44,12 @@ int main(int argc, char* argv[])
     std::string loss = "2";
     bool f_flag = false;
     bool k_flag = false;
+    bool numa_mode = false;
+    std::string serve_address;
+    std::vector<std::string> workers;
     const int ARGUMENT_ERROR_CODE = 1;
 
-    while (prev_ind = optind, (opt = getopt(argc, argv, "f:l:k:v:s:")) != -1) {
+    while (prev_ind = optind, (opt = getopt(argc, argv, "f:l:k:v:s:d:nw:c:")) != -1) {
 
         if ( optind == prev_ind + 2 && *optarg == '-' ) {
         opt = ':';
@@ -62,6 +79,27 @@ int main(int argc, char* argv[])
             case 'v':
                 verbosity = std::stoi(optarg);
                 break;
+            // dimension of the datapoints of a mapped input
+            case 'd':
+                dimension = std::stoul(optarg);
+                break;
+            // pin threads and place the data on their NUMA nodes
+            case 'n':
+                numa_mode = true;
+                break;
+            // serve the input file as a shard at this address
+            case 'w':
+                serve_address = optarg;
+                break;
+            // coordinate a sharded fit over these worker addresses
+            case 'c': {
+                std::stringstream addresses(optarg);
+                std::string address;
+                while (std::getline(addresses, address, ',')) {
+                    workers.push_back(address);
+                }
+                break;
+            }
             case ':':
                 printf("option needs a value\n");
                 return ARGUMENT_ERROR_CODE;
@@ -72,9 +110,9 @@ int main(int argc, char* argv[])
     }
 
     try {
-      if (!f_flag) {
+      if (!f_flag && workers.empty()) {
         throw std::invalid_argument("error: Must specify input file via -f flag");
-      } else if (!k_flag) {
+      } else if (!k_flag && serve_address.empty()) {
         throw std::invalid_argument("error: Must specify number of clusters via -k flag");
       } 
     } catch (std::invalid_argument& e) {
@@ -82,13 +120,40 @@ int main(int argc, char* argv[])
       return ARGUMENT_ERROR_CODE;
     }
 
-    arma::mat data;
-    data.load(input_name);
-    arma::uword n = data.n_cols;
-    arma::uword d = data.n_rows;
+    if (!serve_address.empty()) {
+      arma::mat shard;
+      shard.load(input_name);
+      ShardWorker(shard).serve(serve_address);
+      return 0;
+    }
+
+    const bool mapped = std::regex_search(input_name, std::regex("\\.bin$"));
+    try {
+      if (mapped && loss != "precomputed" && dimension == 0) {
+        throw std::invalid_argument("error: Must specify the dimension of a .bin input via -d flag");
+      }
+    } catch (std::invalid_argument& e) {
+      std::cout << e.what() << std::endl;
+      return ARGUMENT_ERROR_CODE;
+    }
 
     KMedoids kmed(k, "BanditPAM", verbosity, max_iter, log_file_name);
-    kmed.fit(data, loss);
+    kmed.setNumaMode(numa_mode);
+    if (!workers.empty()) {
+      kmed.fit_sharded(workers, loss);
+    } else if (mapped && loss == "precomputed") {
+      MappedMatrix dists(input_name);
+      kmed.fit(dists.mat(), loss);
+    } else if (mapped) {
+      MappedMatrix points(input_name, dimension);
+      kmed.fit(points, loss);
+    } else {
+      arma::mat data;
+      data.load(input_name);
+      arma::uword n = data.n_cols;
+      arma::uword d = data.n_rows;
+      kmed.fit(data, loss);
+    }
 
     if (verbosity > 0) {
       arma::rowvec meds = kmed.getMedoidsFinal();
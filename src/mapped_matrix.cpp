@@ -0,0 +1,161 @@
+/**
+ * @file mapped_matrix.cpp
+ *
+ * Memory-mapped, read-only matrices used to pass data that does not fit in
+ * memory to KMedoids::fit.
+ *
+ */
+#include "mapped_matrix.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ *  \brief Maps a matrix of the given shape
+ *
+ *  Maps the raw column-major file of doubles at path. The file must hold at
+ *  least n_rows x n_cols entries. The matrix aliases the mapping, no copy is
+ *  made.
+ *
+ *  @param path Path to the raw matrix file
+ *  @param n_rows Number of rows of the matrix
+ *  @param n_cols Number of columns of the matrix
+ */
+MappedMatrix::MappedMatrix(const std::string& path, arma::uword n_rows, arma::uword n_cols)
+  : addr(MappedMatrix::map(path, n_rows * n_cols * sizeof(double))),
+    length(n_rows * n_cols * sizeof(double)),
+    view(static_cast<double*>(addr), n_rows, n_cols, false, true) {}
+
+/**
+ *  \brief Maps a matrix with the given number of rows
+ *
+ *  Maps the raw column-major file of doubles at path, with the number of
+ *  columns inferred from the size of the file. A dataset stored with one
+ *  datapoint per column, e.g. a C ordered N x d array written with
+ *  numpy.ndarray.tofile, is mapped with n_rows = d.
+ *
+ *  @param path Path to the raw matrix file
+ *  @param n_rows Number of rows of the matrix
+ */
+MappedMatrix::MappedMatrix(const std::string& path, arma::uword n_rows)
+  : MappedMatrix(path, n_rows, n_rows > 0 ? MappedMatrix::fileEntries(path) / n_rows : 0) {}
+
+/**
+ *  \brief Maps a square matrix
+ *
+ *  Maps the raw column-major file of doubles at path as an N x N matrix, with
+ *  N inferred from the size of the file. Used for precomputed dissimilarity
+ *  matrices.
+ *
+ *  @param path Path to the raw matrix file
+ */
+MappedMatrix::MappedMatrix(const std::string& path)
+  : MappedMatrix(path, MappedMatrix::squareSize(path)) {}
+
+/**
+ *  \brief Unmaps the file
+ */
+MappedMatrix::~MappedMatrix() {
+  munmap(addr, length);
+}
+
+/**
+ *  \brief Returns the matrix aliasing the mapping
+ */
+const arma::mat& MappedMatrix::mat() const {
+  return view;
+}
+
+/**
+ *  \brief Prefetches columns of the matrix
+ *
+ *  Advises the kernel that the given columns will be read soon, so it starts
+ *  reading them from disk without blocking. Runs of adjacent columns are
+ *  advised with a single call.
+ *
+ *  @param cols Indices of the columns to prefetch
+ */
+void MappedMatrix::prefetch(const arma::uvec& cols) const {
+  static const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t col_bytes = view.n_rows * sizeof(double);
+  char* base = static_cast<char*>(addr);
+  size_t start = 0;
+  size_t end = 0;
+  for (arma::uword c : cols) {
+    // madvise needs page aligned addresses; the mapping itself is aligned
+    const size_t first = size_t(c) * col_bytes / page * page;
+    const size_t last = std::min(length, size_t(c + 1) * col_bytes);
+    if (first <= end && last >= start && end > start) {
+      start = std::min(start, first);
+      end = std::max(end, last);
+      continue;
+    }
+    if (end > start) {
+      madvise(base + start, end - start, MADV_WILLNEED);
+    }
+    start = first;
+    end = last;
+  }
+  if (end > start) {
+    madvise(base + start, end - start, MADV_WILLNEED);
+  }
+}
+
+/**
+ *  \brief Maps the first length bytes of a file read-only
+ *
+ *  @param path Path to the raw matrix file
+ *  @param length Number of bytes to map
+ */
+void* MappedMatrix::map(const std::string& path, size_t length) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("error: cannot open " + path + ": " + std::strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < length) {
+    close(fd);
+    throw std::runtime_error("error: " + path + " is smaller than the requested matrix");
+  }
+  void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  // the mapping stays valid after the descriptor is closed
+  close(fd);
+  if (addr == MAP_FAILED) {
+    throw std::runtime_error("error: cannot map " + path + ": " + std::strerror(errno));
+  }
+  return addr;
+}
+
+/**
+ *  \brief Number of doubles stored at path
+ *
+ *  @param path Path to the raw matrix file
+ */
+arma::uword MappedMatrix::fileEntries(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    throw std::runtime_error("error: cannot stat " + path + ": " + std::strerror(errno));
+  }
+  return st.st_size / sizeof(double);
+}
+
+/**
+ *  \brief Number of rows of the square matrix of doubles stored at path
+ *
+ *  @param path Path to the raw matrix file
+ */
+arma::uword MappedMatrix::squareSize(const std::string& path) {
+  const arma::uword entries = MappedMatrix::fileEntries(path);
+  const arma::uword n = std::llround(std::sqrt(double(entries)));
+  if (n * n != entries) {
+    throw std::runtime_error("error: " + path + " does not hold a square matrix of doubles");
+  }
+  return n;
+}
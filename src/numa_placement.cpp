@@ -0,0 +1,141 @@
+/**
+ * @file numa_placement.cpp
+ *
+ * NUMA topology discovery and thread pinning used by the NUMA mode of
+ * KMedoids::fit.
+ *
+ */
+#include "numa_placement.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <omp.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace numa {
+
+namespace {
+
+/**
+ *  \brief Parses a sysfs CPU list such as "0-15,32-47"
+ */
+std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        const size_t dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ *  \brief Reads the topology, keeping the CPUs in the affinity mask
+ */
+std::vector<std::vector<int>> readNodeCpus() {
+    std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return nodes;
+    }
+    for (int node = 0; ; node++) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!file) {
+            break;
+        }
+        std::string list;
+        std::getline(file, list);
+        std::vector<int> cpus;
+        for (int cpu : parseCpuList(list)) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            nodes.push_back(cpus);
+        }
+    }
+    if (nodes.empty()) {
+        // unknown topology: every allowed CPU forms one node
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        nodes.push_back(cpus);
+    }
+#endif
+    return nodes;
+}
+
+} // namespace
+
+const std::vector<std::vector<int>>& nodeCpus() {
+    static const std::vector<std::vector<int>> nodes = readNodeCpus();
+    return nodes;
+}
+
+/**
+ *  \brief Pins every thread of the OpenMP pool to a CPU of its node
+ */
+ThreadPinning::ThreadPinning() {
+#ifdef __linux__
+    const std::vector<std::vector<int>>& nodes = nodeCpus();
+    if (nodes.empty()) {
+        return;
+    }
+#pragma omp parallel
+    {
+        const size_t t = omp_get_thread_num();
+        const size_t n = omp_get_num_threads();
+#pragma omp single
+        masks.assign(n, std::vector<char>(sizeof(cpu_set_t)));
+        pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                               reinterpret_cast<cpu_set_t*>(masks[t].data()));
+        // threads are split over the nodes in contiguous groups
+        const size_t node = t * nodes.size() / n;
+        const size_t first = (node * n + nodes.size() - 1) / nodes.size();
+        const std::vector<int>& cpus = nodes[node];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[(t - first) % cpus.size()], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+}
+
+/**
+ *  \brief Restores the affinity of every thread of the OpenMP pool
+ */
+ThreadPinning::~ThreadPinning() {
+#ifdef __linux__
+    if (masks.empty()) {
+        return;
+    }
+#pragma omp parallel num_threads(masks.size())
+    {
+        const size_t t = omp_get_thread_num();
+        if (t < masks.size()) {
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                   reinterpret_cast<cpu_set_t*>(masks[t].data()));
+        }
+    }
+#endif
+}
+
+} // namespace numa
@@ -0,0 +1,1077 @@
+/**
+ * @file sharded.cpp
+ *
+ * Workers, coordinator and socket protocol of KMedoids::fit_sharded, which
+ * runs BanditPAM over datapoints split across processes.
+ *
+ */
+#include "sharded.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <limits>
+#include <thread>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ *  \brief Header sent before every payload
+ */
+struct FrameHeader {
+    uint32_t op;
+
+    uint64_t length;
+};
+
+/**
+ *  \brief Listening or connecting socket of an address
+ */
+struct Endpoint {
+    bool local; ///< Unix domain socket rather than TCP
+
+    std::string path; ///< socket path of a Unix domain address
+
+    std::string host;
+
+    std::string port;
+};
+
+Endpoint parseAddress(const std::string& address) {
+    Endpoint endpoint;
+    if (address.compare(0, 5, "unix:") == 0) {
+        endpoint.local = true;
+        endpoint.path = address.substr(5);
+        if (endpoint.path.empty() || endpoint.path.size() >= sizeof(sockaddr_un::sun_path)) {
+            throw std::invalid_argument("error: invalid unix socket path in " + address);
+        }
+        return endpoint;
+    }
+    const size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+        throw std::invalid_argument("error: shard address must be unix:<path> or <host>:<port>, got " + address);
+    }
+    endpoint.local = false;
+    endpoint.host = address.substr(0, colon);
+    endpoint.port = address.substr(colon + 1);
+    return endpoint;
+}
+
+sockaddr_un unixAddress(const std::string& path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+    return addr;
+}
+
+/**
+ *  \brief Resolves a TCP address; the result is freed with freeaddrinfo
+ */
+addrinfo* resolve(const Endpoint& endpoint, bool passive) {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo* result = nullptr;
+    const int status = getaddrinfo(endpoint.host.c_str(), endpoint.port.c_str(), &hints, &result);
+    if (status != 0) {
+        throw std::runtime_error("error: cannot resolve " + endpoint.host + ": " + gai_strerror(status));
+    }
+    return result;
+}
+
+/**
+ *  \brief Connects once; returns -1 if nobody listens yet
+ */
+int tryConnect(const Endpoint& endpoint) {
+    if (endpoint.local) {
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        const sockaddr_un addr = unixAddress(endpoint.path);
+        if (fd >= 0 && ::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+            return fd;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    addrinfo* addrs = resolve(endpoint, false);
+    int connected = -1;
+    for (addrinfo* a = addrs; a != nullptr && connected < 0; a = a->ai_next) {
+        const int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            // requests are small and answered one at a time
+            const int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            connected = fd;
+        } else {
+            close(fd);
+        }
+    }
+    freeaddrinfo(addrs);
+    return connected;
+}
+
+/**
+ *  \brief Binds and listens on an address
+ */
+int listenOn(const Endpoint& endpoint) {
+    if (endpoint.local) {
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        const sockaddr_un addr = unixAddress(endpoint.path);
+        // a socket file left by an earlier worker would make bind fail
+        unlink(endpoint.path.c_str());
+        if (fd < 0 || bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            listen(fd, 1) != 0) {
+            throw std::runtime_error("error: cannot listen on unix:" + endpoint.path + ": " + std::strerror(errno));
+        }
+        return fd;
+    }
+    addrinfo* addrs = resolve(endpoint, true);
+    int listening = -1;
+    for (addrinfo* a = addrs; a != nullptr && listening < 0; a = a->ai_next) {
+        const int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        const int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, 1) == 0) {
+            listening = fd;
+        } else {
+            close(fd);
+        }
+    }
+    freeaddrinfo(addrs);
+    if (listening < 0) {
+        throw std::runtime_error("error: cannot listen on " + endpoint.host + ":" + endpoint.port + ": " + std::strerror(errno));
+    }
+    return listening;
+}
+
+void writeAll(int fd, const char* bytes, size_t n) {
+    while (n > 0) {
+        const ssize_t written = ::send(fd, bytes, n, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            throw std::runtime_error(std::string("error: shard connection lost: ") + std::strerror(errno));
+        }
+        bytes += written;
+        n -= written;
+    }
+}
+
+void readAll(int fd, char* bytes, size_t n) {
+    while (n > 0) {
+        const ssize_t got = ::recv(fd, bytes, n, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got == 0) {
+            throw std::runtime_error("error: shard connection closed by peer");
+        }
+        if (got < 0) {
+            throw std::runtime_error(std::string("error: shard connection lost: ") + std::strerror(errno));
+        }
+        bytes += got;
+        n -= got;
+    }
+}
+
+/**
+ *  \brief Receives the reply to op, failing on any other message
+ */
+void expect(ShardConnection& connection, ShardOp op, ShardMessage& reply) {
+    if (connection.receive(reply) != op) {
+        throw std::runtime_error("error: unexpected reply from shard worker");
+    }
+}
+
+} // namespace
+
+/**
+ *  \brief Connects to address, retrying while the worker starts up
+ *
+ *  @param address Address of the worker, "unix:<path>" or "<host>:<port>"
+ *  @param timeoutSeconds Time to wait for the worker to listen
+ */
+std::unique_ptr<ShardConnection> ShardConnection::connect(const std::string& address, double timeoutSeconds) {
+    const Endpoint endpoint = parseAddress(address);
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::duration<double>(timeoutSeconds);
+    while (true) {
+        const int fd = tryConnect(endpoint);
+        if (fd >= 0) {
+            return std::unique_ptr<ShardConnection>(new ShardConnection(fd));
+        }
+        if (std::chrono::steady_clock::now() > deadline) {
+            throw std::runtime_error("error: cannot connect to shard worker at " + address);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+ShardConnection::ShardConnection(int fd) : fd(fd) {}
+
+ShardConnection::~ShardConnection() {
+    close(fd);
+}
+
+/**
+ *  \brief Sends op with its payload
+ */
+void ShardConnection::send(ShardOp op, const ShardMessage& message) {
+    FrameHeader header;
+    header.op = static_cast<uint32_t>(op);
+    header.length = message.bytes.size();
+    writeAll(fd, reinterpret_cast<const char*>(&header.op), sizeof(header.op));
+    writeAll(fd, reinterpret_cast<const char*>(&header.length), sizeof(header.length));
+    writeAll(fd, message.bytes.data(), message.bytes.size());
+}
+
+/**
+ *  \brief Receives the next message into message and returns its op
+ */
+ShardOp ShardConnection::receive(ShardMessage& message) {
+    FrameHeader header;
+    readAll(fd, reinterpret_cast<char*>(&header.op), sizeof(header.op));
+    readAll(fd, reinterpret_cast<char*>(&header.length), sizeof(header.length));
+    message = ShardMessage();
+    message.bytes.resize(header.length);
+    readAll(fd, message.bytes.data(), header.length);
+    return static_cast<ShardOp>(header.op);
+}
+
+/**
+ *  \brief Creates a worker holding shard
+ *
+ *  @param shard Datapoints of the shard, one per row
+ */
+ShardWorker::ShardWorker(const arma::mat& shard)
+  : data(arma::trans(shard)),
+    nLocal(shard.n_rows) {}
+
+/**
+ *  \brief Serves one coordinator session on address
+ *
+ *  Listens on address, accepts a single coordinator and answers its
+ *  requests until it ends the session.
+ *
+ *  @param address Address to listen on, "unix:<path>" or "<host>:<port>"
+ */
+void ShardWorker::serve(const std::string& address) {
+    const Endpoint endpoint = parseAddress(address);
+    const int listening = listenOn(endpoint);
+    const int fd = accept(listening, nullptr, nullptr);
+    close(listening);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("error: cannot accept coordinator: ") + std::strerror(errno));
+    }
+    if (!endpoint.local) {
+        const int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    ShardConnection connection(fd);
+    bool done = false;
+    while (!done) {
+        ShardMessage request;
+        ShardMessage reply;
+        const ShardOp op = connection.receive(request);
+        switch (op) {
+            case ShardOp::HELLO:
+                hello(request, reply);
+                break;
+            case ShardOp::POINTS:
+                points(request, reply);
+                break;
+            case ShardOp::COORDINATES:
+                coordinates(request);
+                continue;
+            case ShardOp::REFERENCES:
+                sampleReferences(request, reply);
+                break;
+            case ShardOp::BUILD_ESTIMATE:
+                buildEstimate(request, reply);
+                break;
+            case ShardOp::SWAP_ESTIMATE:
+                swapEstimate(request, reply);
+                break;
+            case ShardOp::ADD_MEDOID:
+                addMedoid(request, reply);
+                break;
+            case ShardOp::SET_MEDOIDS:
+                setMedoids(request, reply);
+                break;
+            case ShardOp::LABELS: {
+                std::vector<uint64_t> labels(assignments.begin(), assignments.end());
+                reply.putArray(labels.data(), labels.size());
+                break;
+            }
+            case ShardOp::BYE:
+                done = true;
+                continue;
+            default:
+                throw std::runtime_error("error: unknown shard request");
+        }
+        connection.send(op, reply);
+    }
+    if (endpoint.local) {
+        unlink(endpoint.path.c_str());
+    }
+}
+
+/**
+ *  \brief Starts a session: sets its loss, seed and the shard's position
+ */
+void ShardWorker::hello(ShardMessage& request, ShardMessage& reply) {
+    lossType = static_cast<LossType>(request.get<uint32_t>());
+    lp = request.get<int32_t>();
+    const uint64_t seed = request.get<uint64_t>();
+    const uint64_t shard = request.get<uint64_t>();
+    offset = request.get<uint64_t>();
+    // every shard draws its own stream of references
+    sampler.seed(seed, shard + 1);
+    cached.clear();
+    candidates.reset();
+    nCached = 0;
+    bestDistances.set_size(nLocal);
+    bestDistances.fill(std::numeric_limits<double>::infinity());
+    secondDistances = bestDistances;
+    assignments.zeros(nLocal);
+    reply.put<uint64_t>(nLocal);
+    reply.put<uint64_t>(data.n_rows);
+}
+
+/**
+ *  \brief Returns the coordinates of datapoints of the shard
+ */
+void ShardWorker::points(ShardMessage& request, ShardMessage& reply) {
+    const std::vector<uint64_t> indices = request.getArray<uint64_t>();
+    const arma::mat coordinates = gather(indices, 0, indices.size());
+    reply.putArray(coordinates.memptr(), coordinates.n_elem);
+}
+
+/**
+ *  \brief Caches the coordinates of datapoints of other shards
+ *
+ *  The cache grows geometrically; it only ever holds pruned candidates and
+ *  medoids, never a copy of the shard.
+ */
+void ShardWorker::coordinates(ShardMessage& request) {
+    const std::vector<uint64_t> indices = request.getArray<uint64_t>();
+    const std::vector<double> values = request.getArray<double>();
+    const arma::uword D = data.n_rows;
+    if (values.size() != indices.size() * D) {
+        throw std::runtime_error("error: malformed shard coordinates");
+    }
+    if (nCached + indices.size() > candidates.n_cols) {
+        const arma::uword capacity = std::max<arma::uword>(nCached + indices.size(), 2 * candidates.n_cols);
+        candidates.resize(D, capacity);
+    }
+    for (size_t i = 0; i < indices.size(); i++) {
+        const double* point = values.data() + i * D;
+        std::copy(point, point + D, candidates.colptr(nCached));
+        cached[indices[i]] = nCached;
+        nCached++;
+    }
+}
+
+/**
+ *  \brief Returns a batch of references of the shard with their state
+ */
+void ShardWorker::sampleReferences(ShardMessage& request, ShardMessage& reply) {
+    const arma::uvec local = references(request.get<uint64_t>());
+    localReferences(local, 0, local.n_elem).write(reply);
+}
+
+/**
+ *  \brief Sums the build losses of arms over a batch of references
+ *
+ *  The value of arm n on reference j is its distance to j, or the change in
+ *  the best distance of j when n joins the medoids. The references are the
+ *  broadcast batch, or else a batch sampled from the shard.
+ */
+void ShardWorker::buildEstimate(ShardMessage& request, ShardMessage& reply) {
+    const std::vector<uint64_t> arms = request.getArray<uint64_t>();
+    const uint64_t batch = request.get<uint64_t>();
+    const bool use_absolute = request.get<uint8_t>() != 0;
+    const bool broadcast = request.get<uint8_t>() != 0;
+    ShardReferences shared;
+    arma::uvec local;
+    if (broadcast) {
+        shared.read(request, data.n_rows);
+    } else {
+        local = references(batch);
+    }
+    arma::vec sum(arms.size(), arma::fill::zeros);
+    arma::vec sum_sq(arms.size(), arma::fill::zeros);
+    for (size_t start = 0; start < arms.size(); start += blockCols) {
+        const arma::mat tile = gather(arms, start, std::min(start + blockCols, arms.size()));
+        forReferences(broadcast, shared, local, [&](const ShardReferences& refs) {
+            buildSums(tile, start, refs, use_absolute, sum, sum_sq);
+        });
+    }
+    reply.put<double>(broadcast ? shared.best.n_elem : local.n_elem);
+    reply.putArray(sum.memptr(), sum.n_elem);
+    reply.putArray(sum_sq.memptr(), sum_sq.n_elem);
+}
+
+/**
+ *  \brief Sums the swap losses of arms over a batch of references
+ *
+ *  Arm n * nMedoids + k swaps datapoint n in for medoid slot k. The
+ *  references are the broadcast batch, or else a batch sampled from the
+ *  shard.
+ */
+void ShardWorker::swapEstimate(ShardMessage& request, ShardMessage& reply) {
+    const std::vector<uint64_t> arms = request.getArray<uint64_t>();
+    const uint64_t batch = request.get<uint64_t>();
+    const uint64_t K = request.get<uint64_t>();
+    const bool broadcast = request.get<uint8_t>() != 0;
+    ShardReferences shared;
+    arma::uvec local;
+    if (broadcast) {
+        shared.read(request, data.n_rows);
+    } else {
+        local = references(batch);
+    }
+    // arms sharing a candidate come adjacent and share its distances
+    std::vector<uint64_t> points;
+    std::vector<size_t> first_arm;
+    for (size_t i = 0; i < arms.size(); i++) {
+        if (first_arm.empty() || arms[i] / K != arms[first_arm.back()] / K) {
+            points.push_back(arms[i] / K);
+            first_arm.push_back(i);
+        }
+    }
+    first_arm.push_back(arms.size());
+    arma::vec sum(arms.size(), arma::fill::zeros);
+    arma::vec sum_sq(arms.size(), arma::fill::zeros);
+    for (size_t start = 0; start < points.size(); start += blockCols) {
+        const arma::mat tile = gather(points, start, std::min(start + blockCols, points.size()));
+        forReferences(broadcast, shared, local, [&](const ShardReferences& refs) {
+            swapSums(tile, start, refs, arms, first_arm, K, sum, sum_sq);
+        });
+    }
+    reply.put<double>(broadcast ? shared.best.n_elem : local.n_elem);
+    reply.putArray(sum.memptr(), sum.n_elem);
+    reply.putArray(sum_sq.memptr(), sum_sq.n_elem);
+}
+
+/**
+ *  \brief Lowers the best distances of the shard to a new build medoid
+ */
+void ShardWorker::addMedoid(ShardMessage& request, ShardMessage& reply) {
+    const arma::mat medoid = gather({request.get<uint64_t>()}, 0, 1);
+    arma::mat distances;
+    for (size_t start = 0; start < nLocal; start += blockCols) {
+        const size_t end = std::min<size_t>(start + blockCols, nLocal);
+        pairwise(medoid, data.cols(start, end - 1), distances);
+#pragma omp parallel for
+        for (size_t i = start; i < end; i++) {
+            bestDistances(i) = std::min(bestDistances(i), distances(0, i - start));
+        }
+    }
+    reply.put<double>(arma::accu(bestDistances));
+}
+
+/**
+ *  \brief Assigns the datapoints of the shard to a new set of medoids
+ */
+void ShardWorker::setMedoids(ShardMessage& request, ShardMessage& reply) {
+    const std::vector<uint64_t> indices = request.getArray<uint64_t>();
+    const arma::mat medoids = gather(indices, 0, indices.size());
+    arma::mat distances;
+    for (size_t start = 0; start < nLocal; start += blockCols) {
+        const size_t end = std::min<size_t>(start + blockCols, nLocal);
+        pairwise(medoids, data.cols(start, end - 1), distances);
+#pragma omp parallel for
+        for (size_t i = start; i < end; i++) {
+            double best = std::numeric_limits<double>::infinity();
+            double second = std::numeric_limits<double>::infinity();
+            arma::uword slot = 0;
+            for (size_t k = 0; k < medoids.n_cols; k++) {
+                const double cost = distances(k, i - start);
+                if (cost < best) {
+                    second = best;
+                    best = cost;
+                    slot = k;
+                } else if (cost < second) {
+                    second = cost;
+                }
+            }
+            bestDistances(i) = best;
+            secondDistances(i) = second;
+            assignments(i) = slot;
+        }
+    }
+    reply.put<double>(arma::accu(bestDistances));
+}
+
+/**
+ *  \brief Adds the build losses of a tile of candidates over refs
+ *
+ *  @param candidates Coordinates of the candidates, one per column
+ *  @param start Index of the first candidate among the arms
+ *  @param refs References to sum over
+ *  @param useAbsolute Sums distances rather than changes of the loss
+ *  @param sum Sum of each arm, added to
+ *  @param sumSq Sum of squares of each arm, added to
+ */
+void ShardWorker::buildSums(
+  const arma::mat& candidates,
+  size_t start,
+  const ShardReferences& refs,
+  bool useAbsolute,
+  arma::vec& sum,
+  arma::vec& sumSq
+) {
+    arma::mat distances;
+    pairwise(candidates, refs.coordinates, distances);
+#pragma omp parallel for
+    for (size_t i = 0; i < candidates.n_cols; i++) {
+        double total = 0;
+        double total_sq = 0;
+        for (size_t j = 0; j < refs.best.n_elem; j++) {
+            const double cost = distances(i, j);
+            const double value = useAbsolute
+                                   ? cost
+                                   : std::min(cost, refs.best(j)) - refs.best(j);
+            total += value;
+            total_sq += value * value;
+        }
+        sum(start + i) += total;
+        sumSq(start + i) += total_sq;
+    }
+}
+
+/**
+ *  \brief Adds the swap losses of a tile of candidates over refs
+ *
+ *  As in KMedoids::swap_target, the change in loss on reference j splits
+ *  into a part s shared by every slot and a part d only for the slot j is
+ *  assigned to; the sums of squares of the arms of one candidate follow from
+ *  the sums of s^2 and of 2sd + d^2 per slot.
+ *
+ *  @param candidates Coordinates of the candidates, one per column
+ *  @param start Index of the first candidate among those of the arms
+ *  @param refs References to sum over
+ *  @param arms Swaps, each encoded as n * nMedoids + k
+ *  @param firstArm Index of the first arm of each candidate, then the number of arms
+ *  @param nMedoids Number of medoids
+ *  @param sum Sum of each arm, added to
+ *  @param sumSq Sum of squares of each arm, added to
+ */
+void ShardWorker::swapSums(
+  const arma::mat& candidates,
+  size_t start,
+  const ShardReferences& refs,
+  const std::vector<uint64_t>& arms,
+  const std::vector<size_t>& firstArm,
+  size_t nMedoids,
+  arma::vec& sum,
+  arma::vec& sumSq
+) {
+    arma::mat distances;
+    pairwise(candidates, refs.coordinates, distances);
+#pragma omp parallel
+    {
+        // shared sum and sum of squares, then both sums of each slot
+        std::vector<double> sums(2 * nMedoids + 2);
+#pragma omp for schedule(dynamic)
+        for (size_t c = 0; c < candidates.n_cols; c++) {
+            std::fill(sums.begin(), sums.end(), 0.0);
+            for (size_t j = 0; j < refs.best.n_elem; j++) {
+                const double cost = distances(c, j);
+                const double kept = std::min(cost, refs.best(j));
+                const double s = kept - refs.best(j);
+                const double d = std::min(cost, refs.second(j)) - kept;
+                const size_t slot = 2 + 2 * refs.assignment(j);
+                sums[0] += s;
+                sums[1] += s * s;
+                sums[slot] += d;
+                sums[slot + 1] += 2 * s * d + d * d;
+            }
+            for (size_t i = firstArm[start + c]; i < firstArm[start + c + 1]; i++) {
+                const size_t k = arms[i] % nMedoids;
+                sum(i) += sums[0] + sums[2 + 2 * k];
+                sumSq(i) += sums[1] + sums[3 + 2 * k];
+            }
+        }
+    }
+}
+
+/**
+ *  \brief Calls fn with the broadcast batch, or with each tile of the
+ *  sampled references of the shard
+ */
+template <typename Fn>
+void ShardWorker::forReferences(bool broadcast, const ShardReferences& batch, const arma::uvec& local, Fn fn) {
+    if (broadcast) {
+        fn(batch);
+        return;
+    }
+    for (size_t start = 0; start < local.n_elem; start += blockCols) {
+        fn(localReferences(local, start, std::min<size_t>(start + blockCols, local.n_elem)));
+    }
+}
+
+/**
+ *  \brief Computes the distance of every column of left to every column of
+ *  right
+ *
+ *  The distance policies index a single dataset, so both sides are copied
+ *  into one; callers keep them to a tile of datapoints.
+ */
+void ShardWorker::pairwise(const arma::mat& left, const arma::mat& right, arma::mat& out) {
+    if (left.n_cols == 0 || right.n_cols == 0) {
+        out.set_size(left.n_cols, right.n_cols);
+        return;
+    }
+    const arma::mat both = arma::join_rows(left, right);
+    const arma::uvec rows = arma::regspace<arma::uvec>(0, left.n_cols - 1);
+    const arma::uvec cols = arma::regspace<arma::uvec>(left.n_cols, both.n_cols - 1);
+    withLossFn(column_sq_norms(both), [&](const auto& lossFn) {
+        lossFn.block(both, rows, cols, out);
+    });
+}
+
+/**
+ *  \brief Returns the coordinates of a datapoint of the shard or the cache
+ */
+const double* ShardWorker::point(uint64_t index) const {
+    if (index >= offset && index < offset + nLocal) {
+        return data.colptr(index - offset);
+    }
+    const auto it = cached.find(index);
+    if (it == cached.end()) {
+        throw std::runtime_error("error: shard worker is missing the coordinates of datapoint " + std::to_string(index));
+    }
+    return candidates.colptr(it->second);
+}
+
+/**
+ *  \brief Copies the datapoints indices[start, end) into the columns of a
+ *  matrix
+ */
+arma::mat ShardWorker::gather(const std::vector<uint64_t>& indices, size_t start, size_t end) const {
+    arma::mat coordinates(data.n_rows, end - start);
+    for (size_t i = start; i < end; i++) {
+        const double* values = point(indices[i]);
+        std::copy(values, values + data.n_rows, coordinates.colptr(i - start));
+    }
+    return coordinates;
+}
+
+/**
+ *  \brief Copies the references local[start, end) of the shard with their
+ *  state
+ */
+ShardReferences ShardWorker::localReferences(const arma::uvec& local, size_t start, size_t end) const {
+    ShardReferences refs;
+    refs.coordinates.set_size(data.n_rows, end - start);
+    refs.best.set_size(end - start);
+    refs.second.set_size(end - start);
+    refs.assignment.set_size(end - start);
+    for (size_t i = start; i < end; i++) {
+        const arma::uword j = local(i);
+        std::copy(data.colptr(j), data.colptr(j) + data.n_rows, refs.coordinates.colptr(i - start));
+        refs.best(i - start) = bestDistances(j);
+        refs.second(i - start) = secondDistances(j);
+        refs.assignment(i - start) = assignments(j);
+    }
+    return refs;
+}
+
+/**
+ *  \brief Draws a batch of references of the shard; 0 means all of them
+ */
+arma::uvec ShardWorker::references(uint64_t batch) {
+    if (batch == 0 || batch >= nLocal) {
+        return nLocal > 0 ? arma::regspace<arma::uvec>(0, nLocal - 1) : arma::uvec();
+    }
+    return sampler.draw(nLocal, batch);
+}
+
+/**
+ *  \brief Calls fn with the distance policy of the session
+ *
+ *  @param sqNorms Squared norms of the columns of the block, for L2 and cosine
+ */
+template <typename Fn>
+void ShardWorker::withLossFn(const arma::rowvec& sqNorms, Fn fn) {
+    switch (lossType) {
+        case LossType::L1:
+            fn(L1Distance<double>());
+            break;
+        case LossType::L2:
+            fn(L2Distance<double>(sqNorms));
+            break;
+        case LossType::LP:
+            fn(LpDistance<double>(lp));
+            break;
+        case LossType::LINF:
+            fn(LinfDistance<double>());
+            break;
+        case LossType::COS:
+            fn(CosDistance<double>(sqNorms));
+            break;
+        case LossType::PRECOMPUTED:
+            throw std::invalid_argument("error: sharded fits do not support the precomputed loss");
+    }
+}
+
+/**
+ *  \brief Connects to the workers and starts a session with each
+ *
+ *  The shards are numbered in the order of addresses; the datapoints of
+ *  shard w follow those of shard w - 1.
+ *
+ *  @param addresses Address of each worker
+ *  @param lossType Distance of the session
+ *  @param lp Exponent when lossType is LossType::LP
+ *  @param seed Seed of the reference batches of every shard
+ */
+ShardCoordinator::ShardCoordinator(const std::vector<std::string>& addresses, LossType lossType, int lp, size_t seed) {
+    if (addresses.empty()) {
+        throw std::invalid_argument("error: sharded fits need at least one worker");
+    }
+    offsets.push_back(0);
+    for (size_t w = 0; w < addresses.size(); w++) {
+        workers.push_back(ShardConnection::connect(addresses[w]));
+        ShardMessage hello;
+        hello.put<uint32_t>(static_cast<uint32_t>(lossType));
+        hello.put<int32_t>(lp);
+        hello.put<uint64_t>(seed);
+        hello.put<uint64_t>(w);
+        hello.put<uint64_t>(offsets.back());
+        workers[w]->send(ShardOp::HELLO, hello);
+        ShardMessage reply;
+        expect(*workers[w], ShardOp::HELLO, reply);
+        const uint64_t n = reply.get<uint64_t>();
+        const uint64_t D = reply.get<uint64_t>();
+        if (n > 0 && dimension > 0 && D != dimension) {
+            throw std::invalid_argument("error: all shards must have the same number of columns");
+        }
+        if (n > 0) {
+            dimension = D;
+        }
+        offsets.push_back(offsets.back() + n);
+    }
+    known.assign(workers.size(), std::vector<bool>(size(), false));
+    for (size_t w = 0; w < workers.size(); w++) {
+        std::fill(known[w].begin() + offsets[w], known[w].begin() + offsets[w + 1], true);
+    }
+}
+
+/**
+ *  \brief Ends the session of every worker still connected
+ */
+ShardCoordinator::~ShardCoordinator() {
+    for (auto& worker : workers) {
+        try {
+            worker->send(ShardOp::BYE, ShardMessage());
+        } catch (const std::exception&) {
+            // the worker is gone already
+        }
+    }
+}
+
+/**
+ *  \brief Returns the number of datapoints over all shards
+ */
+arma::uword ShardCoordinator::size() const {
+    return offsets.back();
+}
+
+/**
+ *  \brief Sums the build losses of arms over a batch of references
+ *
+ *  @param arms Candidate datapoints
+ *  @param batch Number of references, or 0 for every datapoint
+ *  @param useAbsolute Sums distances rather than changes of the loss
+ */
+ArmSums ShardCoordinator::buildEstimate(const arma::uvec& arms, size_t batch, bool useAbsolute) {
+    ShardMessage parameters;
+    parameters.put<uint8_t>(useAbsolute);
+    return estimate(ShardOp::BUILD_ESTIMATE, arms, 1, batch, parameters);
+}
+
+/**
+ *  \brief Sums the swap losses of arms over a batch of references
+ *
+ *  @param arms Swaps, each encoded as n * nMedoids + k
+ *  @param nMedoids Number of medoids
+ *  @param batch Number of references, or 0 for every datapoint
+ */
+ArmSums ShardCoordinator::swapEstimate(const arma::uvec& arms, size_t nMedoids, size_t batch) {
+    ShardMessage parameters;
+    parameters.put<uint64_t>(nMedoids);
+    return estimate(ShardOp::SWAP_ESTIMATE, arms, nMedoids, batch, parameters);
+}
+
+/**
+ *  \brief Sums the losses of arms over a batch of references
+ *
+ *  While there are more candidates than references, as in the sigma
+ *  estimates and the first rounds of a race, the workers sample a batch that
+ *  is broadcast to the owner of every candidate, and each worker estimates
+ *  the arms of its own datapoints. Once the arms are pruned to at most one
+ *  batch of candidates, or to evaluate them exactly, the candidates are
+ *  forwarded to every worker instead and each sums over its own references.
+ *  Either way the batch is split over the shards in proportion to their
+ *  sizes.
+ *
+ *  @param op ShardOp::BUILD_ESTIMATE or ShardOp::SWAP_ESTIMATE
+ *  @param arms Arms to estimate
+ *  @param armsPerCandidate Arms of each candidate datapoint, numbered n * armsPerCandidate + k
+ *  @param batch Number of references, or 0 for every datapoint
+ *  @param parameters Rest of the request, specific to op
+ */
+ArmSums ShardCoordinator::estimate(ShardOp op, const arma::uvec& arms, size_t armsPerCandidate, size_t batch, const ShardMessage& parameters) {
+    const arma::uvec candidates = arma::unique(arms / armsPerCandidate);
+    ArmSums total;
+    if (batch == 0 || candidates.n_elem <= batch) {
+        shareCoordinates(candidates);
+        const std::vector<uint64_t> ids(arms.begin(), arms.end());
+        for (size_t w = 0; w < workers.size(); w++) {
+            ShardMessage request;
+            request.putArray(ids.data(), ids.size());
+            request.put<uint64_t>(share(batch, w));
+            request.bytes.insert(request.bytes.end(), parameters.bytes.begin(), parameters.bytes.end());
+            request.put<uint8_t>(false);
+            workers[w]->send(op, request);
+        }
+        // the workers compute concurrently; replies are collected in order
+        for (size_t w = 0; w < workers.size(); w++) {
+            ShardMessage reply;
+            expect(*workers[w], op, reply);
+            ArmSums sums;
+            sums.count = reply.get<double>();
+            sums.sum = arma::vec(reply.getArray<double>());
+            sums.sumSq = arma::vec(reply.getArray<double>());
+            total.add(sums);
+        }
+        return total;
+    }
+    const ShardMessage refs = sampleReferences(batch, total.count);
+    std::vector<std::vector<uint64_t>> owned(workers.size());
+    std::vector<std::vector<arma::uword>> positions(workers.size());
+    for (arma::uword i = 0; i < arms.n_elem; i++) {
+        const size_t w = owner(arms(i) / armsPerCandidate);
+        owned[w].push_back(arms(i));
+        positions[w].push_back(i);
+    }
+    for (size_t w = 0; w < workers.size(); w++) {
+        if (owned[w].empty()) {
+            continue;
+        }
+        ShardMessage request;
+        request.putArray(owned[w].data(), owned[w].size());
+        request.put<uint64_t>(0);
+        request.bytes.insert(request.bytes.end(), parameters.bytes.begin(), parameters.bytes.end());
+        request.put<uint8_t>(true);
+        request.bytes.insert(request.bytes.end(), refs.bytes.begin(), refs.bytes.end());
+        workers[w]->send(op, request);
+    }
+    total.sum.zeros(arms.n_elem);
+    total.sumSq.zeros(arms.n_elem);
+    for (size_t w = 0; w < workers.size(); w++) {
+        if (owned[w].empty()) {
+            continue;
+        }
+        ShardMessage reply;
+        expect(*workers[w], op, reply);
+        reply.get<double>();
+        const std::vector<double> sum = reply.getArray<double>();
+        const std::vector<double> sum_sq = reply.getArray<double>();
+        for (size_t i = 0; i < positions[w].size(); i++) {
+            total.sum(positions[w][i]) = sum[i];
+            total.sumSq(positions[w][i]) = sum_sq[i];
+        }
+    }
+    return total;
+}
+
+/**
+ *  \brief Collects a batch of references from the shards for a broadcast
+ *
+ *  @param batch Number of references
+ *  @param count Set to the number of references drawn
+ *  @return The batch, written as by ShardReferences::write
+ */
+ShardMessage ShardCoordinator::sampleReferences(size_t batch, double& count) {
+    for (size_t w = 0; w < workers.size(); w++) {
+        ShardMessage request;
+        request.put<uint64_t>(share(batch, w));
+        workers[w]->send(ShardOp::REFERENCES, request);
+    }
+    std::vector<double> coordinates;
+    std::vector<double> best;
+    std::vector<double> second;
+    std::vector<uint64_t> assignment;
+    for (size_t w = 0; w < workers.size(); w++) {
+        ShardMessage reply;
+        expect(*workers[w], ShardOp::REFERENCES, reply);
+        const std::vector<double> shard_coordinates = reply.getArray<double>();
+        const std::vector<double> shard_best = reply.getArray<double>();
+        const std::vector<double> shard_second = reply.getArray<double>();
+        const std::vector<uint64_t> shard_assignment = reply.getArray<uint64_t>();
+        coordinates.insert(coordinates.end(), shard_coordinates.begin(), shard_coordinates.end());
+        best.insert(best.end(), shard_best.begin(), shard_best.end());
+        second.insert(second.end(), shard_second.begin(), shard_second.end());
+        assignment.insert(assignment.end(), shard_assignment.begin(), shard_assignment.end());
+    }
+    count = best.size();
+    ShardMessage refs;
+    refs.putArray(coordinates.data(), coordinates.size());
+    refs.putArray(best.data(), best.size());
+    refs.putArray(second.data(), second.size());
+    refs.putArray(assignment.data(), assignment.size());
+    return refs;
+}
+
+/**
+ *  \brief Adds a build medoid and returns the mean loss
+ */
+double ShardCoordinator::addMedoid(arma::uword index) {
+    shareCoordinates(arma::uvec({index}));
+    for (auto& worker : workers) {
+        ShardMessage request;
+        request.put<uint64_t>(index);
+        worker->send(ShardOp::ADD_MEDOID, request);
+    }
+    double total = 0;
+    for (auto& worker : workers) {
+        ShardMessage reply;
+        expect(*worker, ShardOp::ADD_MEDOID, reply);
+        total += reply.get<double>();
+    }
+    return total / size();
+}
+
+/**
+ *  \brief Reassigns every datapoint to medoidIndices and returns the mean loss
+ */
+double ShardCoordinator::setMedoids(const arma::rowvec& medoidIndices) {
+    const arma::uvec medoids = arma::conv_to<arma::uvec>::from(medoidIndices);
+    shareCoordinates(medoids);
+    const std::vector<uint64_t> ids(medoids.begin(), medoids.end());
+    for (auto& worker : workers) {
+        ShardMessage request;
+        request.putArray(ids.data(), ids.size());
+        worker->send(ShardOp::SET_MEDOIDS, request);
+    }
+    double total = 0;
+    for (auto& worker : workers) {
+        ShardMessage reply;
+        expect(*worker, ShardOp::SET_MEDOIDS, reply);
+        total += reply.get<double>();
+    }
+    return total / size();
+}
+
+/**
+ *  \brief Returns the medoid slot of every datapoint
+ */
+arma::rowvec ShardCoordinator::labels() {
+    for (auto& worker : workers) {
+        worker->send(ShardOp::LABELS, ShardMessage());
+    }
+    arma::rowvec labels(size());
+    for (size_t w = 0; w < workers.size(); w++) {
+        ShardMessage reply;
+        expect(*workers[w], ShardOp::LABELS, reply);
+        const std::vector<uint64_t> shard = reply.getArray<uint64_t>();
+        for (size_t i = 0; i < shard.size(); i++) {
+            labels(offsets[w] + i) = shard[i];
+        }
+    }
+    return labels;
+}
+
+/**
+ *  \brief Sends every worker the candidates it does not hold yet
+ *
+ *  The coordinates are fetched from the shards owning them, one owner at a
+ *  time, and forwarded before the next is asked, so the coordinator holds
+ *  those of one owner only; each datapoint is sent to each worker at most
+ *  once per session.
+ */
+void ShardCoordinator::shareCoordinates(const arma::uvec& candidates) {
+    const size_t W = workers.size();
+    std::vector<std::vector<uint64_t>> owned(W);
+    for (arma::uword c : candidates) {
+        for (size_t w = 0; w < W; w++) {
+            if (!known[w][c]) {
+                owned[owner(c)].push_back(c);
+                break;
+            }
+        }
+    }
+    for (size_t o = 0; o < W; o++) {
+        if (owned[o].empty()) {
+            continue;
+        }
+        // one owner at a time: a worker blocked on a large reply of its own
+        // would not read the coordinates forwarded to it
+        ShardMessage request;
+        request.putArray(owned[o].data(), owned[o].size());
+        workers[o]->send(ShardOp::POINTS, request);
+        ShardMessage reply;
+        expect(*workers[o], ShardOp::POINTS, reply);
+        const std::vector<double> coordinates = reply.getArray<double>();
+        for (size_t w = 0; w < W; w++) {
+            std::vector<uint64_t> missing;
+            std::vector<double> values;
+            for (size_t i = 0; i < owned[o].size(); i++) {
+                const uint64_t c = owned[o][i];
+                if (!known[w][c]) {
+                    missing.push_back(c);
+                    values.insert(values.end(), coordinates.begin() + i * dimension,
+                                  coordinates.begin() + (i + 1) * dimension);
+                    known[w][c] = true;
+                }
+            }
+            if (!missing.empty()) {
+                ShardMessage request;
+                request.putArray(missing.data(), missing.size());
+                request.putArray(values.data(), values.size());
+                workers[w]->send(ShardOp::COORDINATES, request);
+            }
+        }
+    }
+}
+
+/**
+ *  \brief Returns the share of a batch of references drawn from shard w
+ *
+ *  @param batch Number of references, or 0 for every datapoint
+ *  @param w Index of the shard
+ */
+size_t ShardCoordinator::share(size_t batch, size_t w) const {
+    if (batch == 0) {
+        return 0;
+    }
+    return std::max<size_t>(1, (batch * (offsets[w + 1] - offsets[w]) + size() / 2) / size());
+}
+
+/**
+ *  \brief Returns the shard holding a datapoint
+ */
+size_t ShardCoordinator::owner(arma::uword index) const {
+    return std::upper_bound(offsets.begin(), offsets.end(), index) - offsets.begin() - 1;
+}
@@ -0,0 +1,612 @@
+/**
+ * @file simd_kernels.cpp
+ * @date 2021-03-02
+ *
+ * Hand-vectorized distance kernels for the BanditPAM distance policies, and
+ * the runtime selection of the widest instruction set the host supports.
+ *
+ */
+#include "simd_kernels.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BANDITPAM_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+namespace simd {
+namespace {
+
+// Scalar kernels, used on non-x86 hosts and for the tails of vector loops
+
+template <typename eT>
+double l1_scalar(const eT* a, const eT* b, size_t n) {
+    double total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += std::abs(double(a[i]) - double(b[i]));
+    }
+    return total;
+}
+
+template <typename eT>
+double sqeuclidean_scalar(const eT* a, const eT* b, size_t n) {
+    double total = 0;
+    for (size_t i = 0; i < n; i++) {
+        const double diff = double(a[i]) - double(b[i]);
+        total += diff * diff;
+    }
+    return total;
+}
+
+template <typename eT>
+double linf_scalar(const eT* a, const eT* b, size_t n) {
+    double largest = 0;
+    for (size_t i = 0; i < n; i++) {
+        const double diff = std::abs(double(a[i]) - double(b[i]));
+        if (diff > largest) {
+            largest = diff;
+        }
+    }
+    return largest;
+}
+
+template <typename eT>
+void cos_terms_scalar(const eT* a, const eT* b, size_t n,
+                      double& dot, double& norm_a, double& norm_b) {
+    for (size_t i = 0; i < n; i++) {
+        dot += double(a[i]) * b[i];
+        norm_a += double(a[i]) * a[i];
+        norm_b += double(b[i]) * b[i];
+    }
+}
+
+template <typename eT>
+double cos_scalar(const eT* a, const eT* b, size_t n) {
+    double dot = 0, norm_a = 0, norm_b = 0;
+    cos_terms_scalar(a, b, n, dot, norm_a, norm_b);
+    return dot / (std::sqrt(norm_a) * std::sqrt(norm_b));
+}
+
+#ifdef BANDITPAM_X86_DISPATCH
+
+// SSE2 kernels (2 doubles per register, baseline on every x86-64 host)
+
+__attribute__((target("sse2")))
+inline double hsum_sse2(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+__attribute__((target("sse2")))
+inline double hmax_sse2(__m128d v) {
+    return _mm_cvtsd_f64(_mm_max_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+__attribute__((target("sse2")))
+double l1_sse2(const double* a, const double* b, size_t n) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+        acc0 = _mm_add_pd(acc0, _mm_andnot_pd(sign, d0));
+        acc1 = _mm_add_pd(acc1, _mm_andnot_pd(sign, d1));
+    }
+    return hsum_sse2(_mm_add_pd(acc0, acc1)) + l1_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+double sqeuclidean_sse2(const double* a, const double* b, size_t n) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(d1, d1));
+    }
+    return hsum_sse2(_mm_add_pd(acc0, acc1)) + sqeuclidean_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+double linf_sse2(const double* a, const double* b, size_t n) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d acc = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d d = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        acc = _mm_max_pd(acc, _mm_andnot_pd(sign, d));
+    }
+    double largest = hmax_sse2(acc);
+    double tail = linf_scalar(a + i, b + i, n - i);
+    return tail > largest ? tail : largest;
+}
+
+__attribute__((target("sse2")))
+double cos_sse2(const double* a, const double* b, size_t n) {
+    __m128d dot = _mm_setzero_pd(), na = _mm_setzero_pd(), nb = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d va = _mm_loadu_pd(a + i);
+        __m128d vb = _mm_loadu_pd(b + i);
+        dot = _mm_add_pd(dot, _mm_mul_pd(va, vb));
+        na = _mm_add_pd(na, _mm_mul_pd(va, va));
+        nb = _mm_add_pd(nb, _mm_mul_pd(vb, vb));
+    }
+    double d = hsum_sse2(dot), norm_a = hsum_sse2(na), norm_b = hsum_sse2(nb);
+    cos_terms_scalar(a + i, b + i, n - i, d, norm_a, norm_b);
+    return d / (std::sqrt(norm_a) * std::sqrt(norm_b));
+}
+
+// AVX2 kernels (4 doubles per register, fused multiply-add)
+
+__attribute__((target("avx2,fma")))
+inline double hsum_avx2(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2,fma")))
+inline double hmax_avx2(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_max_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_max_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2,fma")))
+double l1_avx2(const double* a, const double* b, size_t n) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4));
+        acc0 = _mm256_add_pd(acc0, _mm256_andnot_pd(sign, d0));
+        acc1 = _mm256_add_pd(acc1, _mm256_andnot_pd(sign, d1));
+    }
+    for (; i + 4 <= n; i += 4) {
+        __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        acc0 = _mm256_add_pd(acc0, _mm256_andnot_pd(sign, d0));
+    }
+    return hsum_avx2(_mm256_add_pd(acc0, acc1)) + l1_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+double sqeuclidean_avx2(const double* a, const double* b, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4));
+        acc0 = _mm256_fmadd_pd(d0, d0, acc0);
+        acc1 = _mm256_fmadd_pd(d1, d1, acc1);
+    }
+    for (; i + 4 <= n; i += 4) {
+        __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        acc0 = _mm256_fmadd_pd(d0, d0, acc0);
+    }
+    return hsum_avx2(_mm256_add_pd(acc0, acc1)) + sqeuclidean_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+double linf_avx2(const double* a, const double* b, size_t n) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d d = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        acc = _mm256_max_pd(acc, _mm256_andnot_pd(sign, d));
+    }
+    double largest = hmax_avx2(acc);
+    double tail = linf_scalar(a + i, b + i, n - i);
+    return tail > largest ? tail : largest;
+}
+
+__attribute__((target("avx2,fma")))
+double cos_avx2(const double* a, const double* b, size_t n) {
+    __m256d dot = _mm256_setzero_pd(), na = _mm256_setzero_pd(), nb = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d va = _mm256_loadu_pd(a + i);
+        __m256d vb = _mm256_loadu_pd(b + i);
+        dot = _mm256_fmadd_pd(va, vb, dot);
+        na = _mm256_fmadd_pd(va, va, na);
+        nb = _mm256_fmadd_pd(vb, vb, nb);
+    }
+    double d = hsum_avx2(dot), norm_a = hsum_avx2(na), norm_b = hsum_avx2(nb);
+    cos_terms_scalar(a + i, b + i, n - i, d, norm_a, norm_b);
+    return d / (std::sqrt(norm_a) * std::sqrt(norm_b));
+}
+
+// AVX-512 kernels (8 doubles per register, masked tails)
+
+__attribute__((target("avx512f")))
+double l1_avx512(const double* a, const double* b, size_t n) {
+    __m512d acc = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d d = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+        acc = _mm512_add_pd(acc, _mm512_abs_pd(d));
+    }
+    if (i < n) {
+        const __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(tail, a + i),
+                                  _mm512_maskz_loadu_pd(tail, b + i));
+        acc = _mm512_add_pd(acc, _mm512_abs_pd(d));
+    }
+    return _mm512_reduce_add_pd(acc);
+}
+
+__attribute__((target("avx512f")))
+double sqeuclidean_avx512(const double* a, const double* b, size_t n) {
+    __m512d acc = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d d = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+        acc = _mm512_fmadd_pd(d, d, acc);
+    }
+    if (i < n) {
+        const __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(tail, a + i),
+                                  _mm512_maskz_loadu_pd(tail, b + i));
+        acc = _mm512_fmadd_pd(d, d, acc);
+    }
+    return _mm512_reduce_add_pd(acc);
+}
+
+__attribute__((target("avx512f")))
+double linf_avx512(const double* a, const double* b, size_t n) {
+    __m512d acc = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d d = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+        acc = _mm512_max_pd(acc, _mm512_abs_pd(d));
+    }
+    if (i < n) {
+        const __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(tail, a + i),
+                                  _mm512_maskz_loadu_pd(tail, b + i));
+        acc = _mm512_max_pd(acc, _mm512_abs_pd(d));
+    }
+    return _mm512_reduce_max_pd(acc);
+}
+
+__attribute__((target("avx512f")))
+double cos_avx512(const double* a, const double* b, size_t n) {
+    __m512d dot = _mm512_setzero_pd(), na = _mm512_setzero_pd(), nb = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d va = _mm512_loadu_pd(a + i);
+        __m512d vb = _mm512_loadu_pd(b + i);
+        dot = _mm512_fmadd_pd(va, vb, dot);
+        na = _mm512_fmadd_pd(va, va, na);
+        nb = _mm512_fmadd_pd(vb, vb, nb);
+    }
+    if (i < n) {
+        const __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        __m512d va = _mm512_maskz_loadu_pd(tail, a + i);
+        __m512d vb = _mm512_maskz_loadu_pd(tail, b + i);
+        dot = _mm512_fmadd_pd(va, vb, dot);
+        na = _mm512_fmadd_pd(va, va, na);
+        nb = _mm512_fmadd_pd(vb, vb, nb);
+    }
+    return _mm512_reduce_add_pd(dot) /
+           (std::sqrt(_mm512_reduce_add_pd(na)) * std::sqrt(_mm512_reduce_add_pd(nb)));
+}
+
+// Single precision kernels. Lanes accumulate in float, which doubles the
+// number of coordinates per instruction; the horizontal reductions, tails and
+// final divisions are carried out in double.
+
+__attribute__((target("sse2")))
+inline double hsum_sse2(__m128 v) {
+    __m128 shuf = _mm_movehl_ps(v, v);
+    __m128 sums = _mm_add_ps(v, shuf);
+    sums = _mm_add_ss(sums, _mm_shuffle_ps(sums, sums, 1));
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("sse2")))
+inline double hmax_sse2(__m128 v) {
+    __m128 shuf = _mm_movehl_ps(v, v);
+    __m128 maxs = _mm_max_ps(v, shuf);
+    maxs = _mm_max_ss(maxs, _mm_shuffle_ps(maxs, maxs, 1));
+    return _mm_cvtss_f32(maxs);
+}
+
+__attribute__((target("sse2")))
+double l1_sse2(const float* a, const float* b, size_t n) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_andnot_ps(sign, d0));
+        acc1 = _mm_add_ps(acc1, _mm_andnot_ps(sign, d1));
+    }
+    return hsum_sse2(_mm_add_ps(acc0, acc1)) + l1_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+double sqeuclidean_sse2(const float* a, const float* b, size_t n) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    return hsum_sse2(_mm_add_ps(acc0, acc1)) + sqeuclidean_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+double linf_sse2(const float* a, const float* b, size_t n) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 acc = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc = _mm_max_ps(acc, _mm_andnot_ps(sign, d));
+    }
+    double largest = hmax_sse2(acc);
+    double tail = linf_scalar(a + i, b + i, n - i);
+    return tail > largest ? tail : largest;
+}
+
+__attribute__((target("sse2")))
+double cos_sse2(const float* a, const float* b, size_t n) {
+    __m128 dot = _mm_setzero_ps(), na = _mm_setzero_ps(), nb = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 va = _mm_loadu_ps(a + i);
+        __m128 vb = _mm_loadu_ps(b + i);
+        dot = _mm_add_ps(dot, _mm_mul_ps(va, vb));
+        na = _mm_add_ps(na, _mm_mul_ps(va, va));
+        nb = _mm_add_ps(nb, _mm_mul_ps(vb, vb));
+    }
+    double d = hsum_sse2(dot), norm_a = hsum_sse2(na), norm_b = hsum_sse2(nb);
+    cos_terms_scalar(a + i, b + i, n - i, d, norm_a, norm_b);
+    return d / (std::sqrt(norm_a) * std::sqrt(norm_b));
+}
+
+__attribute__((target("avx2,fma")))
+inline double hsum_avx2(__m256 v) {
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuf = _mm_movehl_ps(lo, lo);
+    lo = _mm_add_ps(lo, shuf);
+    lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+    return _mm_cvtss_f32(lo);
+}
+
+__attribute__((target("avx2,fma")))
+inline double hmax_avx2(__m256 v) {
+    __m128 lo = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuf = _mm_movehl_ps(lo, lo);
+    lo = _mm_max_ps(lo, shuf);
+    lo = _mm_max_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+    return _mm_cvtss_f32(lo);
+}
+
+__attribute__((target("avx2,fma")))
+double l1_avx2(const float* a, const float* b, size_t n) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_add_ps(acc0, _mm256_andnot_ps(sign, d0));
+        acc1 = _mm256_add_ps(acc1, _mm256_andnot_ps(sign, d1));
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_add_ps(acc0, _mm256_andnot_ps(sign, d0));
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + l1_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+double sqeuclidean_avx2(const float* a, const float* b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + sqeuclidean_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+double linf_avx2(const float* a, const float* b, size_t n) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc = _mm256_max_ps(acc, _mm256_andnot_ps(sign, d));
+    }
+    double largest = hmax_avx2(acc);
+    double tail = linf_scalar(a + i, b + i, n - i);
+    return tail > largest ? tail : largest;
+}
+
+__attribute__((target("avx2,fma")))
+double cos_avx2(const float* a, const float* b, size_t n) {
+    __m256 dot = _mm256_setzero_ps(), na = _mm256_setzero_ps(), nb = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i);
+        __m256 vb = _mm256_loadu_ps(b + i);
+        dot = _mm256_fmadd_ps(va, vb, dot);
+        na = _mm256_fmadd_ps(va, va, na);
+        nb = _mm256_fmadd_ps(vb, vb, nb);
+    }
+    double d = hsum_avx2(dot), norm_a = hsum_avx2(na), norm_b = hsum_avx2(nb);
+    cos_terms_scalar(a + i, b + i, n - i, d, norm_a, norm_b);
+    return d / (std::sqrt(norm_a) * std::sqrt(norm_b));
+}
+
+__attribute__((target("avx512f")))
+double l1_avx512(const float* a, const float* b, size_t n) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc = _mm512_add_ps(acc, _mm512_abs_ps(d));
+    }
+    if (i < n) {
+        const __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, a + i),
+                                 _mm512_maskz_loadu_ps(tail, b + i));
+        acc = _mm512_add_ps(acc, _mm512_abs_ps(d));
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+__attribute__((target("avx512f")))
+double sqeuclidean_avx512(const float* a, const float* b, size_t n) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    if (i < n) {
+        const __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, a + i),
+                                 _mm512_maskz_loadu_ps(tail, b + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+__attribute__((target("avx512f")))
+double linf_avx512(const float* a, const float* b, size_t n) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc = _mm512_max_ps(acc, _mm512_abs_ps(d));
+    }
+    if (i < n) {
+        const __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, a + i),
+                                 _mm512_maskz_loadu_ps(tail, b + i));
+        acc = _mm512_max_ps(acc, _mm512_abs_ps(d));
+    }
+    return _mm512_reduce_max_ps(acc);
+}
+
+__attribute__((target("avx512f")))
+double cos_avx512(const float* a, const float* b, size_t n) {
+    __m512 dot = _mm512_setzero_ps(), na = _mm512_setzero_ps(), nb = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 va = _mm512_loadu_ps(a + i);
+        __m512 vb = _mm512_loadu_ps(b + i);
+        dot = _mm512_fmadd_ps(va, vb, dot);
+        na = _mm512_fmadd_ps(va, va, na);
+        nb = _mm512_fmadd_ps(vb, vb, nb);
+    }
+    if (i < n) {
+        const __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+        __m512 va = _mm512_maskz_loadu_ps(tail, a + i);
+        __m512 vb = _mm512_maskz_loadu_ps(tail, b + i);
+        dot = _mm512_fmadd_ps(va, vb, dot);
+        na = _mm512_fmadd_ps(va, va, na);
+        nb = _mm512_fmadd_ps(vb, vb, nb);
+    }
+    return double(_mm512_reduce_add_ps(dot)) /
+           (std::sqrt(double(_mm512_reduce_add_ps(na))) * std::sqrt(double(_mm512_reduce_add_ps(nb))));
+}
+
+#endif // BANDITPAM_X86_DISPATCH
+
+/**
+ *  \brief Picks the widest instruction set supported by the host.
+ *
+ *  Queries the CPU and returns 0 (scalar), 1 (SSE2), 2 (AVX2) or 3 (AVX-512),
+ *  honoring the BANDITPAM_SIMD cap when it is set.
+ */
+int select_level() {
+#ifdef BANDITPAM_X86_DISPATCH
+    const char* cap = std::getenv("BANDITPAM_SIMD");
+    int max_level = 3;
+    if (cap != nullptr) {
+        if (std::strcmp(cap, "scalar") == 0) {
+            max_level = 0;
+        } else if (std::strcmp(cap, "sse2") == 0) {
+            max_level = 1;
+        } else if (std::strcmp(cap, "avx2") == 0) {
+            max_level = 2;
+        }
+    }
+
+    __builtin_cpu_init();
+    if (max_level >= 3 && __builtin_cpu_supports("avx512f")) {
+        return 3;
+    }
+    if (max_level >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return 2;
+    }
+    if (max_level >= 1 && __builtin_cpu_supports("sse2")) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/**
+ *  \brief Builds the kernel table of element type eT for an instruction set.
+ *
+ *  @param level Instruction set, as returned by select_level
+ */
+template <typename eT>
+DistanceKernels<eT> make_kernels(int level) {
+#ifdef BANDITPAM_X86_DISPATCH
+    if (level == 3) {
+        return {l1_avx512, sqeuclidean_avx512, linf_avx512, cos_avx512, "avx512"};
+    } else if (level == 2) {
+        return {l1_avx2, sqeuclidean_avx2, linf_avx2, cos_avx2, "avx2"};
+    } else if (level == 1) {
+        return {l1_sse2, sqeuclidean_sse2, linf_sse2, cos_sse2, "sse2"};
+    }
+#endif
+    return {l1_scalar<eT>, sqeuclidean_scalar<eT>, linf_scalar<eT>, cos_scalar<eT>, "scalar"};
+}
+
+} // namespace
+
+template <>
+const DistanceKernels<double>& kernels<double>() {
+    static const DistanceKernels<double> active = make_kernels<double>(select_level());
+    return active;
+}
+
+template <>
+const DistanceKernels<float>& kernels<float>() {
+    static const DistanceKernels<float> active = make_kernels<float>(select_level());
+    return active;
+}
+
+namespace {
+// forces the selection while the library is loaded rather than inside a fit
+const DistanceKernels<double>& loaded_kernels = kernels<double>();
+const DistanceKernels<float>& loaded_fkernels = kernels<float>();
+} // namespace
+
+} // namespace simd
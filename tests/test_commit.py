@@ -1,7 +1,13 @@
 import unittest
-from BanditPAM import KMedoids
+from BanditPAM import KMedoids, get_max_threads, set_num_threads, serve_shard
 import pandas as pd
 import numpy as np
+import scipy.sparse
+import tempfile
+import os
+import multiprocessing
+import threading
+import asyncio
 
 def onFly(k, data, loss):
     kmed_bpam = KMedoids(
@@ -21,6 +27,34 @@ def onFly(k, data, loss):
     else:
         return 0
 
+def gaussianMixture(n, means = ((0, 0), (-5, 5), (5, 5)), seed = 0):
+    '''
+    Draws n datapoints around each of the means of a Gaussian Mixture Model
+    '''
+    np.random.seed(seed)
+    return np.vstack([np.random.randn(n, 2) + mu for mu in np.array(means)])
+
+def medoidDistances(X, medoids):
+    '''
+    L2 distance of every datapoint of X to each of the medoids, given as
+    indices of X
+    '''
+    X = np.asarray(X, dtype = np.float64)
+    medoids = np.asarray(medoids).astype(int)
+    return np.sqrt(((X[:, None, :] - X[None, medoids, :]) ** 2).sum(axis = 2))
+
+def totalLoss(X, medoids):
+    '''
+    Total L2 distance of the datapoints of X to their closest medoid
+    '''
+    return medoidDistances(X, medoids).min(axis = 1).sum()
+
+def serve(shard, address):
+    '''
+    Serves a shard to one sharded fit; runs in a worker process
+    '''
+    serve_shard(shard, address)
+
 class PythonTests(unittest.TestCase):
     small_mnist = pd.read_csv('./data/MNIST.csv', header=None).to_numpy()
 
@@ -106,6 +140,391 @@ class PythonTests(unittest.TestCase):
         self.assertEqual(kmed_10.build_medoids.tolist(), np.array([377, 267, 276, 762, 394, 311, 663, 802, 422, 20]).tolist())
         self.assertEqual(kmed_10.medoids.tolist(), np.array([377, 267, 276, 762, 394, 311, 663, 802, 422, 20]).tolist())
 
+    def test_float32_input(self):
+        '''
+        Test that float32 data is clustered in single precision to the same
+        medoids as the float64 data on a Gaussian Mixture Model, and to as
+        good medoids on mnist
+        '''
+        X = gaussianMixture(40)
+
+        kmed_64 = KMedoids(n_medoids = 3, algorithm = "BanditPAM")
+        kmed_64.fit(X, "L2", "KMedoidsLogfile")
+        kmed_32 = KMedoids(n_medoids = 3, algorithm = "BanditPAM")
+        kmed_32.fit(X.astype(np.float32), "L2", "KMedoidsLogfile")
+
+        self.assertEqual(kmed_32.medoids.tolist(), kmed_64.medoids.tolist())
+
+        kmed_64 = KMedoids(n_medoids = 5, algorithm = "BanditPAM")
+        kmed_64.fit(self.small_mnist.astype(np.float64), "L2", "KMedoidsLogfile")
+        kmed_32 = KMedoids(n_medoids = 5, algorithm = "BanditPAM")
+        kmed_32.fit(self.small_mnist.astype(np.float32), "L2", "KMedoidsLogfile")
+
+        self.assertLessEqual(totalLoss(self.small_mnist, kmed_32.medoids),
+                             1.01 * totalLoss(self.small_mnist, kmed_64.medoids))
+
+    def test_sparse_input(self):
+        '''
+        Test that a scipy.sparse matrix is clustered to the same medoids as
+        its dense counterpart, on sparsified Gaussian Mixture data and on
+        scrna
+        '''
+        X = np.hstack([gaussianMixture(40), np.zeros((120, 30))])
+        X[np.random.rand(*X.shape) < 0.3] = 0
+        scrna = self.scrna.head(1000).to_numpy()
+
+        for data, k in [(X, 3), (scrna, 5)]:
+            kmed_dense = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed_dense.fit(data, "L1", "KMedoidsLogfile")
+            kmed_sparse = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed_sparse.fit(scipy.sparse.csr_matrix(data), "L1", "KMedoidsLogfile")
+
+            self.assertEqual(kmed_sparse.medoids.tolist(), kmed_dense.medoids.tolist())
+
+    def test_precomputed_input(self):
+        '''
+        Test that a precomputed L2 distance matrix gives the same medoids as
+        the data itself, for both BanditPAM and the naive algorithm
+        '''
+        for X, k in [(gaussianMixture(40), 3), (self.small_mnist, 5)]:
+            D = medoidDistances(X, np.arange(len(X)))
+            for algorithm in ["BanditPAM", "naive"]:
+                kmed_data = KMedoids(n_medoids = k, algorithm = algorithm)
+                kmed_data.fit(X, "L2", "KMedoidsLogfile")
+                kmed_dists = KMedoids(n_medoids = k, algorithm = algorithm)
+                kmed_dists.fit(D, "precomputed", "KMedoidsLogfile")
+
+                self.assertEqual(kmed_dists.medoids.tolist(), kmed_data.medoids.tolist())
+
+    def test_distance_cache(self):
+        '''
+        Test that caching distances leaves the medoids unchanged and that the
+        cache serves repeated distances
+        '''
+        X = gaussianMixture(40)
+
+        kmed = KMedoids(n_medoids = 3, algorithm = "BanditPAM")
+        kmed.fit(X, "L1", "KMedoidsLogfile")
+        kmed_cached = KMedoids(n_medoids = 3, algorithm = "BanditPAM")
+        kmed_cached.cache_bytes = 1 << 20
+        kmed_cached.fit(X, "L1", "KMedoidsLogfile")
+
+        self.assertEqual(kmed_cached.medoids.tolist(), kmed.medoids.tolist())
+        self.assertGreater(kmed_cached.cache_hits, 0)
+        self.assertEqual(kmed.cache_hits + kmed.cache_misses, 0)
+
+        # the known scrna medoids of test_small_cases_scrna
+        kmed_cached = KMedoids(n_medoids = 5, algorithm = "BanditPAM")
+        kmed_cached.cache_bytes = 1 << 20
+        kmed_cached.fit(self.scrna.head(1000).to_numpy(), "L1", "KMedoidsLogfile")
+        self.assertEqual(kmed_cached.medoids.tolist(), [377, 267, 276, 762, 394])
+
+    def test_eager_swap(self):
+        '''
+        Test that eager swaps reach a loss comparable to BanditPAM's on a
+        Gaussian Mixture Model and on mnist
+        '''
+        X = gaussianMixture(50, means = [[0, 0], [-5, 5], [5, 5], [0, 10]])
+
+        for data, k in [(X, 4), (self.small_mnist, 5)]:
+            kmed_bpam = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed_bpam.fit(data, "L2", "KMedoidsLogfile")
+            kmed_eager = KMedoids(n_medoids = k, algorithm = "FasterPAM")
+            kmed_eager.fit(data, "L2", "KMedoidsLogfile")
+
+            self.assertLessEqual(totalLoss(data, kmed_eager.medoids),
+                                 1.01 * totalLoss(data, kmed_bpam.medoids))
+
+    def test_adaptive_batch(self):
+        '''
+        Test that adaptive batches reach a loss comparable to fixed batches
+        and that distance calls are reported per step
+        '''
+        mnist = self.mnist_70k.sample(n = 1000, random_state = 0).to_numpy()
+
+        for data, k in [(gaussianMixture(100), 3), (mnist, 5)]:
+            kmed = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed.fit(data, "L2", "KMedoidsLogfile")
+            kmed_adaptive = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed_adaptive.adaptive_batch = True
+            kmed_adaptive.fit(data, "L2", "KMedoidsLogfile")
+
+            self.assertLessEqual(totalLoss(data, kmed_adaptive.medoids),
+                                 1.01 * totalLoss(data, kmed.medoids))
+            self.assertGreater(kmed_adaptive.build_distance_calls, 0)
+            self.assertEqual(kmed_adaptive.distance_calls,
+                             kmed_adaptive.build_distance_calls + kmed_adaptive.swap_distance_calls)
+
+    def test_pilot_confidence(self):
+        '''
+        Test that the pilot picks one of its candidate scalings of the
+        confidences
+        '''
+        X = gaussianMixture(40)
+
+        kmed = KMedoids(n_medoids = 3, algorithm = "BanditPAM")
+        kmed.pilot_error_rate = 0.2
+        kmed.fit(X, "L2", "KMedoidsLogfile")
+
+        self.assertIn(kmed.build_confidence, [1, 10, 100, 1000, 10000])
+        self.assertEqual(kmed.swap_confidence, 10 * kmed.build_confidence)
+
+    def test_seed(self):
+        '''
+        Test that fits with equal seeds draw equal batches, and so find equal
+        medoids with an equal number of distance calls
+        '''
+        X = gaussianMixture(400)
+
+        kmed = KMedoids(n_medoids = 3, algorithm = "BanditPAM", seed = 7)
+        kmed.fit(X, "L2", "KMedoidsLogfile")
+        medoids = kmed.medoids
+        calls = kmed.distance_calls
+
+        kmed_again = KMedoids(n_medoids = 3, algorithm = "BanditPAM")
+        kmed_again.seed = 7
+        kmed_again.fit(X, "L2", "KMedoidsLogfile")
+        self.assertEqual(kmed_again.seed, 7)
+        self.assertTrue((kmed_again.medoids == medoids).all())
+        self.assertEqual(kmed_again.distance_calls, calls)
+
+    def test_thread_count_independence(self):
+        '''
+        Test that a seeded fit finds the same medoids with one thread as with
+        all of them
+        '''
+        X = gaussianMixture(400)
+
+        max_threads = get_max_threads()
+        results = []
+        for threads in [1, max_threads]:
+            set_num_threads(threads)
+            kmed = KMedoids(n_medoids = 3, algorithm = "BanditPAM", seed = 3)
+            kmed.fit(X, "L2", "KMedoidsLogfile")
+            results.append((kmed.build_medoids, kmed.medoids))
+        set_num_threads(max_threads)
+        self.assertTrue((results[0][0] == results[1][0]).all())
+        self.assertTrue((results[0][1] == results[1][1]).all())
+
+    def test_fit_many(self):
+        '''
+        Test that fitting many datasets at once matches fitting each one on
+        its own with the seed of its model
+        '''
+        datasets = [gaussianMixture(20 + i, seed = i) for i in range(12)]
+        k_values = [2 + i % 3 for i in range(12)]
+
+        kmed = KMedoids(algorithm = "BanditPAM", seed = 5)
+        models = kmed.fit_many(datasets, k_values, "L2")
+
+        self.assertEqual(len(models), len(datasets))
+        for X, k, model in zip(datasets, k_values, models):
+            self.assertEqual(model.n_medoids, k)
+            self.assertEqual(len(model.labels), len(X))
+            single = KMedoids(n_medoids = k, algorithm = "BanditPAM", seed = model.seed)
+            single.fit(X, "L2", "KMedoidsLogfile")
+            self.assertEqual(model.medoids.tolist(), single.medoids.tolist())
+
+    def test_fit_async(self):
+        '''
+        Test that background fits, fits on several threads and cancelled fits
+        all end with valid medoids
+        '''
+        X = gaussianMixture(400)
+
+        kmed = KMedoids(n_medoids = 3, algorithm = "BanditPAM", seed = 2)
+        kmed.fit(X, "L2", "KMedoidsLogfile")
+
+        kmed_async = KMedoids(n_medoids = 3, algorithm = "BanditPAM", seed = 2)
+        future = kmed_async.fit_async(X, "L2", "KMedoidsLogfile")
+        self.assertIs(future.result(timeout = 60), kmed_async)
+        self.assertEqual(kmed_async.medoids.tolist(), kmed.medoids.tolist())
+
+        async def fit_awaited():
+            return await asyncio.wrap_future(kmed_async.fit_async(X, "L2", "KMedoidsLogfile"))
+        self.assertIs(asyncio.run(fit_awaited()), kmed_async)
+
+        # the GIL is released while fitting, so fits on two threads overlap
+        models = [KMedoids(n_medoids = 3, algorithm = "BanditPAM", seed = 2) for _ in range(2)]
+        threads = [threading.Thread(target = model.fit, args = (X, "L2", "KMedoidsLogfile"))
+                   for model in models]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for model in models:
+            self.assertEqual(model.medoids.tolist(), kmed.medoids.tolist())
+
+        # a cancel made right after fit_async stops the first swap round
+        future = kmed_async.fit_async(X, "L2", "KMedoidsLogfile")
+        kmed_async.cancel()
+        future.result(timeout = 60)
+        self.assertEqual(kmed_async.stop_reason, "cancelled")
+        self.assertEqual(len(np.unique(kmed_async.medoids)), 3)
+
+    def test_loss(self):
+        '''
+        Test that the loss of a fitted model is the total distance of the
+        datapoints to their closest medoid
+        '''
+        for X, k in [(gaussianMixture(40), 3), (self.small_mnist, 5)]:
+            kmed = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed.fit(X, "L2", "KMedoidsLogfile")
+            calls = kmed.distance_calls
+
+            self.assertAlmostEqual(kmed.loss() / totalLoss(X, kmed.medoids), 1, places = 9)
+            self.assertEqual(kmed.distance_calls, calls)
+
+    def test_numa_mode(self):
+        '''
+        Test that NUMA placement of the data leaves the medoids unchanged
+        '''
+        for X, k in [(gaussianMixture(400), 3), (self.small_mnist, 5)]:
+            kmed = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed.fit(X, "L2", "KMedoidsLogfile")
+            kmed_numa = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed_numa.numa = True
+            kmed_numa.fit(X, "L2", "KMedoidsLogfile")
+
+            self.assertTrue(kmed_numa.numa)
+            self.assertEqual(kmed_numa.medoids.tolist(), kmed.medoids.tolist())
+
+    def test_sharded_fit(self):
+        '''
+        Test that a fit over shards served by local worker processes finds
+        medoids as good as a fit on the whole dataset
+        '''
+        mnist = self.mnist_70k.sample(n = 1000, random_state = 0).to_numpy().astype(np.float64)
+
+        for X, k in [(gaussianMixture(400), 3), (mnist, 5)]:
+            shards = np.array_split(np.random.permutation(X), 2)
+            X = np.vstack(shards)
+
+            kmed = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed.fit(X, "L2", "KMedoidsLogfile")
+
+            context = multiprocessing.get_context("spawn")
+            with tempfile.TemporaryDirectory() as tmp:
+                addresses = ["unix:" + os.path.join(tmp, "shard%d" % i) for i in range(len(shards))]
+                workers = [context.Process(target = serve, args = (shard, address))
+                           for shard, address in zip(shards, addresses)]
+                for worker in workers:
+                    worker.start()
+                kmed_sharded = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+                kmed_sharded.fit_sharded(addresses, "L2")
+                for worker in workers:
+                    worker.join()
+
+            D = medoidDistances(X, kmed_sharded.medoids)
+            self.assertEqual(kmed_sharded.labels.tolist(), D.argmin(axis = 1).tolist())
+            self.assertLess(D.min(axis = 1).sum(), kmed.loss() * 1.01)
+
+    def test_early_stopping(self):
+        '''
+        Test that a spent time budget or a loose loss tolerance stops the swap
+        step early, reports why, and still leaves valid medoids
+        '''
+        X = gaussianMixture(40)
+
+        kmed = KMedoids(n_medoids = 3, algorithm = "BanditPAM")
+        kmed.fit(X, "L2", "KMedoidsLogfile")
+        self.assertIn(kmed.stop_reason, ["converged", "max_iter"])
+
+        kmed.loss_tolerance = 1.0
+        kmed.fit(X, "L2", "KMedoidsLogfile")
+        self.assertIn(kmed.stop_reason, ["converged", "loss_tolerance"])
+
+        kmed.loss_tolerance = 0
+        kmed.time_budget = 1e-9
+        kmed.fit(X, "L2", "KMedoidsLogfile")
+        self.assertEqual(kmed.stop_reason, "time_budget")
+        self.assertEqual(len(np.unique(kmed.medoids)), 3)
+
+    def test_warm_start(self):
+        '''
+        Test that warm starts from the final medoids, given as indices or as
+        perturbed coordinates, skip build and stay at those medoids
+        '''
+        for X, k in [(gaussianMixture(40), 3), (self.small_mnist.astype(np.float64), 5)]:
+            kmed = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed.fit(X, "L2", "KMedoidsLogfile")
+            medoids = kmed.medoids.astype(int)
+
+            kmed_idx = KMedoids(algorithm = "BanditPAM")
+            kmed_idx.fit(X, "L2", "KMedoidsLogfile", medoids = medoids)
+            self.assertEqual(kmed_idx.build_medoids.tolist(), medoids.tolist())
+            self.assertEqual(sorted(kmed_idx.medoids.tolist()), sorted(medoids.tolist()))
+
+            kmed_coords = KMedoids(algorithm = "BanditPAM")
+            kmed_coords.fit(X, "L2", "KMedoidsLogfile", medoids = X[medoids] + 1e-6)
+            self.assertEqual(kmed_coords.build_medoids.tolist(), medoids.tolist())
+
+    def test_fit_path(self):
+        '''
+        Test that a sweep over k shares its build prefixes, matches the
+        losses of the medoids it returns, and swaps each k as a fit
+        warm-started from its build medoids with the seed of that k
+        '''
+        X = gaussianMixture(40, means = [[0, 0], [-5, 5], [5, 5], [0, 10]])
+
+        for data, k_values in [(X, [2, 3, 4]), (self.small_mnist.astype(np.float64), [5, 8, 10])]:
+            seeds = []
+            for seed in [1, 2]:
+                kmed = KMedoids(algorithm = "BanditPAM", seed = seed)
+                path = kmed.fit_path(data, "L2", k_values)
+
+                self.assertEqual([fit["k"] for fit in path], k_values)
+                for fit in path:
+                    self.assertAlmostEqual(fit["loss"] / totalLoss(data, fit["medoids"]), 1, places = 9)
+                    self.assertEqual(fit["build_medoids"].tolist(), path[-1]["build_medoids"][:fit["k"]].tolist())
+
+                    warm = KMedoids(algorithm = "BanditPAM", seed = fit["seed"])
+                    warm.fit(data, "L2", "KMedoidsLogfile", medoids = fit["build_medoids"].astype(int))
+                    self.assertEqual(warm.medoids.tolist(), fit["medoids"].tolist())
+                self.assertEqual(kmed.medoids.tolist(), path[-1]["medoids"].tolist())
+
+                again = KMedoids(algorithm = "BanditPAM", seed = seed).fit_path(data, "L2", k_values)
+                self.assertEqual([fit["medoids"].tolist() for fit in again],
+                                 [fit["medoids"].tolist() for fit in path])
+                seeds.append([fit["seed"] for fit in path])
+
+            # different seeds give every k a different stream
+            self.assertTrue(all(a != b for a, b in zip(*seeds)))
+
+    def test_mapped_input(self):
+        '''
+        Test that data clustered out of core from a raw file gives the same
+        medoids as the data in memory
+        '''
+        for X, k in [(gaussianMixture(40), 3), (self.small_mnist.astype(np.float64), 5)]:
+            kmed = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+            kmed.fit(X, "L2", "KMedoidsLogfile")
+
+            with tempfile.TemporaryDirectory() as tmp:
+                path = os.path.join(tmp, "X.bin")
+                X.tofile(path)
+                kmed_mapped = KMedoids(n_medoids = k, algorithm = "BanditPAM")
+                kmed_mapped.fit_mapped(path, X.shape[1], "L2")
+
+            self.assertEqual(kmed_mapped.medoids.tolist(), kmed.medoids.tolist())
+
+    def test_partial_fit(self):
+        '''
+        Test that a streamed batch of datapoints is labeled with the closest
+        of the current medoids
+        '''
+        X = gaussianMixture(40)
+        X_new = gaussianMixture(10, seed = 1)
+
+        kmed = KMedoids(n_medoids = 3, algorithm = "BanditPAM")
+        kmed.fit(X, "L2", "KMedoidsLogfile")
+        kmed.partial_fit(X_new)
+
+        X_all = np.vstack([X, X_new])
+        D = medoidDistances(X_all, kmed.medoids)
+        self.assertEqual(len(kmed.labels), len(X_all))
+        self.assertEqual(kmed.labels[len(X):].tolist(), D[len(X):].argmin(axis = 1).tolist())
+
     def test_edge_cases(self):
         '''
         Test BanditPAM algorithm on edge cases